@@ -11,12 +11,62 @@
 #include <r3d_math.h>
 #include <r3d_shape.h>
 #include <r3d_array.h>
+#include <r3d_cpu.h>
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Accelerator class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class Accelerator
+{
+public:
+    //=============================================================================================
+    // public methods.
+    //=============================================================================================
+
+    // 実行中のCPUで使える最も幅の広いカーネルで構築します.
+    static Accelerator* build(std::vector<Triangle*>& tris);
+
+    // build() が選択するカーネル名を取得します.
+    static const char* kernel_name();
+
+    // 量子化したノードを使う圧縮BVHで構築するかどうか設定します(AVX対応CPUのみ有効).
+    static void set_compressed(bool value);
+
+    // 空間分割ありのSAH(SBVH)で構築するかどうか設定します(AVX対応CPUのみ有効. 圧縮BVHになる).
+    // budget は三角形数に対して重複を許す参照数の割合で，0 なら使いません.
+    static void set_spatial_split(float budget);
+
+    virtual void dispose() = 0;
+    virtual bool intersect(const Ray& ray, HitRecord& record) const = 0;
+
+    // 三角形の移動に合わせてボックスを更新し，ルートの表面積で正規化したSAHコストを返します.
+    // 更新に対応していない場合は負値を返すので，作り直すこと.
+    virtual float refit()
+    { return -1.0f; }
+
+protected:
+    virtual ~Accelerator()
+    { /* DO_NOTHING */ }
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// TrianglePack structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 葉ノードの三角形を N 個ずつ SoA に並べたものです.
+// 余ったレーンは辺の長さが0なので必ず外れる.
+template<int N>
+struct alignas(N * 4) TrianglePack
+{
+    float   v0[3][N];   //!< 頂点0の位置.
+    float   e0[3][N];   //!< 辺(v1 - v0).
+    float   e1[3][N];   //!< 辺(v2 - v0).
+};
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // BVH class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-class BVH
+class BVH : public Accelerator
 {
     //=============================================================================================
     // list of friend classes and methods.
@@ -33,8 +83,9 @@ public:
     // public methods.
     //=============================================================================================
     static BVH* build(std::vector<Triangle*>& tris);
-    void dispose();
-    bool intersect(const Ray& ray, HitRecord& record) const;
+    void dispose() override;
+    bool intersect(const Ray& ray, HitRecord& record) const override;
+    float refit() override;
 
 private:
     BVH*                    m_node[2];
@@ -48,13 +99,15 @@ private:
     BVH( size_t count, Triangle** tris, const Box& box );
     ~BVH();
     static BVH* build_sub(size_t count, Triangle** tris);
+    bool intersect_sub(const Ray& ray, HitRecord& record) const;
+    Box refit_sub(float& cost);
 };
 
 #if defined(ENABLE_SSE2)
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // BVH4 class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-class BVH4
+class BVH4 : public Accelerator
 {
     //=============================================================================================
     // list of friend classes and methods.
@@ -71,8 +124,9 @@ public:
     // public methods.
     //=============================================================================================
     static BVH4* build(std::vector<Triangle*>& tris);
-    void dispose();
-    bool intersect(const Ray& ray, HitRecord& record) const;
+    void dispose() override;
+    bool intersect(const Ray& ray, HitRecord& record) const override;
+    float refit() override;
 
 private:
     //=============================================================================================
@@ -89,7 +143,8 @@ private:
     BVH4( BVH4* node0, BVH4* node1, BVH4* node2, BVH4* node3, const Box4& box );
     BVH4( size_t count, Triangle** tris, const Box& box);
     ~BVH4();
-    bool intersect_sub(const Ray4& ray, HitRecord& record) const;
+    bool intersect_sub(const Ray& ray, const Ray4& ray4, HitRecord& record) const;
+    Box refit_sub(float& cost);
     void* operator new      (size_t size);
     void* operator new[]    (size_t size);
     void  operator delete   (void* ptr);
@@ -101,7 +156,7 @@ private:
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // BVH8 class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-class BVH8
+class BVH8 : public Accelerator
 {
     //=============================================================================================
     // list of friend classes and methods.
@@ -118,8 +173,9 @@ public:
     // public methods.
     //=============================================================================================
     static BVH8* build(std::vector<Triangle*>& tris);
-    void dispose();
-    bool intersect(const Ray& ray, HitRecord& record) const;
+    void dispose() override;
+    bool intersect(const Ray& ray, HitRecord& record) const override;
+    float refit() override;
 
 private:
     //=============================================================================================
@@ -128,6 +184,9 @@ private:
     BVH8*                   m_node[8];
     Box8                    m_box;
     ref_array<Triangle*>    m_tris;
+    TrianglePack<8>*        m_packs;        //!< 葉ノードの三角形(8個ずつ).
+    size_t                  m_pack_count;   //!< パック数.
+    bool                    m_fma;          //!< AVX2 + FMA 版で走査するか(ルートのみ有効).
 
     //============================================================================================
     // private methods.
@@ -137,7 +196,10 @@ private:
          BVH8* n4, BVH8* n5, BVH8* n6, BVH8* n7, const Box8& box );
     BVH8( size_t count, Triangle** tris, const Box& box);
     ~BVH8();
-    bool intersect_sub(const Ray8& ray, HitRecord& record) const;
+    bool intersect_sub(const Ray& ray, const Ray8& ray8, HitRecord& record) const;
+    bool intersect_sub_fma(const Ray& ray, const Ray8& ray8, HitRecord& record) const;
+    bool intersect_leaf(const Ray& ray, const Ray8& ray8, HitRecord& record) const;
+    Box refit_sub(float& cost);
     void* operator new      (size_t size);
     void* operator new[]    (size_t size);
     void  operator delete   (void* ptr);
@@ -145,3 +207,192 @@ private:
 };
 #endif//defined(ENABLE_AVX)
 
+#if defined(ENABLE_AVX)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CNode8 structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 8個の子ノードのボックスを，親のボックスを基準に8bitで量子化して持ちます.
+// 子ノードのボックス = origin + q * 2^exponent (外側に丸めてあるので元のボックスを必ず含む).
+struct alignas(32) CNode8
+{
+    float       origin[3];      //!< 量子化の基準点(親のボックスの最小値).
+    int8_t      exponent[3];    //!< 量子化の刻み幅(2の冪乗)の指数.
+    uint8_t     count;          //!< 子ノード数.
+    uint8_t     qmin[3][8];     //!< 量子化した子ノードのボックス最小値.
+    uint8_t     qmax[3][8];     //!< 量子化した子ノードのボックス最大値.
+    uint32_t    child[8];       //!< 子ノード番号(最上位ビットが立っていれば葉番号).
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CBVH8 class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 圧縮BVH8です. ノードを配列に詰めて持ち，1ノード96byteに抑える.
+class CBVH8 : public Accelerator
+{
+    //=============================================================================================
+    // list of friend classes and methods.
+    //=============================================================================================
+    /* NOTHING */
+
+public:
+    //=============================================================================================
+    // public variables.
+    //=============================================================================================
+    struct BuildNode;   // 構築中のノード.
+    struct BuildLeaf;   // 構築中の葉.
+
+    //=============================================================================================
+    // public methods.
+    //=============================================================================================
+    static CBVH8* build(std::vector<Triangle*>& tris);
+    static CBVH8* build_spatial(std::vector<Triangle*>& tris, float budget);
+    void dispose() override;
+    bool intersect(const Ray& ray, HitRecord& record) const override;
+
+private:
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Leaf structure
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    struct Leaf
+    {
+        uint32_t    offset;     //!< 先頭の三角形番号.
+        uint32_t    count;      //!< 三角形数.
+        uint32_t    pack;       //!< 先頭のパック番号.
+    };
+
+    //=============================================================================================
+    // private variables.
+    //=============================================================================================
+    CNode8*             m_nodes;
+    size_t              m_node_count;
+    Leaf*               m_leaves;
+    size_t              m_leaf_count;
+    TrianglePack<8>*    m_packs;
+    size_t              m_pack_count;
+    Triangle**          m_tris;
+    std::vector<Triangle*>  m_refs;     //!< SBVHで重複した参照(SBVHのみ).
+
+    //============================================================================================
+    // private methods.
+    //=============================================================================================
+    CBVH8();
+    ~CBVH8();
+    void setup(Triangle** tris, const std::vector<BuildNode>& nodes, const std::vector<BuildLeaf>& leaves);
+    bool intersect_sub(const Ray& ray, const Ray8& ray8, uint32_t index, HitRecord& record) const;
+    bool intersect_leaf(const Ray& ray, const Ray8& ray8, const Leaf& leaf, HitRecord& record) const;
+};
+#endif//defined(ENABLE_AVX)
+
+#if defined(ENABLE_AVX512)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// BVH16 class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class BVH16 : public Accelerator
+{
+    //=============================================================================================
+    // list of friend classes and methods.
+    //=============================================================================================
+    /* NOTHING */
+
+public:
+    //=============================================================================================
+    // public variables.
+    //=============================================================================================
+    /* NOTHING */
+
+    //=============================================================================================
+    // public methods.
+    //=============================================================================================
+    static BVH16* build(std::vector<Triangle*>& tris);
+    void dispose() override;
+    bool intersect(const Ray& ray, HitRecord& record) const override;
+    float refit() override;
+
+private:
+    //=============================================================================================
+    // private variables.
+    //=============================================================================================
+    BVH16*                  m_node[16];
+    Box16                   m_box;          //!< 子ノードのボックス.
+    uint32_t                m_mask;         //!< 有効な子ノードのビットマスク.
+    ref_array<Triangle*>    m_tris;
+    TrianglePack<16>*       m_packs;        //!< 葉ノードの三角形(16個ずつ).
+    size_t                  m_pack_count;   //!< パック数.
+
+    //============================================================================================
+    // private methods.
+    //=============================================================================================
+    static BVH16* build_sub(size_t count, Triangle** tris);
+    BVH16( int count, BVH16** nodes, const Box* boxes );
+    BVH16( size_t count, Triangle** tris );
+    ~BVH16();
+    bool intersect_sub(const Ray& ray, const Ray16& ray16, HitRecord& record) const;
+    Box refit_sub(float& cost);
+    void* operator new      (size_t size);
+    void* operator new[]    (size_t size);
+    void  operator delete   (void* ptr);
+    void  operator delete[] (void* ptr);
+};
+#endif//defined(ENABLE_AVX512)
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// ShapeBVH class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// シーン全体の形状(球・メッシュ・インスタンス)をまとめる上位BVHです.
+// 形状の移動後は refit() でボックスだけ更新し，品質が落ちたら作り直す.
+class ShapeBVH
+{
+    //=============================================================================================
+    // list of friend classes and methods.
+    //=============================================================================================
+    /* NOTHING */
+
+public:
+    //=============================================================================================
+    // public variables.
+    //=============================================================================================
+    /* NOTHING */
+
+    //=============================================================================================
+    // public methods.
+    //=============================================================================================
+    ShapeBVH();
+    ~ShapeBVH();
+    void build(const std::vector<Shape*>& shapes);
+    void clear();
+    bool intersect(const Ray& ray, HitRecord& record) const;
+
+    // 形状のボックスを更新します.
+    // SAHコストが構築時の threshold 倍を超えて劣化した場合は再構築し，true を返します.
+    bool refit(float threshold = 1.5f);
+
+    // ルートの表面積で正規化したSAHコストを取得します.
+    float cost() const
+    { return m_cost; }
+
+private:
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Node structure
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    struct Node
+    {
+        Box         box;        //!< ノードのボックス.
+        uint32_t    index;      //!< 葉なら先頭の形状番号，そうでなければ右の子ノード番号(左は直後).
+        uint32_t    count;      //!< 形状数(0 なら内部ノード).
+    };
+
+    //=============================================================================================
+    // private variables.
+    //=============================================================================================
+    std::vector<Node>   m_nodes;
+    std::vector<Shape*> m_shapes;       //!< 葉の順に並べた形状.
+    std::vector<Box>    m_boxes;        //!< 形状のボックス(m_shapes と同じ並び).
+    float               m_cost;         //!< 現在のSAHコスト.
+    float               m_base_cost;    //!< 構築時のSAHコスト.
+
+    //=============================================================================================
+    // private methods.
+    //=============================================================================================
+    uint32_t build_sub(uint32_t offset, uint32_t count);
+    float update();
+};
@@ -9,6 +9,7 @@
 // Includes
 //-------------------------------------------------------------------------------------------------
 #include <r3d_math.h>
+#include <r3d_sampler.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -52,6 +53,17 @@ public:
         return make_ray(p, normalize(d));
     }
 
+    inline Ray emit(int x, int y, Sampler& sampler) const
+    {
+        // ピクセル内でジッタリング.
+        auto jitter = sampler.get2d();
+        return emit(float(x) + jitter.x, float(y) + jitter.y);
+    }
+
+    // ビュー空間での深度を求めます.
+    inline float depth(const Vector3& p) const
+    { return dot(p - pos, axis_z); }
+
 private:
     Vector3 pos;        //!< 位置座標です.
     Vector3 axis_x;     //!< X軸
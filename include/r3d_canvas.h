@@ -9,8 +9,56 @@
 // Includes
 //-------------------------------------------------------------------------------------------------
 #include <r3d_math.h>
+#include <cstdio>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// AOV structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct AOV
+{
+    Vector3     albedo  = Vector3(0.0f, 0.0f, 0.0f);    // 最初の衝突点のアルベド.
+    Vector3     normal  = Vector3(0.0f, 0.0f, 0.0f);    // 最初の衝突点のシェーディング法線.
+    float       depth   = 0.0f;                         // 最初の衝突点のビュー空間での深度.
+};
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// TileBuffer class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class TileBuffer
+{
+public:
+    TileBuffer();
+
+    void reset  (int x, int y, int w, int h, bool aov);
+    void add    (int x, int y, const Vector3& value);
+    void add    (int x, int y, const Vector3& value, const AOV& aov);
+    void add_time(int x, int y, float sec);
+    bool empty  () const;
+
+private:
+    friend class Canvas;
+
+    int                     m_x;        // タイルの左上X座標.
+    int                     m_y;        // タイルの左上Y座標.
+    int                     m_w;        // タイルの横幅.
+    int                     m_h;        // タイルの縦幅.
+    bool                    m_dirty;    // 加算されたかどうか.
+    std::vector<Vector3>    m_pixels;   // 放射輝度の総和.
+    std::vector<float>      m_sum2;     // 輝度の2乗和.
+    std::vector<uint32_t>   m_count;    // サンプル数.
+    bool                    m_aov;      // AOVを記録するかどうか.
+    std::vector<Vector3>    m_albedo;   // アルベドの総和.
+    std::vector<Vector3>    m_normal;   // 法線の総和.
+    std::vector<float>      m_depth;    // 深度の総和.
+    std::vector<float>      m_time;     // 処理時間の総和[sec].
+};
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -19,31 +67,133 @@
 class Canvas
 {
 public:
+    enum Filter
+    {
+        FilterNone,         //!< フィルタ無し.
+        FilterMedian,       //!< 3x3 中央値フィルタ.
+        FilterATrous,       //!< エッジ保存 à-trous ウェーブレットフィルタ.
+    };
+
+    enum Format
+    {
+        FormatBMP,          //!< 8bit BMP.
+        FormatPNG,          //!< 8bit PNG.
+        FormatHDR,          //!< Radiance HDR (トーンマップ無し).
+        FormatPFM,          //!< Portable Float Map (トーンマップ無し).
+    };
+
     Canvas();
     ~Canvas();
 
-    void            resize  (int w, int h);
-    Vector3&        at      (int x, int y);
-    const Vector3&  at      (int x, int y) const;
-    const Vector3*  data    () const;
-    void            add     (int x, int y, const Vector3& value);
+    void            resize      (int w, int h);
+    Vector3&        at          (int x, int y);
+    const Vector3&  at          (int x, int y) const;
+    const Vector3*  data        () const;
+    void            commit      (const TileBuffer& tile);
+    uint32_t        samples     (int x, int y) const;
+    float           error       (int x, int y, int w, int h) const;
+    float           average_samples() const;
+    void            set_filter  (Filter filter);
+    Filter          filter      () const;
+
+    // キャプチャー番号で書き出す際のファイル形式を設定します.
+    void            set_format  (Format format);
+    Format          format      () const;
+
+    // AOVの記録を有効にします. resize() より前に呼び出してください.
+    void            enable_aov  (bool enable);
+    bool            has_aov     () const;
 
     bool write(const char* filename);
     bool write(int counter);
 
+    // 累積バッファをそのまま保存・復元します.
+    bool save(FILE* fp) const;
+    bool load(FILE* fp);
+
+    // 別のキャンバスの累積結果を加算します.
+    bool merge(const Canvas& other);
+
+    // スナップショットを取り，バックグラウンドで書き出します.
+    void write_async(int counter);
+
+    // 非同期書き出しの完了を待機します.
+    void flush();
+
+    // 近似関数とSIMDを使わず，標準ライブラリの関数で出力処理を行います(検証用の参照実装).
+    void            set_exact   (bool exact);
+    bool            exact       () const;
+
+    // 出力時の画像処理です. 画素数は resize() で設定したサイズと一致している必要があります.
+    void log_average        (const std::vector<Vector3>& pixels, float& aveLw, float& maxLw) const;
+    void tonemap_none       (std::vector<Vector3>& pixels) const;
+    void tonemap_reinhard   (std::vector<Vector3>& pixels) const;
+    void tonemap_aces       (std::vector<Vector3>& pixels) const;
+    void gamma_correction   (std::vector<Vector3>& pixels) const;
+    void srgb_correction    (std::vector<Vector3>& pixels) const;
+    void quantize           (const std::vector<Vector3>& pixels, std::vector<uint8_t>& output) const;
+
 private:
+    struct Accum
+    {
+        float       sum2;       // 輝度の2乗和.
+        uint32_t    count;      // サンプル数.
+    };
+
+    enum AOVType
+    {
+        AOV_Albedo,
+        AOV_Normal,
+        AOV_Depth,
+        AOV_Samples,
+        AOV_Time,
+        AOV_Count,
+    };
+
+    struct Snapshot
+    {
+        int                     counter;            // キャプチャー番号.
+        double                  copy_ms;            // スナップショットのコピーにかかった時間[ms].
+        std::vector<Vector3>    pixels;             // 正規化済みの放射輝度.
+        std::vector<Vector3>    aovs[AOV_Count];    // 正規化済みのAOV.
+        std::vector<uint8_t>    output;             // 8bit量子化後の出力(PNGのみ使用).
+    };
+
     int                     m_w;
     int                     m_h;
-    std::vector<Vector3>    m_pixels;
-    std::vector<Vector3>    m_temps;
-    std::vector<uint8_t>    m_output;
+    Filter                  m_filter;
+    Format                  m_format;
+    bool                    m_aov;
+    bool                    m_exact;    // 参照実装で出力するかどうか.
+    std::vector<Vector3>    m_pixels;   // 放射輝度の総和.
+    std::vector<Accum>      m_accums;
+    std::vector<Vector3>    m_albedo;   // アルベドの総和.
+    std::vector<Vector3>    m_normal;   // 法線の総和.
+    std::vector<float>      m_depth;    // 深度の総和.
+    std::vector<float>      m_time;     // 処理時間の総和[sec].
+    Snapshot                m_capture;  // 同期書き出し用.
+
+    // ワーカースレッドは担当タイルが重ならないので共有ロックで同時に書き込み，
+    // スナップショットを取る時だけ排他ロックを取る.
+    mutable std::shared_timed_mutex m_mutex;
+
+    // 非同期書き出し(ダブルバッファ).
+    Snapshot                m_snapshots[2];
+    int                     m_write_index;  // 書き出し中のスナップショット番号(-1で無し).
+    int                     m_ready_index;  // 書き出し待ちのスナップショット番号(-1で無し).
+    bool                    m_writer_exit;
+    std::thread             m_writer;
+    std::mutex              m_writer_mutex;
+    std::condition_variable m_writer_cond;
 
-    void tonemap_none();
-    void tonemap_reinhard();
-    void tonemap_aces();
-    void gamma_correction();
-    void srgb_correction();
+    void resolve(Snapshot& snapshot) const;
+    bool process(const char* filename, Snapshot& snapshot) const;
+    bool write_ldr(const char* filename, const std::vector<Vector3>& pixels, std::vector<uint8_t>& output) const;
+    bool write_hdr(const char* filename, const std::vector<Vector3>& pixels) const;
+    void make_path(char* path, size_t size, int counter) const;
+    void writer_main();
 
-    void median_filter();
+    void median_filter      (std::vector<Vector3>& pixels) const;
+    void atrous_filter      (std::vector<Vector3>& pixels, const Vector3* albedo, const Vector3* normal) const;
 };
 
@@ -0,0 +1,64 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_checkpoint.h
+// Desc : Checkpoint Module.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+#include <r3d_canvas.h>
+#include <vector>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Checkpoint class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class Checkpoint
+{
+public:
+    static constexpr uint32_t kMagic   = 0x43443352;    // 'R3DC'
+    static constexpr uint32_t kVersion = 2;
+
+    enum Flag
+    {
+        FlagDeterministic   = 0x1,
+        FlagAdaptive        = 0x2,
+        FlagAOV             = 0x4,
+    };
+
+    struct Header
+    {
+        uint32_t    magic;          // マジックナンバー.
+        uint32_t    version;        // ファイルバージョン.
+        int32_t     width;          // 画像の横幅.
+        int32_t     height;         // 画像の縦幅.
+        int32_t     samples;        // シーンのサンプル数.
+        uint32_t    sampler;        // サンプラーの種類.
+        uint32_t    flags;          // 描画モード.
+        uint32_t    next_sample;    // 次に描画するサンプル番号(全画面共通).
+        uint32_t    capture;        // 次のキャプチャー番号.
+        uint32_t    tile_count;     // タイル数(適応サンプリング時のみ).
+        uint32_t    random_count;   // 乱数状態の数.
+        uint32_t    shard;          // 分散描画時の担当番号.
+        uint32_t    shard_count;    // 分散描画時の分割数.
+    };
+
+    Header                  header;
+    std::vector<int32_t>    tile_samples;   // タイル毎の割り当て済みサンプル数.
+    std::vector<Random>     randoms;        // スレッド毎の乱数状態.
+
+    Checkpoint();
+
+    // 描画設定が一致するかどうか?
+    bool is_compatible(const Header& value) const;
+
+    // 一時ファイルに書き出してから置き換えるので，途中で強制終了されても壊れない.
+    bool save(const char* path, const Canvas& canvas) const;
+    bool load(const char* path, Canvas& canvas);
+
+    // ヘッダーだけを読み込みます.
+    static bool read_header(const char* path, Header& header);
+};
@@ -0,0 +1,40 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_cpu.h
+// Desc : CPU Feature Detection.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CpuInfo class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class CpuInfo
+{
+public:
+    // 上位の命令セットは下位の命令セットを全て含む.
+    enum Isa
+    {
+        IsaScalar,      //!< SIMDなし.
+        IsaSSE2,        //!< SSE2.
+        IsaAVX,         //!< AVX.
+        IsaAVX2,        //!< AVX2 + FMA3.
+        IsaAVX512,      //!< AVX-512F.
+        Isa_Count,
+    };
+
+    // CPUとOSが対応している命令セットを取得します.
+    static Isa detect();
+
+    // 実際に使用する命令セットを取得します.
+    static Isa isa();
+
+    // 使用できる命令セットかどうかチェックします.
+    static bool has(Isa isa);
+
+    // 使用する命令セットの上限を設定します(計測・検証用).
+    static void set_limit(Isa isa);
+
+    static const char* name(Isa isa);
+    static bool parse(const char* name, Isa& isa);
+};
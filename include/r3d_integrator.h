@@ -0,0 +1,21 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_integrator.h
+// Desc : Path Tracing Integrator.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+#include <r3d_sampler.h>
+#include <r3d_scene.h>
+#include <r3d_canvas.h>
+
+
+//-------------------------------------------------------------------------------------------------
+//      放射輝度を求めます.
+//      aov が nullptr でなければ最初の衝突点の情報を記録します.
+//-------------------------------------------------------------------------------------------------
+Vector3 radiance(const Ray& input_ray, Sampler& sampler, const Scene* scene, AOV* aov);
@@ -9,7 +9,9 @@
 // Includes
 //-------------------------------------------------------------------------------------------------
 #include <r3d_math.h>
-#include <new>
+#include <r3d_sampler.h>
+#include <cassert>
+#include <cstring>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -21,16 +23,16 @@ struct ShadingArg
     Vector3     output;         // 出射方向         [out].
     Vector3     normal;         // 法線ベクトル      [in].
     Vector2     uv;             // テクスチャ座標    [in].
-    Random*     random;         // 乱数             [in, out].
+    Sampler*    sampler;        // サンプラー        [in, out].
     float       pdf;            // BRDFの確率密度   [out].
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Material structure
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-struct Material
+struct alignas(32) Material
 {
-    enum Type
+    enum Type : uint16_t
     {
         None,
         Lambert,
@@ -41,262 +43,242 @@ struct Material
 
     static constexpr float kThresholdEps = 1e-3f;
 
-    virtual Type    type     () const = 0;
-    virtual bool    is_delta () const = 0;
-    virtual float   threshold() const = 0;
-    virtual Vector3 emissive () const = 0;
-    virtual Vector3 shade    (ShadingArg& arg) const = 0;
+    Vector3     albedo;     //!< 反射率.
+    float       param;      //!< 屈折率(Refract) または 鏡面指数(Phong).
+    Vector3     emissive;   //!< 自己発光.
+    uint16_t    type;       //!< マテリアルタイプ.
+    uint16_t    delta;      //!< デルタ関数を持つBRDFかどうか.
+
+    inline bool is_delta() const
+    { return delta != 0; }
+
+    inline float threshold() const
+    { return max(max(albedo.x, max(albedo.y, albedo.z)), kThresholdEps); }
 };
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
-// Lambert class
-///////////////////////////////////////////////////////////////////////////////////////////////////
-class Lambert : public Material
+static_assert(sizeof(Material) == 32, "Material must fit in half of a cache line.");
+
+//-------------------------------------------------------------------------------------------------
+//      Lambertを評価します.
+//-------------------------------------------------------------------------------------------------
+inline Vector3 shade_lambert(const Material& mat, ShadingArg& arg)
 {
-public:
-    static Material* create(const Vector3& albedo)
-    { return create(albedo, Vector3(0.0f, 0.0f, 0.0f)); }
+    // 物体からのレイの入出を考慮した法線ベクトル.
+    auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
 
-    static Material* create(const Vector3& albedo, const Vector3& emissive)
-    {
-        auto instance = new (std::nothrow) Lambert();
-        instance->m_albedo    = albedo;
-        instance->m_emissive  = emissive;
-        instance->m_threshold = max(albedo.x, max(albedo.y, albedo.z));
-        instance->m_threshold = max(instance->m_threshold, kThresholdEps);
-        return instance;
-    }
+    // 基底ベクトル.
+    Onb onb;
+    onb.FromW(normal);
 
-    Type type() const override
-    { return Type::Lambert; }
+    const auto u  = arg.sampler->get2d();
+    const auto r1 = F_2PI * u.x;
+    const auto r2 = u.y;
+    const auto r2s = sqrt(r2);
 
-    bool is_delta() const override
-    { return false; }
+    // 出射方向.
+    arg.output = normalize(onb.u * cos(r1) * r2s + onb.v * sin(r1) * r2s + onb.w * sqrt(1.0f - r2));
 
-    float threshold() const override
-    { return m_threshold; }
+    const auto cosine = dot(normal, arg.output);
 
-    Vector3 emissive() const override
-    { return m_emissive; }
+    // 確率密度.
+    arg.pdf = cosine / F_PI;
 
-    Vector3 shade(ShadingArg& arg) const override
-    {
-        // 物体からのレイの入出を考慮した法線ベクトル.
-        auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
+    return mat.albedo;
+}
 
-        // 基底ベクトル.
-        Onb onb;
-        onb.FromW(normal);
+//-------------------------------------------------------------------------------------------------
+//      Mirrorを評価します.
+//-------------------------------------------------------------------------------------------------
+inline Vector3 shade_mirror(const Material& mat, ShadingArg& arg)
+{
+    // 物体からのレイの入出を考慮した法線ベクトル.
+    auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
 
-        const auto r1 = F_2PI * arg.random->get_as_float();
-        const auto r2 = arg.random->get_as_float();
-        const auto r2s = sqrt(r2);
+    arg.output = normalize(reflect(arg.input, normal));
+    arg.pdf    = 1.0f;
+    return mat.albedo;
+}
 
-        // 出射方向.
-        arg.output = normalize(onb.u * cos(r1) * r2s + onb.v * sin(r1) * r2s + onb.w * sqrt(1.0f - r2));
+//-------------------------------------------------------------------------------------------------
+//      Refractを評価します.
+//-------------------------------------------------------------------------------------------------
+inline Vector3 shade_refract(const Material& mat, ShadingArg& arg)
+{
+    arg.pdf = 1.0f;
 
-        const auto cosine = dot(normal, arg.output);
+    // 物体からのレイの入出を考慮した法線ベクトル.
+    auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
+    auto into   = dot(arg.normal, normal) > 0.0f;
 
-        // 確率密度.
-        arg.pdf = cosine / F_PI;
+    const auto nc = 1.0f;
+    const auto nt = mat.param;
+    const auto nnt = (into) ? (nc / nt) : (nt / nc);
+    const auto ddn = dot(arg.input, normal);
+    const auto cos2t = 1.0f - nnt * nnt * (1.0f - ddn * ddn);
 
-        return m_albedo;
+    if (cos2t <= 0.0f)
+    {
+        arg.output = reflect(arg.input, arg.normal);
+        return mat.albedo;
     }
 
-private:
-    Vector3 m_albedo;
-    Vector3 m_emissive;
-    float   m_threshold;
-};
+    auto dir = normalize(arg.input * nnt - arg.normal * ((into) ? 1.0f : -1.0f) * (ddn * nnt + sqrt(cos2t)));
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
-// Mirror class
-///////////////////////////////////////////////////////////////////////////////////////////////////
-class Mirror : public Material
-{
-public:
-    static Mirror* create(const Vector3& albedo)
-    { return create(albedo, Vector3(0.0f, 0.0f, 0.0f)); }
+    const auto a = nt - nc;
+    const auto b = nt + nc;
+    const auto R0 = (a * a) / (b * b);
+    const auto c = 1.0f - ((into) ? -ddn : dot(dir, arg.normal));
+    const auto Re = R0 + (1.0f - R0) * pow(c, 5.0f);
+    const auto Tr = 1.0f - Re;
+    const auto prob = 0.25f + 0.5f * Re;
 
-    static Mirror* create(const Vector3& albedo, const Vector3& emissive)
+    if (arg.sampler->get1d() < prob)
+    {
+        arg.output = reflect(arg.input, arg.normal);
+        return mat.albedo * Re / prob;
+    }
+    else
     {
-        auto instance = new (std::nothrow) Mirror();
-        instance->m_albedo   = albedo;
-        instance->m_emissive = emissive;
-        instance->m_threshold = max(albedo.x, max(albedo.y, albedo.z));
-        instance->m_threshold = max(instance->m_threshold, kThresholdEps);
-        return instance;
+        arg.output = dir;
+        return mat.albedo * Tr / (1.0f - prob);
     }
+}
 
-    Type type() const override
-    { return Type::Mirror; }
+//-------------------------------------------------------------------------------------------------
+//      Phongを評価します.
+//-------------------------------------------------------------------------------------------------
+inline Vector3 shade_phong(const Material& mat, ShadingArg& arg)
+{
+    // 物体からのレイの入出を考慮した法線ベクトル.
+    auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
 
-    bool is_delta() const override
-    { return true; }
+    const auto shininess = mat.param;
+    const auto u = arg.sampler->get2d();
+    const auto phi = F_2PI * u.x;
+    const auto cos_theta = pow( 1.0f - u.y, 1.0f / (shininess + 1.0f) );
+    const auto sin_theta = sqrt( 1.0f - (cos_theta * cos_theta) );
+    const auto x = cos( phi ) * sin_theta;
+    const auto y = sin( phi ) * sin_theta;
+    const auto z = cos_theta;
 
-    float threshold() const override
-    { return m_threshold; }
+    auto w = reflect(arg.input, normal);
+    Onb onb;
+    onb.FromW(w);
 
-    Vector3 emissive() const override
-    { return m_emissive; }
+    auto dir = normalize(onb.u * x + onb.v * y + onb.w * z);
+    auto cosine = dot(dir, normal);
 
-    Vector3 shade(ShadingArg& arg) const override
-    {
-        // 物体からのレイの入出を考慮した法線ベクトル.
-        auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
+    arg.output = dir;
+    arg.pdf    = ((shininess + 1.0f) / F_2PI) * cosine;
 
-        arg.output = normalize(reflect(arg.input, normal));
-        arg.pdf    = 1.0f;
-        return m_albedo;
-    }
+    return mat.albedo * cosine * ((shininess + 2.0f) / (shininess + 1.0f));
+}
 
-private:
-    Vector3 m_albedo;
-    Vector3 m_emissive;
-    float   m_threshold;
-};
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-// Refract class
+// MaterialTable class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-class Refract : public Material
+class MaterialTable
 {
 public:
-    static Refract* create(const Vector3& albedo, float ior)
-    { return create(albedo, ior, Vector3(0.0f, 0.0f, 0.0f)); }
+    static constexpr uint16_t kDefaultId   = 0;         //!< 既定マテリアル(黒)のIDです.
+    static constexpr uint32_t kMaxCount    = 0x10000;   //!< 登録可能な最大数です.
+
+    MaterialTable()
+    { clear(); }
 
-    static Refract* create(const Vector3& albedo, float ior, const Vector3& emissive)
+    ~MaterialTable()
     {
-        auto instance = new (std::nothrow) Refract();
-        instance->m_albedo    = albedo;
-        instance->m_emissive  = emissive;
-        instance->m_ior       = ior;
-        instance->m_threshold = max(albedo.x, max(albedo.y, albedo.z));
-        instance->m_threshold = max(instance->m_threshold, kThresholdEps);
-        return instance;
+        if (m_data != nullptr)
+        {
+            _aligned_free(m_data);
+            m_data = nullptr;
+        }
     }
 
-    Type type() const override
-    { return Type::Refract; }
+    void clear()
+    {
+        m_count = 0;
+        add(Material::None, Vector3(0.0f, 0.0f, 0.0f), Vector3(0.0f, 0.0f, 0.0f), 0.0f);
+    }
 
-    bool is_delta() const override
-    { return true; }
+    uint16_t add_lambert(const Vector3& albedo, const Vector3& emissive)
+    { return add(Material::Lambert, albedo, emissive, 0.0f); }
 
-    float threshold() const override
-    { return m_threshold; }
+    uint16_t add_mirror(const Vector3& albedo, const Vector3& emissive)
+    { return add(Material::Mirror, albedo, emissive, 0.0f); }
 
-    Vector3 emissive() const override
-    { return m_emissive; }
+    uint16_t add_refract(const Vector3& albedo, float ior, const Vector3& emissive)
+    { return add(Material::Refract, albedo, emissive, ior); }
 
-    Vector3 shade(ShadingArg& arg) const override
-    {
-        arg.pdf = 1.0f;
+    uint16_t add_phong(const Vector3& albedo, float shininess, const Vector3& emissive)
+    { return add(Material::Phong, albedo, emissive, shininess); }
 
-        // 物体からのレイの入出を考慮した法線ベクトル.
-        auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
-        auto into   = dot(arg.normal, normal) > 0.0f;
+    size_t size() const
+    { return m_count; }
 
-        const auto nc = 1.0f;
-        const auto nt = m_ior;
-        const auto nnt = (into) ? (nc / nt) : (nt / nc);
-        const auto ddn = dot(arg.input, normal);
-        const auto cos2t = 1.0f - nnt * nnt * (1.0f - ddn * ddn);
+    const Material& operator[](uint16_t id) const
+    {
+        assert(id < m_count);
+        return m_data[id];
+    }
 
-        if (cos2t <= 0.0f)
+    // 分岐でディスパッチするので，コンパイラがシェーディング処理をインライン展開できる.
+    Vector3 shade(uint16_t id, ShadingArg& arg) const
+    {
+        const auto& mat = (*this)[id];
+        switch(mat.type)
         {
-            arg.output = reflect(arg.input, arg.normal);
-            return m_albedo;
+        case Material::Lambert: return shade_lambert(mat, arg);
+        case Material::Mirror:  return shade_mirror (mat, arg);
+        case Material::Refract: return shade_refract(mat, arg);
+        case Material::Phong:   return shade_phong  (mat, arg);
+        default:
+            break;
         }
 
-        auto dir = normalize(arg.input * nnt - arg.normal * ((into) ? 1.0f : -1.0f) * (ddn * nnt + sqrt(cos2t)));
-
-        const auto a = nt - nc;
-        const auto b = nt + nc;
-        const auto R0 = (a * a) / (b * b);
-        const auto c = 1.0f - ((into) ? -ddn : dot(dir, arg.normal));
-        const auto Re = R0 + (1.0f - R0) * pow(c, 5.0f);
-        const auto Tr = 1.0f - Re;
-        const auto prob = 0.25f + 0.5f * Re;
-
-        if (arg.random->get_as_float() < prob)
-        {
-            arg.output = reflect(arg.input, arg.normal);
-            return m_albedo * Re / prob;
-        }
-        else
-        {
-            arg.output = dir;
-            return m_albedo * Tr / (1.0f - prob);
-        }
+        arg.output = arg.input;
+        arg.pdf    = 1.0f;
+        return Vector3(0.0f, 0.0f, 0.0f);
     }
 
 private:
-    Vector3 m_albedo;
-    Vector3 m_emissive;
-    float   m_ior;
-    float   m_threshold;
-};
-
-///////////////////////////////////////////////////////////////////////////////////////////////////
-// Phong class
-///////////////////////////////////////////////////////////////////////////////////////////////////
-class Phong : public Material
-{
-public:
-    static Phong* create(const Vector3& albedo, float shininess)
-    { return create(albedo, shininess, Vector3(0.0f, 0.0f, 0.0f)); }
-
-    static Phong* create(const Vector3& albedo, float shininess, const Vector3& emissive)
-    {
-        auto instance = new (std::nothrow) Phong();
-        instance->m_albedo    = albedo;
-        instance->m_emissive  = emissive;
-        instance->m_shininess = shininess;
-        instance->m_threshold = max(albedo.x, max(albedo.y, albedo.z));
-        instance->m_threshold = max(instance->m_threshold, kThresholdEps);
-        return instance;
-    }
-
-    Type type() const override
-    { return Type::Phong; }
-
-    bool is_delta() const override
-    { return false; }
-
-    float threshold() const override
-    { return m_threshold; }
+    Material*   m_data      = nullptr;
+    size_t      m_count     = 0;
+    size_t      m_capacity  = 0;
 
-    Vector3 emissive() const override
-    { return m_emissive; }
-
-    Vector3 shade(ShadingArg& arg) const override
+    uint16_t add(Material::Type type, const Vector3& albedo, const Vector3& emissive, float param)
     {
-        // 物体からのレイの入出を考慮した法線ベクトル.
-        auto normal = (dot(arg.normal, arg.input) < 0.0f) ? arg.normal : -arg.normal;
-
-        const auto phi = F_2PI * arg.random->get_as_float();
-        const auto cos_theta = pow( 1.0f - arg.random->get_as_float(), 1.0f / (m_shininess + 1.0f) );
-        const auto sin_theta = sqrt( 1.0f - (cos_theta * cos_theta) );
-        const auto x = cos( phi ) * sin_theta;
-        const auto y = sin( phi ) * sin_theta;
-        const auto z = cos_theta;
-
-        auto w = reflect(arg.input, normal);
-        Onb onb;
-        onb.FromW(w);
+        // IDは16bitなので，溢れた分は既定マテリアルに割り当てる.
+        if (m_count >= kMaxCount)
+        {
+            fprintf_s(stderr, "Error : MaterialTable is full. max count = %u\n", kMaxCount);
+            return kDefaultId;
+        }
 
-        auto dir = normalize(onb.u * x + onb.v * y + onb.w * z);
-        auto cosine = dot(dir, normal);
+        if (m_count == m_capacity)
+        {
+            auto capacity = (m_capacity == 0) ? 64 : m_capacity * 2;
+            auto data = static_cast<Material*>(_aligned_malloc(sizeof(Material) * capacity, 64));
+            if (m_data != nullptr)
+            {
+                memcpy(data, m_data, sizeof(Material) * m_count);
+                _aligned_free(m_data);
+            }
+            m_data     = data;
+            m_capacity = capacity;
+        }
 
-        arg.output = dir;
-        arg.pdf    = ((m_shininess + 1.0f) / F_2PI) * cosine;
+        auto& mat = m_data[m_count];
+        mat.albedo   = albedo;
+        mat.param    = param;
+        mat.emissive = emissive;
+        mat.type     = type;
+        mat.delta    = (type == Material::Mirror || type == Material::Refract) ? 1 : 0;
 
-        return m_albedo * cosine * ((m_shininess + 2.0f) / (m_shininess + 1.0f));
+        return static_cast<uint16_t>(m_count++);
     }
 
-private:
-    Vector3 m_albedo;
-    Vector3 m_emissive;
-    float   m_shininess;
-    float   m_threshold;
+    MaterialTable           (const MaterialTable&) = delete;
+    MaterialTable& operator=(const MaterialTable&) = delete;
 };
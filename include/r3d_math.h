@@ -5,20 +5,35 @@
 //-------------------------------------------------------------------------------------------------
 #pragma once
 
-#define NOMINMAX
-
 //-------------------------------------------------------------------------------------------------
 // Includes
 //-------------------------------------------------------------------------------------------------
+#include <r3d_platform.h>
 #include <cstdint>
 #include <cmath>
 
+// x86/x64 では SIMD 版を常にコンパイルしておき，どれを使うかは実行時に CpuInfo で選ぶ.
+// DISABLE_SIMD を定義するとスカラー版のみになる.
+#if defined(R3D_ARCH_X86) && !defined(DISABLE_SIMD)
+    #ifndef ENABLE_SSE2
+    #define ENABLE_SSE2
+    #endif//ENABLE_SSE2
+
+    #ifndef ENABLE_AVX
+    #define ENABLE_AVX
+    #endif//ENABLE_AVX
+
+    #if defined(R3D_HAS_AVX512) && !defined(ENABLE_AVX512)
+    #define ENABLE_AVX512
+    #endif
+#endif
+
 #if defined(ENABLE_SSE2)
 #include <emmintrin.h>
 #endif//defined(ENABLE_SSE2)
 
 #if defined(ENABLE_AVX)
-#include <intrin.h>
+#include <immintrin.h>
 #endif//defined(ENABLE_AVX)
 
 
@@ -59,6 +74,13 @@ inline bool is_nan(float value)
 inline bool is_inf(float value)
 { return std::isinf(value); }
 
+// 0に近い値でも無限大にならない逆数を求めます(スラブ判定用).
+inline float safe_rcp(float value)
+{
+    constexpr float kMin = 1e-20f;
+    return 1.0f / ((fabs(value) < kMin) ? std::copysign(kMin, value) : value);
+}
+
 inline bool is_zero(float value)
 { return fabs(value) < F_EPSILON; }
 
@@ -196,17 +218,28 @@ struct Vector3
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Ray structure
 ///////////////////////////////////////////////////////////////////////////////////////////////////
+// pos, dir を変更したら make_ray() で作り直すこと(逆数と符号がずれる).
 struct Ray
 {
     Vector3 pos;
     Vector3 dir;
+    Vector3 inv_dir;    // 方向ベクトルの逆数.
+    int     sign[3];    // 逆数が負の軸は1(スラブ判定で近い面を選ぶのに使う).
+    float   t_max;      // 交差判定の上限距離.
 };
 
-inline Ray make_ray(const Vector3& pos, const Vector3& dir)
+inline Ray make_ray(const Vector3& pos, const Vector3& dir, float t_max = F_HIT_MAX)
 {
     Ray result;
-    result.pos = pos;
-    result.dir = dir;
+    result.pos     = pos;
+    result.dir     = dir;
+    result.inv_dir = Vector3( safe_rcp(dir.x), safe_rcp(dir.y), safe_rcp(dir.z) );
+    result.t_max   = t_max;
+
+    // -0 の逆数は負になるので，方向ではなく逆数の符号で判定する.
+    result.sign[0] = (result.inv_dir.x < 0.0f) ? 1 : 0;
+    result.sign[1] = (result.inv_dir.y < 0.0f) ? 1 : 0;
+    result.sign[2] = (result.inv_dir.z < 0.0f) ? 1 : 0;
     return result;
 }
 
@@ -241,7 +274,7 @@ public:
     }
 
     inline float get_as_float()
-    { return static_cast<float>(get()) /  0xffffffffui32; }
+    { return static_cast<float>(get()) /  0xffffffffu; }
 
 private:
     uint32_t a;
@@ -596,6 +629,43 @@ inline Vector3 mul_coord(const Vector3& lhs, const Matrix& rhs)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Affine structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 射影成分を持たない3x4のアフィン変換です. w 除算が要らない.
+// Matrix の1～3列目をそれぞれ1行として持つ.
+struct Affine
+{
+    float m[3][4];
+
+    Affine()
+    { /* DO_NOTHING */ }
+
+    explicit Affine(const Matrix& value)
+    {
+        m[0][0] = value._11; m[0][1] = value._21; m[0][2] = value._31; m[0][3] = value._41;
+        m[1][0] = value._12; m[1][1] = value._22; m[1][2] = value._32; m[1][3] = value._42;
+        m[2][0] = value._13; m[2][1] = value._23; m[2][2] = value._33; m[2][3] = value._43;
+    }
+};
+
+inline Vector3 mul(const Vector3& lhs, const Affine& rhs)
+{
+    return Vector3(
+        (lhs.x * rhs.m[0][0]) + (lhs.y * rhs.m[0][1]) + (lhs.z * rhs.m[0][2]) + rhs.m[0][3],
+        (lhs.x * rhs.m[1][0]) + (lhs.y * rhs.m[1][1]) + (lhs.z * rhs.m[1][2]) + rhs.m[1][3],
+        (lhs.x * rhs.m[2][0]) + (lhs.y * rhs.m[2][1]) + (lhs.z * rhs.m[2][2]) + rhs.m[2][3] );
+}
+
+inline Vector3 mul_normal(const Vector3& lhs, const Affine& rhs)
+{
+    return Vector3(
+        (lhs.x * rhs.m[0][0]) + (lhs.y * rhs.m[0][1]) + (lhs.z * rhs.m[0][2]),
+        (lhs.x * rhs.m[1][0]) + (lhs.y * rhs.m[1][1]) + (lhs.z * rhs.m[1][2]),
+        (lhs.x * rhs.m[2][0]) + (lhs.y * rhs.m[2][1]) + (lhs.z * rhs.m[2][2]) );
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Onb structure
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -679,44 +749,26 @@ struct Box
 
 inline bool hit(const Ray& ray, const Box& box)
 {
-    float t0, t1, n, f;
-    float t_min = -F_HIT_MAX;
-    float t_max =  F_HIT_MAX;
-
-    t0 = (box.mini.x - ray.pos.x) / ray.dir.x;
-    t1 = (box.maxi.x - ray.pos.x) / ray.dir.x;
+    // 逆数の符号で近い面と遠い面が決まるので min/max は要らない.
+    auto t_min = ((ray.sign[0] ? box.maxi.x : box.mini.x) - ray.pos.x) * ray.inv_dir.x;
+    auto t_max = ((ray.sign[0] ? box.mini.x : box.maxi.x) - ray.pos.x) * ray.inv_dir.x;
 
-    n = min(t0, t1);
-    f = max(t0, t1);
+    t_min = max(t_min, -F_HIT_MAX);
+    t_max = min(t_max, ray.t_max);
 
-    t_min = max(t_min, n);
-    t_max = min(t_max, f);
+    auto ty_min = ((ray.sign[1] ? box.maxi.y : box.mini.y) - ray.pos.y) * ray.inv_dir.y;
+    auto ty_max = ((ray.sign[1] ? box.mini.y : box.maxi.y) - ray.pos.y) * ray.inv_dir.y;
 
-    if (t_min > t_max)
+    if (t_min > ty_max || ty_min > t_max)
     { return false; }
 
-    t0 = (box.mini.y - ray.pos.y) / ray.dir.y;
-    t1 = (box.maxi.y - ray.pos.y) / ray.dir.y;
+    t_min = max(t_min, ty_min);
+    t_max = min(t_max, ty_max);
 
-    n = min(t0, t1);
-    f = max(t0, t1);
+    auto tz_min = ((ray.sign[2] ? box.maxi.z : box.mini.z) - ray.pos.z) * ray.inv_dir.z;
+    auto tz_max = ((ray.sign[2] ? box.mini.z : box.maxi.z) - ray.pos.z) * ray.inv_dir.z;
 
-    t_min = max(t_min, n);
-    t_max = min(t_max, f);
-
-    if (t_min > t_max)
-    { return false; }
-
-    t0 = (box.mini.z - ray.pos.z) / ray.dir.z;
-    t1 = (box.maxi.z - ray.pos.z) / ray.dir.z;
-
-    n = min(t0, t1);
-    f = max(t0, t1);
-
-    t_min = max(t_min, n);
-    t_max = min(t_max, f);
-
-    if (t_min > t_max)
+    if (t_min > tz_max || tz_min > t_max)
     { return false; }
 
     return true;
@@ -810,6 +862,10 @@ struct Ray4
 {
     __m128  pos[3];
     __m128  dir[3];
+    __m128  inv_dir[3];     // 方向ベクトルの逆数.
+    __m128  org_inv[3];     // -pos * inv_dir.
+    __m128  t_max;          // 交差判定の上限距離.
+    int     sign[3];        // 逆数が負の軸は1.
 };
 
 inline Ray4 convert(const Ray& ray)
@@ -823,21 +879,37 @@ inline Ray4 convert(const Ray& ray)
     result.dir[1] = _mm_set1_ps( ray.dir.y );
     result.dir[2] = _mm_set1_ps( ray.dir.z );
 
+    // 逆数は make_ray() で求めたものを使う.
+    result.inv_dir[0] = _mm_set1_ps( ray.inv_dir.x );
+    result.inv_dir[1] = _mm_set1_ps( ray.inv_dir.y );
+    result.inv_dir[2] = _mm_set1_ps( ray.inv_dir.z );
+
+    result.org_inv[0] = _mm_set1_ps( -ray.pos.x * ray.inv_dir.x );
+    result.org_inv[1] = _mm_set1_ps( -ray.pos.y * ray.inv_dir.y );
+    result.org_inv[2] = _mm_set1_ps( -ray.pos.z * ray.inv_dir.z );
+
+    result.t_max = _mm_set1_ps( ray.t_max );
+
+    result.sign[0] = ray.sign[0];
+    result.sign[1] = ray.sign[1];
+    result.sign[2] = ray.sign[2];
+
     return result;
 }
 
 inline Ray revert(const Ray4& ray)
 {
-    Ray result;
-    result.pos.x = _mm_cvtss_f32( ray.pos[0] );
-    result.pos.y = _mm_cvtss_f32( ray.pos[1] );
-    result.pos.z = _mm_cvtss_f32( ray.pos[2] );
+    Vector3 pos;
+    pos.x = _mm_cvtss_f32( ray.pos[0] );
+    pos.y = _mm_cvtss_f32( ray.pos[1] );
+    pos.z = _mm_cvtss_f32( ray.pos[2] );
 
-    result.dir.x = _mm_cvtss_f32( ray.dir[0] );
-    result.dir.y = _mm_cvtss_f32( ray.dir[1] );
-    result.dir.z = _mm_cvtss_f32( ray.dir[2] );
+    Vector3 dir;
+    dir.x = _mm_cvtss_f32( ray.dir[0] );
+    dir.y = _mm_cvtss_f32( ray.dir[1] );
+    dir.z = _mm_cvtss_f32( ray.dir[2] );
 
-    return result;
+    return make_ray( pos, dir, _mm_cvtss_f32( ray.t_max ) );
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -916,39 +988,17 @@ inline void revert(const Box4& box4, Box& b0, Box& b1, Box& b2, Box& b3)
 inline bool hit(const Ray4& ray, const Box4& box, int& mask)
 {
     __m128 t_min = _mm_set1_ps( -F_HIT_MAX );
-    __m128 t_max = _mm_set1_ps(  F_HIT_MAX );
+    __m128 t_max = ray.t_max;
 
-    __m128 t0;
-    __m128 t1;
-    __m128 n;
-    __m128 f;
-
-    t0 = _mm_div_ps( _mm_sub_ps(box.mini[0], ray.pos[0]), ray.dir[0] );
-    t1 = _mm_div_ps( _mm_sub_ps(box.maxi[0], ray.pos[0]), ray.dir[0] );
-
-    n = _mm_min_ps( t0, t1 );
-    f = _mm_max_ps( t0, t1 );
-
-    t_min = _mm_max_ps( t_min, n );
-    t_max = _mm_min_ps( t_max, f );
-
-    t0 = _mm_div_ps( _mm_sub_ps(box.mini[1], ray.pos[1]), ray.dir[1] );
-    t1 = _mm_div_ps( _mm_sub_ps(box.maxi[1], ray.pos[1]), ray.dir[1] );
-
-    n = _mm_min_ps( t0, t1 );
-    f = _mm_max_ps( t0, t1 );
-
-    t_min = _mm_max_ps( t_min, n );
-    t_max = _mm_min_ps( t_max, f );
-
-    t0 = _mm_div_ps( _mm_sub_ps(box.mini[2], ray.pos[2]), ray.dir[2] );
-    t1 = _mm_div_ps( _mm_sub_ps(box.maxi[2], ray.pos[2]), ray.dir[2] );
-
-    n = _mm_min_ps( t0, t1 );
-    f = _mm_max_ps( t0, t1 );
+    for(auto i=0; i<3; ++i)
+    {
+        // 逆数の符号で近い面と遠い面が決まるので min/max は要らない.
+        auto& n_side = ray.sign[i] ? box.maxi[i] : box.mini[i];
+        auto& f_side = ray.sign[i] ? box.mini[i] : box.maxi[i];
 
-    t_min = _mm_max_ps( t_min, n );
-    t_max = _mm_min_ps( t_max, f );
+        t_min = _mm_max_ps( t_min, _mm_add_ps( _mm_mul_ps( n_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+        t_max = _mm_min_ps( t_max, _mm_add_ps( _mm_mul_ps( f_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+    }
 
     mask = _mm_movemask_ps( _mm_cmple_ps( t_min, t_max ) );
     return mask > 0;
@@ -977,13 +1027,18 @@ inline bool hit_non_simd(const Ray4& ray, const Box4& box, int& mask)
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Ray8 structure
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-struct Ray8
+// AVXを有効にしていない関数からは __m256 が16byte境界として扱われるため，明示的に揃える.
+struct alignas(32) Ray8
 {
     __m256 pos[3];
     __m256 dir[3];
+    __m256 inv_dir[3];      // 方向ベクトルの逆数.
+    __m256 org_inv[3];      // -pos * inv_dir.
+    __m256 t_max;           // 交差判定の上限距離.
+    int    sign[3];         // 逆数が負の軸は1.
 };
 
-inline Ray8 make_ray8(const Ray& ray)
+R3D_TARGET_AVX inline Ray8 make_ray8(const Ray& ray)
 {
     Ray8 result;
     result.pos[0] = _mm256_set1_ps( ray.pos.x );
@@ -994,34 +1049,50 @@ inline Ray8 make_ray8(const Ray& ray)
     result.dir[1] = _mm256_set1_ps( ray.dir.y );
     result.dir[2] = _mm256_set1_ps( ray.dir.z );
 
+    result.inv_dir[0] = _mm256_set1_ps( ray.inv_dir.x );
+    result.inv_dir[1] = _mm256_set1_ps( ray.inv_dir.y );
+    result.inv_dir[2] = _mm256_set1_ps( ray.inv_dir.z );
+
+    result.org_inv[0] = _mm256_set1_ps( -ray.pos.x * ray.inv_dir.x );
+    result.org_inv[1] = _mm256_set1_ps( -ray.pos.y * ray.inv_dir.y );
+    result.org_inv[2] = _mm256_set1_ps( -ray.pos.z * ray.inv_dir.z );
+
+    result.t_max = _mm256_set1_ps( ray.t_max );
+
+    result.sign[0] = ray.sign[0];
+    result.sign[1] = ray.sign[1];
+    result.sign[2] = ray.sign[2];
+
     return result;
 }
 
-inline Ray revert(const Ray8& ray)
+R3D_TARGET_AVX inline Ray revert(const Ray8& ray)
 {
-    alignas(16) float temp[4];
+    alignas(32) float temp[8];
 
-    Ray result;
-    _mm256_store_ps(temp, ray.pos[0]);    result.pos.x = temp[0];
-    _mm256_store_ps(temp, ray.pos[1]);    result.pos.y = temp[0];
-    _mm256_store_ps(temp, ray.pos[2]);    result.pos.z = temp[0];
+    Vector3 pos;
+    _mm256_store_ps(temp, ray.pos[0]);    pos.x = temp[0];
+    _mm256_store_ps(temp, ray.pos[1]);    pos.y = temp[0];
+    _mm256_store_ps(temp, ray.pos[2]);    pos.z = temp[0];
 
-    _mm256_store_ps(temp, ray.dir[0]);   result.dir.x = temp[0];
-    _mm256_store_ps(temp, ray.dir[1]);   result.dir.x = temp[0];
-    _mm256_store_ps(temp, ray.dir[2]);   result.dir.x = temp[0];
+    Vector3 dir;
+    _mm256_store_ps(temp, ray.dir[0]);    dir.x = temp[0];
+    _mm256_store_ps(temp, ray.dir[1]);    dir.y = temp[0];
+    _mm256_store_ps(temp, ray.dir[2]);    dir.z = temp[0];
 
-    return result;
+    _mm256_store_ps(temp, ray.t_max);
+    return make_ray( pos, dir, temp[0] );
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Box8 structure
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-struct Box8
+struct alignas(32) Box8
 {
     __m256 mini[3];
     __m256 maxi[3];
 
-    Box8()
+    R3D_TARGET_AVX Box8()
     {
         mini[0] = _mm256_set1_ps( F_MAX );
         mini[1] = _mm256_set1_ps( F_MAX );
@@ -1032,7 +1103,7 @@ struct Box8
         maxi[2] = _mm256_set1_ps( -F_MAX );
     }
 
-    Box8(const Box& box)
+    R3D_TARGET_AVX Box8(const Box& box)
     {
         mini[0] = _mm256_set1_ps( box.mini.x );
         mini[1] = _mm256_set1_ps( box.mini.y );
@@ -1043,8 +1114,8 @@ struct Box8
         maxi[2] = _mm256_set1_ps( box.maxi.z );
     }
 
-    Box8(const Box& b0, const Box& b1, const Box& b2, const Box& b3,
-         const Box& b4, const Box& b5, const Box& b6, const Box& b7)
+    R3D_TARGET_AVX Box8(const Box& b0, const Box& b1, const Box& b2, const Box& b3,
+                        const Box& b4, const Box& b5, const Box& b6, const Box& b7)
     {
         mini[0] = _mm256_set_ps( b7.mini.x, b6.mini.x, b5.mini.x, b4.mini.x, b3.mini.x, b2.mini.x, b1.mini.x, b0.mini.x );
         mini[1] = _mm256_set_ps( b7.mini.y, b6.mini.y, b5.mini.y, b4.mini.y, b3.mini.y, b2.mini.y, b1.mini.y, b0.mini.y );
@@ -1056,7 +1127,7 @@ struct Box8
     }
 };
 
-inline void revert(const Box8& box8, Box& b0, Box& b1, Box& b2, Box& b3, Box& b4, Box& b5, Box& b6, Box& b7)
+R3D_TARGET_AVX inline void revert(const Box8& box8, Box& b0, Box& b1, Box& b2, Box& b3, Box& b4, Box& b5, Box& b6, Box& b7)
 {
     alignas(32) float mini_x[8];
     alignas(32) float mini_y[8];
@@ -1099,49 +1170,46 @@ inline void revert(const Box8& box8, Box& b0, Box& b1, Box& b2, Box& b3, Box& b4
     b7.maxi = Vector3(maxi_x[7], maxi_y[7], maxi_z[7]);
 }
 
-inline bool hit(const Ray8& ray, const Box8& box, int& mask)
+R3D_TARGET_AVX inline bool hit(const Ray8& ray, const Box8& box, int& mask)
 {
     __m256 t_min = _mm256_set1_ps( -F_HIT_MAX );
-    __m256 t_max = _mm256_set1_ps(  F_HIT_MAX );
-
-    __m256 t0;
-    __m256 t1;
-    __m256 n;
-    __m256 f;
-
-    t0 = _mm256_div_ps( _mm256_sub_ps(box.mini[0], ray.pos[0]), ray.dir[0] );
-    t1 = _mm256_div_ps( _mm256_sub_ps(box.maxi[0], ray.pos[0]), ray.dir[0] );
+    __m256 t_max = ray.t_max;
 
-    n = _mm256_min_ps( t0, t1 );
-    f = _mm256_max_ps( t0, t1 );
-
-    t_min = _mm256_max_ps( t_min, n );
-    t_max = _mm256_min_ps( t_max, f );
+    for(auto i=0; i<3; ++i)
+    {
+        auto& n_side = ray.sign[i] ? box.maxi[i] : box.mini[i];
+        auto& f_side = ray.sign[i] ? box.mini[i] : box.maxi[i];
 
-    t0 = _mm256_div_ps( _mm256_sub_ps(box.mini[1], ray.pos[1]), ray.dir[1] );
-    t1 = _mm256_div_ps( _mm256_sub_ps(box.maxi[1], ray.pos[1]), ray.dir[1] );
+        t_min = _mm256_max_ps( t_min, _mm256_add_ps( _mm256_mul_ps( n_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+        t_max = _mm256_min_ps( t_max, _mm256_add_ps( _mm256_mul_ps( f_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+    }
 
-    n = _mm256_min_ps( t0, t1 );
-    f = _mm256_max_ps( t0, t1 );
+    mask = _mm256_movemask_ps( _mm256_cmp_ps( t_max, t_min, _CMP_GE_OS ) );
 
-    t_min = _mm256_max_ps( t_min, n );
-    t_max = _mm256_min_ps( t_max, f );
+    return mask > 0;
+}
 
-    t0 = _mm256_div_ps( _mm256_sub_ps(box.mini[2], ray.pos[2]), ray.dir[2] );
-    t1 = _mm256_div_ps( _mm256_sub_ps(box.maxi[2], ray.pos[2]), ray.dir[2] );
+// AVX2 + FMA 版です. 積和を1命令で行う.
+R3D_TARGET_AVX2 inline bool hit_fma(const Ray8& ray, const Box8& box, int& mask)
+{
+    __m256 t_min = _mm256_set1_ps( -F_HIT_MAX );
+    __m256 t_max = ray.t_max;
 
-    n = _mm256_min_ps( t0, t1 );
-    f = _mm256_max_ps( t0, t1 );
+    for(auto i=0; i<3; ++i)
+    {
+        auto& n_side = ray.sign[i] ? box.maxi[i] : box.mini[i];
+        auto& f_side = ray.sign[i] ? box.mini[i] : box.maxi[i];
 
-    t_min = _mm256_max_ps( t_min, n );
-    t_max = _mm256_min_ps( t_max, f );
+        t_min = _mm256_max_ps( t_min, _mm256_fmadd_ps( n_side, ray.inv_dir[i], ray.org_inv[i] ) );
+        t_max = _mm256_min_ps( t_max, _mm256_fmadd_ps( f_side, ray.inv_dir[i], ray.org_inv[i] ) );
+    }
 
     mask = _mm256_movemask_ps( _mm256_cmp_ps( t_max, t_min, _CMP_GE_OS ) );
 
     return mask > 0;
 }
 
-inline bool hit_non_simd(const Ray8& ray, const Box8& box, int& mask)
+R3D_TARGET_AVX inline bool hit_non_simd(const Ray8& ray, const Box8& box, int& mask)
 {
     Ray r = revert(ray);
 
@@ -1169,3 +1237,108 @@ inline bool hit_non_simd(const Ray8& ray, const Box8& box, int& mask)
     return mask > 0;
 }
 #endif//defined(ENABLE_AVX)
+
+
+#if defined(ENABLE_AVX512)
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Ray16 structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct alignas(64) Ray16
+{
+    __m512 pos[3];
+    __m512 dir[3];
+    __m512 inv_dir[3];      // 方向ベクトルの逆数.
+    __m512 org_inv[3];      // -pos * inv_dir.
+    __m512 t_max;           // 交差判定の上限距離.
+    int    sign[3];         // 逆数が負の軸は1.
+};
+
+R3D_TARGET_AVX512 inline Ray16 make_ray16(const Ray& ray)
+{
+    Ray16 result;
+    result.pos[0] = _mm512_set1_ps( ray.pos.x );
+    result.pos[1] = _mm512_set1_ps( ray.pos.y );
+    result.pos[2] = _mm512_set1_ps( ray.pos.z );
+
+    result.dir[0] = _mm512_set1_ps( ray.dir.x );
+    result.dir[1] = _mm512_set1_ps( ray.dir.y );
+    result.dir[2] = _mm512_set1_ps( ray.dir.z );
+
+    result.inv_dir[0] = _mm512_set1_ps( ray.inv_dir.x );
+    result.inv_dir[1] = _mm512_set1_ps( ray.inv_dir.y );
+    result.inv_dir[2] = _mm512_set1_ps( ray.inv_dir.z );
+
+    result.org_inv[0] = _mm512_set1_ps( -ray.pos.x * ray.inv_dir.x );
+    result.org_inv[1] = _mm512_set1_ps( -ray.pos.y * ray.inv_dir.y );
+    result.org_inv[2] = _mm512_set1_ps( -ray.pos.z * ray.inv_dir.z );
+
+    result.t_max = _mm512_set1_ps( ray.t_max );
+
+    result.sign[0] = ray.sign[0];
+    result.sign[1] = ray.sign[1];
+    result.sign[2] = ray.sign[2];
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Box16 structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct alignas(64) Box16
+{
+    __m512 mini[3];
+    __m512 maxi[3];
+
+    // 16個のボックスをSoAに並べます.
+    // count 個に満たないレーンは min/max が反転した空のボックスになる.
+    R3D_TARGET_AVX512 Box16(const Box* boxes, int count)
+    {
+        alignas(64) float temp[6][16];
+        for(auto i=0; i<16; ++i)
+        {
+            auto valid = i < count;
+            temp[0][i] = valid ? boxes[i].mini.x :  F_MAX;
+            temp[1][i] = valid ? boxes[i].mini.y :  F_MAX;
+            temp[2][i] = valid ? boxes[i].mini.z :  F_MAX;
+            temp[3][i] = valid ? boxes[i].maxi.x : -F_MAX;
+            temp[4][i] = valid ? boxes[i].maxi.y : -F_MAX;
+            temp[5][i] = valid ? boxes[i].maxi.z : -F_MAX;
+        }
+
+        for(auto i=0; i<3; ++i)
+        {
+            mini[i] = _mm512_load_ps( temp[i + 0] );
+            maxi[i] = _mm512_load_ps( temp[i + 3] );
+        }
+    }
+};
+
+// GCC 12 は _mm512_max_ps / _mm512_min_ps の内部で使う未定義値(_mm512_undefined_ps)を
+// インライン展開後に未初期化と誤検出するので，この関数の中だけ警告を抑制する.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+R3D_TARGET_AVX512 inline bool hit(const Ray16& ray, const Box16& box, int& mask)
+{
+    __m512 t_min = _mm512_set1_ps( -F_HIT_MAX );
+    __m512 t_max = ray.t_max;
+
+    for(auto i=0; i<3; ++i)
+    {
+        auto& n_side = ray.sign[i] ? box.maxi[i] : box.mini[i];
+        auto& f_side = ray.sign[i] ? box.mini[i] : box.maxi[i];
+
+        t_min = _mm512_max_ps( t_min, _mm512_fmadd_ps( n_side, ray.inv_dir[i], ray.org_inv[i] ) );
+        t_max = _mm512_min_ps( t_max, _mm512_fmadd_ps( f_side, ray.inv_dir[i], ray.org_inv[i] ) );
+    }
+
+    mask = int( _mm512_cmp_ps_mask( t_max, t_min, _CMP_GE_OS ) );
+
+    return mask > 0;
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif//defined(ENABLE_AVX512)
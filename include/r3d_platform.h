@@ -0,0 +1,134 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_platform.h
+// Desc : Platform Abstraction.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif//NOMINMAX
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#include <direct.h>
+#else
+#include <cerrno>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif//defined(_WIN32)
+
+
+//-------------------------------------------------------------------------------------------------
+// Macros
+//-------------------------------------------------------------------------------------------------
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define R3D_ARCH_X86
+#endif
+
+// 命令セットを指定して関数をコンパイルします.
+// MSVC は /arch の指定なしでも AVX 以降の組み込み関数を使えるので何もしない.
+// GCC/Clang は関数単位で有効にして，他の関数には AVX 命令が混ざらないようにする.
+#if defined(_MSC_VER) || !defined(R3D_ARCH_X86)
+    #define R3D_TARGET_AVX
+    #define R3D_TARGET_AVX2
+    #define R3D_TARGET_AVX512
+#else
+    #define R3D_TARGET_AVX      __attribute__((target("avx")))
+    #define R3D_TARGET_AVX2     __attribute__((target("avx2,fma")))
+    #define R3D_TARGET_AVX512   __attribute__((target("avx512f,avx2,fma")))
+#endif
+
+// AVX-512 の組み込み関数は VS2017 15.3 (_MSC_VER 1911) 以降で使える.
+#if defined(R3D_ARCH_X86) && (!defined(_MSC_VER) || _MSC_VER >= 1911)
+    #define R3D_HAS_AVX512
+#endif
+
+
+#if !defined(_WIN32)
+//-------------------------------------------------------------------------------------------------
+// Microsoft CRT 互換関数 (Windows 以外).
+//-------------------------------------------------------------------------------------------------
+typedef int errno_t;
+
+#define printf_s    printf
+#define fprintf_s   fprintf
+#define sscanf_s    sscanf      // 注意 : %s, %c 等のバッファサイズ引数には対応しない.
+
+inline void* _aligned_malloc(size_t size, size_t alignment)
+{
+    void* ptr = nullptr;
+    if (alignment < sizeof(void*))
+    { alignment = sizeof(void*); }
+
+    return (posix_memalign(&ptr, alignment, size) == 0) ? ptr : nullptr;
+}
+
+inline void _aligned_free(void* ptr)
+{ free(ptr); }
+
+inline errno_t fopen_s(FILE** fp, const char* filename, const char* mode)
+{
+    if (fp == nullptr)
+    { return EINVAL; }
+
+    *fp = fopen(filename, mode);
+    return (*fp != nullptr) ? 0 : errno;
+}
+
+inline int sprintf_s(char* buffer, size_t size, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    auto ret = vsnprintf(buffer, size, format, args);
+    va_end(args);
+    return ret;
+}
+
+template<size_t N>
+inline int sprintf_s(char (&buffer)[N], const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    auto ret = vsnprintf(buffer, N, format, args);
+    va_end(args);
+    return ret;
+}
+
+inline errno_t strcpy_s(char* dst, size_t size, const char* src)
+{
+    if (dst == nullptr || src == nullptr || size == 0)
+    { return EINVAL; }
+
+    auto len = strlen(src);
+    if (len >= size)
+    {
+        dst[0] = '\0';
+        return ERANGE;
+    }
+
+    memcpy(dst, src, len + 1);
+    return 0;
+}
+
+template<size_t N>
+inline errno_t strcpy_s(char (&dst)[N], const char* src)
+{ return strcpy_s(dst, N, src); }
+
+inline int _stricmp(const char* lhs, const char* rhs)
+{ return strcasecmp(lhs, rhs); }
+
+inline int _mkdir(const char* path)
+{ return mkdir(path, 0755); }
+
+#endif//!defined(_WIN32)
@@ -0,0 +1,238 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_sampler.h
+// Desc : Sampler.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+
+
+//-------------------------------------------------------------------------------------------------
+//      ビット順を反転します.
+//-------------------------------------------------------------------------------------------------
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x & 0xaaaaaaaau) >> 1) | ((x & 0x55555555u) << 1);
+    x = ((x & 0xccccccccu) >> 2) | ((x & 0x33333333u) << 2);
+    x = ((x & 0xf0f0f0f0u) >> 4) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x & 0xff00ff00u) >> 8) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      32bit整数のハッシュ値を求めます(PCG).
+//-------------------------------------------------------------------------------------------------
+inline uint32_t hash_u32(uint32_t x)
+{
+    auto state = x * 747796405u + 2891336453u;
+    auto word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ハッシュ値を結合します.
+//-------------------------------------------------------------------------------------------------
+inline uint32_t hash_combine(uint32_t seed, uint32_t value)
+{ return seed ^ (hash_u32(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2)); }
+
+//-------------------------------------------------------------------------------------------------
+//      Owenスクランブルを行います.
+//      cf. Brent Burley, "Practical Hash-based Owen Scrambling", JCGT 2020.
+//-------------------------------------------------------------------------------------------------
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+
+    // Laine-Karras permutation.
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+
+    return reverse_bits(x);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      Sobol列の2次元目を求めます(1次元目は reverse_bits(index) ).
+//-------------------------------------------------------------------------------------------------
+inline uint32_t sobol_dim1(uint32_t index)
+{
+    uint32_t result = 0;
+    for(uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 0x1)
+        { result ^= v; }
+    }
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      32bit固定小数を [0, 1) の浮動小数に変換します.
+//-------------------------------------------------------------------------------------------------
+inline float to_unit_float(uint32_t value)
+{ return float(value >> 8) * (1.0f / 16777216.0f); }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Sampler class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class Sampler
+{
+public:
+    enum Type
+    {
+        Independent,    //!< スレッド毎の乱数列(xorshift).
+        Sobol,          //!< Owenスクランブル済みSobol列(次元毎にパディング).
+        BlueNoise,      //!< ランク1格子(R2列) + ピクセル毎のブルーノイズオフセット.
+    };
+
+    Sampler()
+    : m_type (Independent)
+    , m_deterministic(false)
+    , m_seed (0)
+    , m_key  (0)
+    , m_pixel(0)
+    , m_index(0)
+    , m_dim  (0)
+    , m_x    (0)
+    , m_y    (0)
+    { /* DO_NOTHING */ }
+
+    inline void set_type(Type type)
+    { m_type = type; }
+
+    inline Type type() const
+    { return m_type; }
+
+    inline void set_seed(uint32_t seed)
+    {
+        m_seed = seed;
+        m_random.set_seed(seed);
+    }
+
+    // 有効にするとピクセルとサンプル番号をキーとしたカウンターベースの乱数を使います.
+    // スレッド数や処理順に依存せず同じ乱数列が得られます.
+    inline void set_deterministic(bool value)
+    { m_deterministic = value; }
+
+    inline bool is_deterministic() const
+    { return m_deterministic; }
+
+    // 乱数の状態を取得します(チェックポイント用).
+    inline const Random& random() const
+    { return m_random; }
+
+    // 乱数の状態を復元します(チェックポイント用).
+    inline void set_random(const Random& value)
+    { m_random = value; }
+
+    // ピクセルサンプルの評価を開始します.
+    inline void start(int x, int y, uint32_t sample_index)
+    {
+        m_x     = x;
+        m_y     = y;
+        m_pixel = hash_combine(hash_u32(uint32_t(x)), uint32_t(y));
+        m_index = sample_index;
+        m_dim   = 0;
+        m_key   = hash_combine(hash_combine(m_pixel, sample_index), m_seed);
+    }
+
+    // 1次元のサンプルを取得します.
+    inline float get1d()
+    {
+        switch(m_type)
+        {
+        case Sobol:
+            {
+                auto seed  = hash_combine(m_pixel, m_dim++);
+                auto index = owen_scramble(m_index, seed);
+                return to_unit_float(owen_scramble(reverse_bits(index), hash_u32(seed)));
+            }
+
+        case BlueNoise:
+            {
+                // 黄金比によるランク1格子.
+                auto offset = blue_noise_offset(m_dim++);
+                return to_unit_float(offset + m_index * 0x9e3779b9u);
+            }
+
+        default:
+            break;
+        }
+
+        return next_random();
+    }
+
+    // 2次元のサンプルを取得します.
+    inline Vector2 get2d()
+    {
+        switch(m_type)
+        {
+        case Sobol:
+            {
+                auto seed  = hash_combine(m_pixel, m_dim);
+                auto index = owen_scramble(m_index, seed);
+                auto x = owen_scramble(reverse_bits(index), hash_u32(seed));
+                auto y = owen_scramble(sobol_dim1  (index), hash_u32(seed + 1));
+                m_dim += 2;
+                return Vector2(to_unit_float(x), to_unit_float(y));
+            }
+
+        case BlueNoise:
+            {
+                // R2列によるランク1格子.
+                auto x = blue_noise_offset(m_dim + 0) + m_index * 0xc13fa9a9u;
+                auto y = blue_noise_offset(m_dim + 1) + m_index * 0x91e10da6u;
+                m_dim += 2;
+                return Vector2(to_unit_float(x), to_unit_float(y));
+            }
+
+        default:
+            break;
+        }
+
+        auto x = next_random();
+        auto y = next_random();
+        return Vector2(x, y);
+    }
+
+private:
+    Type        m_type;             //!< サンプラーの種類.
+    bool        m_deterministic;    //!< カウンターベースの乱数を使うかどうか.
+    uint32_t    m_seed;             //!< シード値.
+    uint32_t    m_key;              //!< カウンターベース乱数のキー.
+    Random      m_random;           //!< 乱数.
+    uint32_t    m_pixel;            //!< ピクセルのハッシュ値.
+    uint32_t    m_index;            //!< サンプル番号.
+    uint32_t    m_dim;              //!< 次元番号.
+    int         m_x;                //!< ピクセルのX座標.
+    int         m_y;                //!< ピクセルのY座標.
+
+    // 独立な乱数を取得します.
+    inline float next_random()
+    {
+        // (ピクセル, サンプル, 次元) をキーにしたハッシュ値をそのまま乱数とする.
+        if (m_deterministic)
+        { return to_unit_float(hash_u32(m_key ^ hash_u32(m_dim++))); }
+
+        m_dim++;
+        return m_random.get_as_float();
+    }
+
+    // Interleaved Gradient Noise によるピクセル毎のオフセットを求めます.
+    inline uint32_t blue_noise_offset(uint32_t dim) const
+    {
+        auto shift = 5.588238f * float(dim);
+        auto fx    = float(m_x) + shift;
+        auto fy    = float(m_y) + shift;
+        auto f     = 0.06711056f * fx + 0.00583715f * fy;
+        f = 52.9829189f * (f - floorf(f));
+        f = f - floorf(f);
+        return uint32_t(f * 16777216.0f) << 8;
+    }
+};
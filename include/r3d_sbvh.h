@@ -0,0 +1,42 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_sbvh.h
+// Desc : Spatial Split BVH Builder.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+#include <r3d_shape.h>
+#include <vector>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// SplitTree structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 空間分割ありのSAHで構築した2分木です.
+// 葉の参照は深さ優先順に並ぶので，部分木の参照は refs の中で連続する.
+struct SplitTree
+{
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // Node structure
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    struct Node
+    {
+        Box         box;        //!< 部分木のボックス(分割した三角形はクリップ済み).
+        int         child[2];   //!< 子ノード番号(葉は -1).
+        uint32_t    offset;     //!< 部分木の先頭の参照番号.
+        uint32_t    count;      //!< 部分木の参照数.
+    };
+
+    std::vector<Node>       nodes;      //!< ノード(nodes[0] がルート).
+    std::vector<Triangle*>  refs;       //!< 参照する三角形(分割された三角形は重複する).
+};
+
+//-------------------------------------------------------------------------------------------------
+//      空間分割ありのSAHで2分木を構築します.
+//      budget は三角形数に対して重複を許す参照数の割合です(0 なら空間分割しない).
+//-------------------------------------------------------------------------------------------------
+bool build_split_tree(const std::vector<Triangle*>& tris, float budget, SplitTree& tree);
@@ -12,7 +12,15 @@
 #include <r3d_shape.h>
 #include <r3d_camera.h>
 #include <r3d_texture.h>
+#include <r3d_bvh.h>
 #include <vector>
+#include <map>
+
+
+//-------------------------------------------------------------------------------------------------
+// Forward Declarations.
+//-------------------------------------------------------------------------------------------------
+struct ResScene;
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -21,27 +29,101 @@
 class Scene
 {
 public:
+    enum Preset
+    {
+        PresetCornell,      //!< 球だけのコーネルボックス.
+        PresetMesh,         //!< 既定のシーン(コーネルボックス + domo メッシュ).
+        PresetInstanced,    //!< domo メッシュをインスタンスで複数配置.
+        PresetSpheres,      //!< 多数の小さな球を配置.
+        Preset_Count,
+    };
+
     Scene();
     ~Scene();
 
     bool load(const char* filename);
+    bool load(Preset preset);
     bool save(const char* filename);
     void dispose();
     Ray  emit(float x, float y) const;
+    Ray  emit(int x, int y, Sampler& sampler) const;
     bool hit(const Ray& ray, HitRecord& record) const;
     Vector3 sample_ibl(const Vector3& dir) const;
+    float depth(const Vector3& pos) const;
 
     int width  () const { return m_w; }
     int height () const { return m_h; }
     int samples() const { return m_s; }
 
+    // メッシュのBVHと上位BVHの構築にかかった時間[sec].
+    double build_time() const { return m_build_time; }
+
+    static const char* preset_name(Preset preset);
+
+    const MaterialTable& materials() const { return m_mats; }
+
+    // シーンファイルの形状IDからメッシュ・インスタンスを取得します(見つからなければ nullptr).
+    Mesh*          find_mesh    (int id) const;
+    ShapeInstance* find_instance(int id) const;
+
+    // インスタンスの移動に合わせて上位BVHを更新します.
+    // メッシュを変形させた場合は，先に Mesh::refit() を呼び出しておくこと.
+    // SAHコストが構築時の threshold 倍を超えて劣化した場合は再構築し，true を返します.
+    bool refit(float threshold = 1.5f);
+
+    // シーンファイルに記述されたカメラ数を取得します.
+    int camera_count() const { return int(m_keys.size()); }
+
+    // キーフレーム数(カメラとインスタンスのキーの多い方)を取得します.
+    int key_count() const;
+
+    // カメラのキーフレームを補間して描画に使うカメラを設定します.
+    // time は 0 ～ camera_count() - 1 で，整数なら記述されたカメラそのものになります.
+    // 描画中のタスクが無い時に呼び出すこと.
+    void set_camera(float time);
+
+    // インスタンスのキーフレームを補間してワールド行列を設定します.
+    // time は set_camera() と同じで，キーを持つインスタンスを動かした場合は true を返すので，
+    // 続けて refit() を呼び出して上位BVHを更新すること. 描画中のタスクが無い時に呼び出すこと.
+    bool animate(float time);
+
 private:
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // CameraKey structure
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    struct CameraKey
+    {
+        Vector3     pos;
+        Vector3     dir;
+        Vector3     upward;
+        float       fov;        //!< 画角[rad].
+        float       znear;
+    };
+
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    // InstanceKey structure
+    ///////////////////////////////////////////////////////////////////////////////////////////////
+    struct InstanceKey
+    {
+        ShapeInstance*          shape;
+        std::vector<Matrix>     worlds;     //!< キーフレーム毎のワールド行列.
+    };
+
     int                     m_w;
     int                     m_h;
     int                     m_s;
     std::vector<Texture*>   m_texs;
     std::vector<Shape*>     m_objs;
-    std::vector<Material*>  m_mats;
+    ShapeBVH                m_bvh;          //!< m_objs をまとめる上位BVH.
+    std::map<int, Mesh*>            m_meshes;       //!< 形状IDとメッシュの対応.
+    std::map<int, ShapeInstance*>   m_instances;    //!< 形状IDとインスタンスの対応.
+    MaterialTable           m_mats;
     Camera*                 m_cam;
+    std::vector<CameraKey>  m_keys;         //!< カメラのキーフレーム.
+    std::vector<InstanceKey> m_anims;       //!< 動かすインスタンスのキーフレーム.
     Texture*                m_ibl;
+    double                  m_build_time;
+
+    // strict が true なら，メッシュの読み込みやインスタンスの参照の解決に失敗した時点で失敗にする.
+    bool setup(const ResScene& res, bool strict);
 };
@@ -9,6 +9,7 @@
 // Includes
 //-------------------------------------------------------------------------------------------------
 #include <r3d_math.h>
+#include <r3d_stats.h>
 #include <new>
 #include <vector>
 
@@ -16,12 +17,11 @@
 //-------------------------------------------------------------------------------------------------
 // Forward Declaratiosn.
 //-------------------------------------------------------------------------------------------------
-struct Material;
 struct Shape;
-class BVH;
-class BVH4;
-class BVH8;
+class ShapeInstance;
+class Accelerator;
 class Texture;
+class MaterialTable;
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -44,7 +44,8 @@ struct HitRecord
     Vector3         nrm     = Vector3(0.0f, 0.0f, 0.0f);    // 法線ベクトル.
     Vector2         uv      = Vector2(0.0f, 0.0f);          // 衝突点のテクスチャ座標.
     const Shape*    shape   = nullptr;                      // 形状データ.
-    const Material* mat     = nullptr;                      // 材質データ.
+    uint16_t        mat     = 0;                            // 材質ID.
+    const ShapeInstance* instance = nullptr;                // 法線が局所空間のままのインスタンス.
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -55,7 +56,7 @@ struct ShadowRecord
     float           dist  = F_HIT_MAX;
     float           pdf   = 1.0f;
     const Shape*    shape = nullptr;
-    const Material* mat   = nullptr;
+    uint16_t        mat   = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -65,6 +66,9 @@ struct Shape
 {
     virtual ~Shape() {}
     virtual bool hit(const Ray& ray, HitRecord& record) const = 0;
+
+    // 形状を囲むボックスを取得します(上位BVHの構築と更新に使う).
+    virtual Box bounds() const = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -75,9 +79,9 @@ class Sphere : public Shape
 public:
     float           radius;     //!< 半径です.
     Vector3         pos;        //!< 位置座標です.
-    const Material* mat;        //!< マテリアル.
+    uint16_t        mat;        //!< マテリアルID.
 
-    static Sphere* create(float radius, const Vector3& pos, const Material* mat)
+    static Sphere* create(float radius, const Vector3& pos, uint16_t mat)
     {
         auto instance = new (std::nothrow) Sphere();
         instance->radius = radius;
@@ -88,20 +92,28 @@ public:
 
     inline bool hit(const Ray& ray, HitRecord& record) const override
     {
-        auto p = pos - ray.pos;
-        auto b = dot(p, ray.dir);
-        auto det = b * b - dot(p, p) + radius * radius;
+        R3D_STATS_ADD(CounterSphereTests, 1);
+
+        // インスタンスから渡されるレイは方向が正規化されていないので，2次の係数 a も使う.
+        auto a     = dot(ray.dir, ray.dir);
+        auto inv_a = 1.0f / a;
+        auto p     = pos - ray.pos;
+        auto b     = dot(p, ray.dir);
+
+        // 判別式は中心からレイへの垂線の長さで求めると，半径の大きな球でも桁落ちしにくい.
+        auto f   = p - ray.dir * (b * inv_a);
+        auto det = a * (radius * radius - dot(f, f));
         if (det < 0.0f)
         { return false; }
 
         auto sqrt_det = sqrt(det);
-        auto t1 = b - sqrt_det;
-        auto t2 = b + sqrt_det;
+        auto t1 = (b - sqrt_det) * inv_a;
+        auto t2 = (b + sqrt_det) * inv_a;
         if (t1 < F_HIT_MIN && t2 < F_HIT_MIN)
         { return false; }
 
         auto dist = ( t1 > F_HIT_MIN ) ? t1 : t2;
-        if ( dist > record.dist )
+        if ( dist > record.dist || dist > ray.t_max )
         { return false; }
 
         record.dist  = dist;
@@ -116,9 +128,16 @@ public:
         record.uv    = Vector2( phi * F_1DIV2PI, ( F_PI - theta ) * F_1DIVPI );
         record.shape = this;
         record.mat   = mat;
+        record.instance = nullptr;
 
         return true;
     }
+
+    Box bounds() const override
+    {
+        auto r = Vector3(radius, radius, radius);
+        return Box(pos - r, pos + r);
+    }
 };
 
 
@@ -128,26 +147,31 @@ public:
 class Triangle : public Shape
 {
 public:
-    static Triangle* create(const Vertex* vtx, const Material* mat)
+    static Triangle* create(const Vertex* vtx, uint16_t mat)
     {
         auto instance = new (std::nothrow) Triangle();
         instance->m_vtx     = vtx;
         instance->m_mat     = mat;
-
-        instance->m_edge[0] = vtx[1].pos - vtx[0].pos;
-        instance->m_edge[1] = vtx[2].pos - vtx[0].pos;
-        instance->m_center  = (vtx[0].pos + vtx[1].pos + vtx[2].pos) / 3.0f;
-
-        instance->m_box.mini = vtx[0].pos;
-        instance->m_box.maxi = vtx[0].pos;
-        instance->m_box.mini = min(instance->m_box.mini, vtx[1].pos);
-        instance->m_box.maxi = max(instance->m_box.maxi, vtx[1].pos);
-        instance->m_box.mini = min(instance->m_box.mini, vtx[2].pos);
-        instance->m_box.maxi = max(instance->m_box.maxi, vtx[2].pos);
+        instance->update();
 
         return instance;
     }
 
+    // 頂点を書き換えた後に呼び出して，辺・中心・ボックスを更新します.
+    void update()
+    {
+        m_edge[0] = m_vtx[1].pos - m_vtx[0].pos;
+        m_edge[1] = m_vtx[2].pos - m_vtx[0].pos;
+        m_center  = (m_vtx[0].pos + m_vtx[1].pos + m_vtx[2].pos) / 3.0f;
+
+        m_box.mini = m_vtx[0].pos;
+        m_box.maxi = m_vtx[0].pos;
+        m_box.mini = min(m_box.mini, m_vtx[1].pos);
+        m_box.maxi = max(m_box.maxi, m_vtx[1].pos);
+        m_box.mini = min(m_box.mini, m_vtx[2].pos);
+        m_box.maxi = max(m_box.maxi, m_vtx[2].pos);
+    }
+
     inline bool hit(const Ray& ray, HitRecord& record) const override
     {
         auto s1  = cross( ray.dir, m_edge[1] );
@@ -167,7 +191,7 @@ public:
         { return false; }
 
         auto dist = dot( m_edge[1], s2 ) / div;
-        if ( dist < F_HIT_MIN || dist > F_HIT_MAX )
+        if ( dist < F_HIT_MIN || dist > ray.t_max )
         { return false; }
 
         if ( dist >= record.dist )
@@ -177,6 +201,7 @@ public:
         record.dist  = dist;
         record.shape = this;
         record.mat   = m_mat;
+        record.instance = nullptr;
 
         auto alpha = 1.0f - beta - gamma;
         record.nrm = normalize(Vector3(
@@ -200,9 +225,12 @@ public:
     const Box& box() const
     { return m_box; }
 
+    Box bounds() const override
+    { return m_box; }
+
 private:
     const Vertex*   m_vtx;
-    const Material* m_mat;
+    uint16_t        m_mat;
     Vector3         m_edge[2];
     Vector3         m_center;
     Box             m_box;
@@ -217,32 +245,77 @@ public:
     static ShapeInstance* create(Shape* shape, const Matrix& world)
     {
         auto instance = new (std::nothrow) ShapeInstance();
-        instance->m_shape       = shape;
-        instance->m_world       = world;
-        instance->m_inv_world   = invert(world);
+        instance->m_shape = shape;
+        instance->set_world(world);
         return instance;
     }
 
+    // ワールド行列を変更します. 上位BVHに反映するには Scene::refit() を呼び出す.
+    void set_world(const Matrix& world)
+    {
+        auto inv_world = invert(world);
+
+        m_matrix    = world;
+        m_world     = Affine(world);
+        m_inv_world = Affine(inv_world);
+        m_normal    = Affine(transpose(inv_world));
+    }
+
+    const Matrix& world() const
+    { return m_matrix; }
+
     inline bool hit(const Ray& ray, HitRecord& record) const override
     {
-        auto pos = mul_coord ( ray.pos, m_inv_world );
-        auto dir = mul_normal( ray.dir, m_inv_world );
-        auto localRaySet = make_ray( pos, normalize(dir) );
+        // 方向を正規化しないので，局所空間でもレイのパラメータ(距離)はワールド空間と同じになる.
+        auto local = make_ray( mul(ray.pos, m_inv_world), mul_normal(ray.dir, m_inv_world), ray.t_max );
 
-        if ( m_shape->hit( localRaySet, record ) )
+        if ( !m_shape->hit( local, record ) )
+        { return false; }
+
+        // 入れ子のインスタンスは内側の法線の変換を先に済ませる.
+        if ( record.instance != nullptr )
+        { record.instance->resolve( record ); }
+
+        // 位置はワールド空間のレイから求め，法線は最も近い交差が確定してから変換する.
+        record.pos      = ray.pos + ray.dir * record.dist;
+        record.instance = this;
+        return true;
+    }
+
+    // 局所空間のままの法線をワールド空間に変換します.
+    void resolve(HitRecord& record) const
+    {
+        record.nrm      = normalize( mul_normal( record.nrm, m_normal ) );
+        record.instance = nullptr;
+    }
+
+    Box bounds() const override
+    {
+        // 参照先のボックスの8頂点を変換して囲み直す.
+        auto box = m_shape->bounds();
+
+        Box result;
+        for(auto i=0; i<8; ++i)
         {
-            record.pos = mul( record.pos, m_world );
-            record.nrm = mul_normal( record.nrm, transpose( m_inv_world ) );
-            return true;
+            auto p = mul(Vector3(
+                (i & 0x1) ? box.maxi.x : box.mini.x,
+                (i & 0x2) ? box.maxi.y : box.mini.y,
+                (i & 0x4) ? box.maxi.z : box.mini.z), m_world);
+
+            result.mini = min(result.mini, p);
+            result.maxi = max(result.maxi, p);
         }
+        result.empty = false;
 
-        return false;
+        return result;
     }
 
 private:
-    Shape* m_shape;
-    Matrix m_world;
-    Matrix m_inv_world;
+    Shape*  m_shape;
+    Matrix  m_matrix;       //!< ワールド行列.
+    Affine  m_world;        //!< 局所空間からワールド空間への変換.
+    Affine  m_inv_world;    //!< ワールド空間から局所空間への変換.
+    Affine  m_normal;       //!< 法線の変換(逆行列の転置).
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -251,24 +324,39 @@ private:
 class Mesh : public Shape
 {
 public:
-    static Mesh* create(const char* filename);
+    static Mesh* create(const char* filename, MaterialTable& mats);
     bool hit(const Ray& ray, HitRecord& record) const override;
 
+    Box bounds() const override
+    { return m_box; }
+
+    // BVH構築にかかった時間[sec].
+    double build_time() const
+    { return m_build_time; }
+
+    // 変形させる頂点. 書き換えた後は refit() を呼び出すこと.
+    Vertex* vertices()
+    { return m_vtxs.data(); }
+
+    size_t vertex_count() const
+    { return m_vtxs.size(); }
+
+    // 頂点の変形に合わせてBVHを更新します.
+    // SAHコストが基準の threshold 倍を超えて劣化した場合は再構築し，true を返します.
+    bool refit(float threshold = 1.5f);
+
 private:
     std::vector<Vertex>     m_vtxs;
-    std::vector<Material*>  m_mats;
     std::vector<Triangle*>  m_tris;
     std::vector<Texture*>   m_texs;
 
-    #if defined(ENABLE_AVX)
-        BVH8*               m_bvh;
-    #elif defined(ENABLE_SSE2)
-        BVH4*               m_bvh;
-    #else
-        BVH*                m_bvh;
-    #endif
+    Accelerator*            m_bvh;
+    Box                     m_box;
+    float                   m_base_cost;    //!< 品質監視の基準にする構築時のSAHコスト(更新に未対応なら負値).
+
+    double                  m_build_time;
 
-    bool load(const char* filename);
+    bool load(const char* filename, MaterialTable& mats);
 
     Mesh();
     ~Mesh();
@@ -0,0 +1,90 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_stats.h
+// Desc : Render Statistics.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+#pragma once
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_platform.h>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+
+
+//-------------------------------------------------------------------------------------------------
+// Macros
+//-------------------------------------------------------------------------------------------------
+// 走査の内側で数えるカウンターは ENABLE_STATS を定義した時だけ有効にする.
+#if defined(ENABLE_STATS)
+    #define R3D_STATS_ADD(counter, value)   Stats::local().add(Stats::counter, uint64_t(value))
+#else
+    #define R3D_STATS_ADD(counter, value)   ((void)0)
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Stats class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class Stats
+{
+public:
+    static constexpr int kMaxDepth = 16;    // 深度毎に数えるレイの最大深度.
+
+    enum Counter
+    {
+        CounterRays,            //!< 追跡したレイ数.
+        CounterNodes,           //!< 訪問したBVHノード数.
+        CounterBoxTests,        //!< AABBとの交差判定数.
+        CounterTriangleTests,   //!< 三角形との交差判定数.
+        CounterSphereTests,     //!< 球との交差判定数.
+        CounterRussianRoulette, //!< ロシアンルーレットで打ち切ったパス数.
+        CounterSamples,         //!< 完了したサンプル数.
+        Counter_Count,
+    };
+
+    struct Value
+    {
+        uint64_t    counters[Counter_Count];    // カウンター値.
+        uint64_t    rays[kMaxDepth];            // 深度毎のレイ数.
+    };
+
+    Stats();
+    Stats(const Stats& value);
+    Stats& operator = (const Stats& value);
+
+    // 所有スレッドだけが書き込むので，アトミックな加算は不要.
+    inline void add(Counter counter, uint64_t value = 1)
+    { increment(m_counters[counter], value); }
+
+    inline void add_ray(int depth)
+    {
+        increment(m_counters[CounterRays], 1);
+        increment(m_rays[(depth < kMaxDepth) ? depth : kMaxDepth - 1], 1);
+    }
+
+    // 他のスレッドから読み取れる値を取得します.
+    void gather(Value& value) const;
+
+    // 呼び出しスレッドのカウンターを設定します.
+    static void bind(Stats* stats);
+
+    // 呼び出しスレッドのカウンターを取得します.
+    static Stats& local();
+
+    static void reset(Value& value);
+    static void accumulate(Value& value, const Value& other);
+    static void print(const Value& value, double sec);
+    static bool write_json(FILE* fp, const Value& value, double sec);
+    static const char* name(Counter counter);
+
+private:
+    std::atomic<uint64_t>   m_counters[Counter_Count];
+    std::atomic<uint64_t>   m_rays[kMaxDepth];
+    uint8_t                 m_padding[64];      // 隣のスレッドとキャッシュラインを共有しないように空ける.
+
+    inline static void increment(std::atomic<uint64_t>& counter, uint64_t value)
+    { counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+};
@@ -12,6 +12,9 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -24,9 +27,10 @@ public:
     using task_func = std::function<void(T*, U*)>;
 
     task_system(uint32_t count, task_func func)
-    : m_count(count)
-    , m_func (func)
-    , m_finish(false)
+    : m_func   (func)
+    , m_count  (count)
+    , m_finish (false)
+    , m_pending(0)
     {
         m_data.resize(count);
     }
@@ -35,7 +39,10 @@ public:
     { return m_data[index]; }
 
     void enqueue(const T& data)
-    { m_queue.push(data); }
+    {
+        m_pending++;
+        m_queue.push(data);
+    }
 
     void run()
     {
@@ -61,9 +68,18 @@ public:
         m_worker.shrink_to_fit();
     }
 
+    // 積んだタスクが全て完了するか，終了要求が来るまで待機します.
+    // サンプリングの各パスの区切りで呼ばれるので，ポーリングせずに完了の通知を待つ.
+    void wait_idle()
+    {
+        std::unique_lock<std::mutex> locker(m_idle_mutex);
+        m_idle_cond.wait(locker, [this]() { return m_pending == 0 || m_finish; });
+    }
+
     void request_exit()
     {
         m_finish = true;
+        notify_idle();
     }
 
 private:
@@ -84,9 +100,14 @@ private:
                 { return; }
 
                 if (!m_owner.m_queue.pop(data))
-                { continue; }
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
 
                 m_owner.m_func(&data, &m_owner.m_data[m_id]);
+                if (--m_owner.m_pending == 0)
+                { m_owner.notify_idle(); }
             }
         }
 
@@ -95,10 +116,20 @@ private:
         task_system&    m_owner; 
     };
 
+    // 待機側が条件を確かめてから眠るまでの間に通知を取りこぼさないように，ロックを取ってから起こす.
+    void notify_idle()
+    {
+        std::lock_guard<std::mutex> locker(m_idle_mutex);
+        m_idle_cond.notify_all();
+    }
+
     task_func                   m_func;
     uint32_t                    m_count;
     std::vector<std::thread>    m_worker;
     std::vector<U>              m_data;
     lockfree_queue<T>           m_queue;
     std::atomic<bool>           m_finish;
+    std::atomic<uint32_t>       m_pending;
+    std::mutex                  m_idle_mutex;
+    std::condition_variable     m_idle_cond;
 };
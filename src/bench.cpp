@@ -0,0 +1,389 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : bench.cpp
+// Desc : Headless Benchmark Entry Point.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+#include <r3d_scene.h>
+#include <r3d_task.h>
+#include <r3d_sampler.h>
+#include <r3d_stats.h>
+#include <r3d_integrator.h>
+#include <r3d_cpu.h>
+#include <r3d_bvh.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif//NOMINMAX
+#include <Windows.h>
+#include <Psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif//defined(_WIN32)
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+const int     g_tile_size = 32;
+
+struct ThreadData
+{
+    Sampler                 sampler;
+    Stats                   stats;      // スレッド専用の統計カウンター.
+    const Scene*            scene;
+    std::vector<Vector3>*   image;      // 出力先(タイル毎に書き込む範囲が重ならない).
+};
+
+struct TaskData
+{
+    int x;              // タイルの左上X座標.
+    int y;              // タイルの左上Y座標.
+    int w;              // タイルの横幅.
+    int h;              // タイルの縦幅.
+    int samples;        // ピクセル当たりのサンプル数.
+};
+
+struct Option
+{
+    int             samples  = 16;          // ピクセル当たりのサンプル数.
+    uint32_t        threads  = 0;           // ワーカースレッド数(0なら自動).
+    int             repeat   = 1;           // 各シーンの計測回数.
+    const char*     json     = nullptr;     // 結果を書き出すJSONファイルパス.
+    const char*     filter   = nullptr;     // 計測するシーン名(nullptrなら全て).
+};
+
+struct Result
+{
+    const char*     name;           // シーン名.
+    int             width;          // 画像の横幅.
+    int             height;         // 画像の縦幅.
+    const char*     error;          // 計測できなかった理由(成功時は nullptr).
+    double          load_sec;       // シーン読み込み時間[sec](BVH構築時間は含まない).
+    double          build_sec;      // BVH構築時間[sec].
+    double          render_sec;     // 描画時間[sec](計測回数の最小値).
+    double          mrays;          // スループット[Mrays/sec].
+    double          luminance;      // 平均輝度(結果の検算用).
+    Stats::Value    stats;          // 統計カウンター.
+};
+
+//-------------------------------------------------------------------------------------------------
+//      プロセス全体のピークメモリ使用量を取得します.
+//      シーン毎の値ではないので，シーン毎に知りたい場合は --scene で1つずつ実行すること.
+//-------------------------------------------------------------------------------------------------
+uint64_t get_peak_memory()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    { return 0; }
+
+    return uint64_t(counters.PeakWorkingSetSize);
+#else
+    struct rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    { return 0; }
+
+    // Linux では KB 単位.
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+//      コマンドライン引数を解析します.
+//-------------------------------------------------------------------------------------------------
+bool parse_option(int argc, char** argv, Option& option)
+{
+    for(auto i=1; i<argc; ++i)
+    {
+        auto arg = argv[i];
+
+        if (strncmp(arg, "--samples=", 10) == 0)
+        { option.samples = std::max(1, atoi(arg + 10)); }
+        else if (strncmp(arg, "--threads=", 10) == 0)
+        { option.threads = uint32_t(std::max(0, atoi(arg + 10))); }
+        else if (strncmp(arg, "--repeat=", 9) == 0)
+        { option.repeat = std::max(1, atoi(arg + 9)); }
+        else if (strncmp(arg, "--json=", 7) == 0)
+        { option.json = arg + 7; }
+        else if (strncmp(arg, "--scene=", 8) == 0)
+        { option.filter = arg + 8; }
+        else if (strcmp(arg, "--compressed-bvh") == 0)
+        { Accelerator::set_compressed(true); }
+        else if (strcmp(arg, "--sbvh") == 0)
+        { Accelerator::set_spatial_split(0.3f); }
+        else if (strncmp(arg, "--sbvh=", 7) == 0)
+        { Accelerator::set_spatial_split(float(atof(arg + 7))); }
+        else if (strncmp(arg, "--isa=", 6) == 0)
+        {
+            CpuInfo::Isa isa;
+            if (!CpuInfo::parse(arg + 6, isa))
+            {
+                fprintf_s(stderr, "Error : Invalid ISA. %s\n", arg);
+                return false;
+            }
+            CpuInfo::set_limit(isa);
+        }
+        else
+        {
+            fprintf_s(stderr, "Error : Unknown Option. %s\n", arg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      タイルを描画します.
+//-------------------------------------------------------------------------------------------------
+void task_func(TaskData* task, ThreadData* thread_data)
+{
+    auto& sampler = thread_data->sampler;
+    auto  scene   = thread_data->scene;
+    auto& image   = *thread_data->image;
+
+    Stats::bind(&thread_data->stats);
+
+    for(auto y = task->y; y < task->y + task->h; ++y)
+    for(auto x = task->x; x < task->x + task->w; ++x)
+    {
+        Vector3 sum(0.0f, 0.0f, 0.0f);
+        for(auto i = 0; i < task->samples; ++i)
+        {
+            sampler.start(x, y, uint32_t(i));
+            sum += radiance(scene->emit(x, y, sampler), sampler, scene, nullptr);
+        }
+
+        image[x + y * scene->width()] = sum / float(task->samples);
+        thread_data->stats.add(Stats::CounterSamples, uint64_t(task->samples));
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      1シーンを計測します.
+//-------------------------------------------------------------------------------------------------
+bool run_scene(Scene::Preset preset, const Option& option, uint32_t thread_count, Result& result)
+{
+    Scene scene;
+
+    result.name  = Scene::preset_name(preset);
+    result.error = nullptr;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    if (!scene.load(preset))
+    {
+        // 欠けたシーンの計測値を混ぜないように，計測せずにエラーとして報告する.
+        fprintf_s(stderr, "Error : Scene Load Failed. %s\n", Scene::preset_name(preset));
+        result.error = "scene load failed";
+        return false;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    auto w = scene.width();
+    auto h = scene.height();
+
+    // 読み込み時間にはメッシュのBVH構築時間が含まれているので，別々に報告する.
+    result.width     = w;
+    result.height    = h;
+    result.build_sec = scene.build_time();
+    result.load_sec  = std::max(0.0, std::chrono::duration<double>(end - begin).count() - result.build_sec);
+
+    std::vector<Vector3> image(size_t(w) * size_t(h), Vector3(0.0f, 0.0f, 0.0f));
+
+    result.render_sec = 0.0;
+    result.mrays      = 0.0;
+
+    for(auto r=0; r<option.repeat; ++r)
+    {
+        task_system<TaskData, ThreadData> task(thread_count, task_func);
+
+        // 毎回同じ乱数列になるように，決定的なサンプラーを使う.
+        for(uint32_t i=0; i<thread_count; ++i)
+        {
+            auto& data = task.thread_data(i);
+            data.scene = &scene;
+            data.image = &image;
+            data.sampler.set_type(Sampler::Independent);
+            data.sampler.set_deterministic(true);
+            data.sampler.set_seed(0);
+        }
+
+        for(auto y = 0; y < h; y += g_tile_size)
+        for(auto x = 0; x < w; x += g_tile_size)
+        {
+            TaskData info;
+            info.x       = x;
+            info.y       = y;
+            info.w       = std::min(g_tile_size, w - x);
+            info.h       = std::min(g_tile_size, h - y);
+            info.samples = option.samples;
+
+            task.enqueue(info);
+        }
+
+        begin = std::chrono::high_resolution_clock::now();
+        task.run();
+        task.wait_idle();
+        end = std::chrono::high_resolution_clock::now();
+
+        task.request_exit();
+        task.wait();
+
+        Stats::Value stats;
+        Stats::reset(stats);
+        for(uint32_t i=0; i<thread_count; ++i)
+        {
+            Stats::Value value;
+            task.thread_data(i).stats.gather(value);
+            Stats::accumulate(stats, value);
+        }
+
+        // 最も速かった回を採用する.
+        auto sec = std::chrono::duration<double>(end - begin).count();
+        if (r == 0 || sec < result.render_sec)
+        {
+            result.render_sec = sec;
+            result.mrays      = double(stats.counters[Stats::CounterRays]) * 1e-6 / sec;
+            result.stats      = stats;
+        }
+    }
+
+    double sum = 0.0;
+    for(auto& pixel : image)
+    { sum += 0.2126 * pixel.x + 0.7152 * pixel.y + 0.0722 * pixel.z; }
+
+    result.luminance = sum / double(image.size());
+
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      計測結果をJSON形式で書き出します.
+//-------------------------------------------------------------------------------------------------
+bool write_json(const char* path, const Option& option, uint32_t thread_count, uint64_t peak_memory, const std::vector<Result>& results)
+{
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, path, "w");
+    if (err != 0 || fp == nullptr)
+    {
+        fprintf_s(stderr, "Error : File Open Failed. path = %s\n", path);
+        return false;
+    }
+
+    fprintf_s(fp, "{\n");
+    fprintf_s(fp, "  \"samples\": %d,\n", option.samples);
+    fprintf_s(fp, "  \"threads\": %u,\n", thread_count);
+    fprintf_s(fp, "  \"repeat\": %d,\n", option.repeat);
+    fprintf_s(fp, "  \"process_peak_memory_mb\": %.2f,\n", double(peak_memory) / (1024.0 * 1024.0));
+    fprintf_s(fp, "  \"scenes\": [\n");
+
+    for(size_t i=0; i<results.size(); ++i)
+    {
+        auto& r = results[i];
+        fprintf_s(fp, "    {\n");
+        fprintf_s(fp, "      \"name\": \"%s\",\n", r.name);
+
+        if (r.error != nullptr)
+        {
+            fprintf_s(fp, "      \"error\": \"%s\"\n", r.error);
+            fprintf_s(fp, "    }%s\n", (i + 1 < results.size()) ? "," : "");
+            continue;
+        }
+
+        fprintf_s(fp, "      \"width\": %d,\n", r.width);
+        fprintf_s(fp, "      \"height\": %d,\n", r.height);
+        fprintf_s(fp, "      \"load_ms\": %.3f,\n", r.load_sec * 1000.0);
+        fprintf_s(fp, "      \"build_ms\": %.3f,\n", r.build_sec * 1000.0);
+        fprintf_s(fp, "      \"render_sec\": %.4f,\n", r.render_sec);
+        fprintf_s(fp, "      \"mrays_per_sec\": %.3f,\n", r.mrays);
+        fprintf_s(fp, "      \"rays\": %llu,\n", static_cast<unsigned long long>(r.stats.counters[Stats::CounterRays]));
+        fprintf_s(fp, "      \"luminance\": %.6f\n", r.luminance);
+        fprintf_s(fp, "    }%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+
+    fprintf_s(fp, "  ]\n");
+    fprintf_s(fp, "}\n");
+
+    auto ret = ferror(fp) == 0;
+    fclose(fp);
+
+    return ret;
+}
+
+} // namespace
+
+
+//-------------------------------------------------------------------------------------------------
+//      メインエントリーポイントです.
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    Option option;
+    if (!parse_option(argc, argv, option))
+    { return -1; }
+
+    auto thread_count = option.threads;
+    if (thread_count == 0)
+    { thread_count = std::max(1u, std::thread::hardware_concurrency()); }
+
+    printf_s("* samples  : %d\n", option.samples);
+    printf_s("* threads  : %u\n", thread_count);
+    printf_s("* repeat   : %d\n", option.repeat);
+    printf_s("* simd     : %s (%s)\n", CpuInfo::name(CpuInfo::isa()), Accelerator::kernel_name());
+    printf_s("%-10s %9s %9s %9s %9s %10s\n",
+        "scene", "load(ms)", "bvh(ms)", "time(s)", "Mrays/s", "luminance");
+
+    std::vector<Result> results;
+    auto ret = 0;
+
+    for(auto i=0; i<Scene::Preset_Count; ++i)
+    {
+        auto preset = Scene::Preset(i);
+        if (option.filter != nullptr && strcmp(option.filter, Scene::preset_name(preset)) != 0)
+        { continue; }
+
+        Result result = {};
+        if (!run_scene(preset, option, thread_count, result))
+        {
+            printf_s("%-10s error : %s\n", result.name, result.error);
+            results.push_back(result);
+            ret = -1;
+            continue;
+        }
+
+        printf_s("%-10s %9.2f %9.2f %9.3f %9.2f %10.5f\n",
+            result.name,
+            result.load_sec  * 1000.0,
+            result.build_sec * 1000.0,
+            result.render_sec,
+            result.mrays,
+            result.luminance);
+
+        results.push_back(result);
+    }
+
+    // 最大のシーンの値がそれ以降のシーンにも残るので，シーン毎ではなく最後に1回だけ出す.
+    auto peak_memory = get_peak_memory();
+    printf_s("* peak     : %.2f(MB) (process)\n", double(peak_memory) / (1024.0 * 1024.0));
+
+    if (option.json != nullptr && !write_json(option.json, option, thread_count, peak_memory, results))
+    { ret = -1; }
+
+    return ret;
+}
@@ -14,12 +14,19 @@
 #include <r3d_scene.h>
 #include <r3d_canvas.h>
 #include <r3d_task.h>
+#include <r3d_sampler.h>
+#include <r3d_checkpoint.h>
+#include <r3d_stats.h>
+#include <r3d_integrator.h>
+#include <r3d_cpu.h>
+#include <r3d_bvh.h>
 #include <vector>
 #include <algorithm>
 #include <atomic>
 #include <thread>
+#include <chrono>
 #include <cassert>
-#include <direct.h>
+#include <cstring>
 
 
 namespace {
@@ -27,155 +34,670 @@ namespace {
 //-------------------------------------------------------------------------------------------------
 // Global Varaibles.
 //-------------------------------------------------------------------------------------------------
-const int     g_max_depth = 3;
+const int     g_tile_size = 32;
+const int     g_adaptive_min   = 16;    // 適応サンプリングの初回サンプル数.
+const int     g_adaptive_batch = 16;    // 適応サンプリングで1回に追加する平均サンプル数.
+const int     g_deterministic_chunk = 16;   // 決定的モードで1回に処理するサンプル数.
 Scene         g_scene;
 
 struct ThreadData
 {
-    Random              random;
+    Sampler             sampler;
+    TileBuffer          tile;           // スレッド専用の累積バッファ.
+    Stats               stats;          // スレッド専用の統計カウンター.
     const Scene*        scene;
     Canvas*             canvas;
     std::atomic<bool>*  is_finish;
-    float               inv_s;
 };
 
 struct TaskData
 {
-    int w;
-    int h;
+    int x;              // タイルの左上X座標.
+    int y;              // タイルの左上Y座標.
+    int w;              // タイルの横幅.
+    int h;              // タイルの縦幅.
+    int sample_begin;   // 開始サンプル番号.
+    int sample_end;     // 終了サンプル番号(この番号は含まない).
 };
 
-//-------------------------------------------------------------------------------------------------
-//      放射輝度を求めます.
-//-------------------------------------------------------------------------------------------------
-Vector3 radiance(const Ray& input_ray, Random& random, const Scene* scene)
+struct Option
+{
+    const char*     scene   = "test_scene.xml";         // シーンファイル.
+    Sampler::Type   sampler = Sampler::Independent;     // サンプラーの種類.
+    bool            deterministic = false;              // スレッド数に依存しない決定的な描画を行うか?
+    bool            adaptive  = false;                  // 適応サンプリングを行うか?
+    float           threshold = 0.02f;                  // 適応サンプリングで収束とみなす相対誤差.
+    double          time_limit = 272.0;                 // 制限時間[sec](レイトレ合宿5のルール準拠).
+    double          capture    = 30.0;                  // キャプチャー間隔[sec](0以下で無効).
+    Canvas::Filter  filter     = Canvas::FilterNone;    // 出力時のノイズ除去フィルタ.
+    bool            aov        = false;                 // AOVを出力するか?
+    Canvas::Format  format     = Canvas::FormatBMP;     // キャプチャーのファイル形式.
+    const char*     checkpoint = nullptr;               // チェックポイントのファイルパス(nullptr なら担当番号から決める).
+    double          checkpoint_interval = 0.0;          // チェックポイントの保存間隔[sec](0以下で無効).
+    bool            resume     = false;                 // チェックポイントから再開するか?
+    int             shard      = 0;                     // 分散描画時の担当番号.
+    int             shard_count = 1;                    // 分散描画時の分割数.
+    const char*     partial    = nullptr;               // 分散描画時の部分結果のファイルパス.
+    const char*     merge      = nullptr;               // 部分結果を統合した画像の出力パス.
+    const char*     stats      = nullptr;               // 統計情報を書き出すJSONファイルパス.
+    bool            sequence   = false;                 // カメラとインスタンスを動かしながら連番で描画するか?
+    int             frames     = 0;                     // 連番描画のフレーム数(0 ならキーフレーム数).
+    std::vector<const char*> inputs;                    // オプション以外の引数(統合時は部分結果のファイルパス).
+};
+
+struct TileState
+{
+    int     x;
+    int     y;
+    int     w;
+    int     h;
+    int     samples;    // 割り当て済みサンプル数.
+    float   error;      // 相対誤差.
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// TimeBudget class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class TimeBudget
 {
-    Vector3 L(0, 0, 0);
-    Vector3 W(1, 1, 1);
-    Ray ray = make_ray(input_ray.pos, input_ray.dir);
+public:
+    static constexpr double kSafety = 0.9;      // 見積もりに対する安全率.
+    static constexpr double kReserve = 1.0;     // 最終出力のために残しておく時間[sec].
+
+    TimeBudget(std::chrono::system_clock::time_point start, double limit)
+    : m_start   (start)
+    , m_limit   (limit)
+    , m_rate    (0.0)
+    , m_begin   (start)
+    { /* DO_NOTHING */ }
+
+    // 開始からの経過時間[sec]を返します.
+    double elapsed() const
+    {
+        auto curr = std::chrono::system_clock::now();
+        return std::chrono::duration<double>(curr - m_start).count();
+    }
+
+    // 描画に使える残り時間[sec]を返します.
+    double remaining() const
+    { return m_limit - kReserve - elapsed(); }
+
+    // 計測を開始します.
+    void begin()
+    { m_begin = std::chrono::system_clock::now(); }
 
-    auto direct_light = true;
+    // 計測を終了し，スループットの見積もりを更新します.
+    void end(uint64_t samples)
+    {
+        auto curr = std::chrono::system_clock::now();
+        auto sec  = std::chrono::duration<double>(curr - m_begin).count();
+        if (sec <= 0.0)
+        { return; }
+
+        auto rate = double(samples) / sec;
+        m_rate = (m_rate > 0.0) ? (m_rate * 0.5 + rate * 0.5) : rate;
+    }
 
-    for(int depth=0;; depth++)
+    // 残り時間で処理できるサンプル数の見積もりを返します.
+    uint64_t affordable() const
     {
-        HitRecord record = {};
+        if (m_rate <= 0.0)
+        { return UINT64_MAX; }
 
-        if (!scene->hit(ray, record))
+        auto sec = remaining();
+        if (sec <= 0.0)
+        { return 0; }
+
+        return uint64_t(sec * m_rate * kSafety);
+    }
+
+    // スループット[samples/sec]を返します.
+    double rate() const
+    { return m_rate; }
+
+private:
+    std::chrono::system_clock::time_point   m_start;    // 開始時刻.
+    double                                  m_limit;    // 制限時間[sec].
+    double                                  m_rate;     // スループットの見積もり[samples/sec].
+    std::chrono::system_clock::time_point   m_begin;    // 計測開始時刻.
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// RenderContext structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct RenderContext
+{
+    task_system<TaskData, ThreadData>*  task;
+    Canvas*                             canvas;
+    TimeBudget*                         budget;
+    const std::atomic<bool>*            is_finish;
+    std::atomic<int>*                   counter;        // キャプチャー番号.
+    uint32_t                            thread_count;
+    Checkpoint                          progress;       // 進捗状況(チェックポイントに保存する).
+    const char*                         checkpoint;     // チェックポイントのファイルパス.
+    double                              interval;       // チェックポイントの保存間隔[sec].
+    double                              last_save;      // 最後にチェックポイントを保存した時刻[sec].
+};
+
+//-------------------------------------------------------------------------------------------------
+//      コマンドライン引数を解析します.
+//-------------------------------------------------------------------------------------------------
+bool parse_option(int argc, char** argv, Option& option)
+{
+    for(auto i=1; i<argc; ++i)
+    {
+        auto arg = argv[i];
+
+        if (strncmp(arg, "--", 2) != 0)
         {
-            L += W * scene->sample_ibl(ray.dir);
-            break;
+            option.inputs.push_back(arg);
+            continue;
         }
 
-        auto p = record.mat->threshold();
+        if (strcmp(arg, "--sampler=random") == 0)
+        { option.sampler = Sampler::Independent; }
+        else if (strcmp(arg, "--sampler=sobol") == 0)
+        { option.sampler = Sampler::Sobol; }
+        else if (strcmp(arg, "--sampler=bluenoise") == 0)
+        { option.sampler = Sampler::BlueNoise; }
+        else if (strcmp(arg, "--deterministic") == 0)
+        { option.deterministic = true; }
+        else if (strcmp(arg, "--filter=none") == 0)
+        { option.filter = Canvas::FilterNone; }
+        else if (strcmp(arg, "--filter=median") == 0)
+        { option.filter = Canvas::FilterMedian; }
+        else if (strcmp(arg, "--filter=atrous") == 0)
+        { option.filter = Canvas::FilterATrous; }
+        else if (strcmp(arg, "--format=bmp") == 0)
+        { option.format = Canvas::FormatBMP; }
+        else if (strcmp(arg, "--format=png") == 0)
+        { option.format = Canvas::FormatPNG; }
+        else if (strcmp(arg, "--format=hdr") == 0)
+        { option.format = Canvas::FormatHDR; }
+        else if (strcmp(arg, "--format=pfm") == 0)
+        { option.format = Canvas::FormatPFM; }
+        else if (strncmp(arg, "--checkpoint=", 13) == 0)
+        { option.checkpoint_interval = atof(arg + 13); }
+        else if (strncmp(arg, "--checkpoint-file=", 18) == 0)
+        { option.checkpoint = arg + 18; }
+        else if (strcmp(arg, "--resume") == 0)
+        { option.resume = true; }
+        else if (strncmp(arg, "--shard=", 8) == 0)
+        {
+            if (sscanf_s(arg + 8, "%d/%d", &option.shard, &option.shard_count) != 2
+             || option.shard_count < 1
+             || option.shard < 0
+             || option.shard >= option.shard_count)
+            {
+                fprintf_s(stderr, "Error : Invalid Shard. %s\n", arg);
+                return false;
+            }
+        }
+        else if (strncmp(arg, "--partial=", 10) == 0)
+        { option.partial = arg + 10; }
+        else if (strncmp(arg, "--merge=", 8) == 0)
+        { option.merge = arg + 8; }
+        else if (strncmp(arg, "--stats=", 8) == 0)
+        { option.stats = arg + 8; }
+        else if (strcmp(arg, "--aov") == 0)
+        { option.aov = true; }
+        else if (strcmp(arg, "--adaptive") == 0)
+        { option.adaptive = true; }
+        else if (strncmp(arg, "--threshold=", 12) == 0)
+        { option.threshold = float(atof(arg + 12)); }
+        else if (strncmp(arg, "--time=", 7) == 0)
+        { option.time_limit = atof(arg + 7); }
+        else if (strncmp(arg, "--capture=", 10) == 0)
+        { option.capture = atof(arg + 10); }
+        else if (strcmp(arg, "--sequence") == 0)
+        { option.sequence = true; }
+        else if (strncmp(arg, "--frames=", 9) == 0)
+        {
+            option.sequence = true;
+            option.frames   = std::max(1, atoi(arg + 9));
+        }
+        else if (strcmp(arg, "--compressed-bvh") == 0)
+        { Accelerator::set_compressed(true); }
+        else if (strcmp(arg, "--sbvh") == 0)
+        { Accelerator::set_spatial_split(0.3f); }
+        else if (strncmp(arg, "--sbvh=", 7) == 0)
+        { Accelerator::set_spatial_split(float(atof(arg + 7))); }
+        else if (strncmp(arg, "--isa=", 6) == 0)
+        {
+            CpuInfo::Isa isa;
+            if (!CpuInfo::parse(arg + 6, isa))
+            {
+                fprintf_s(stderr, "Error : Invalid ISA. %s\n", arg);
+                return false;
+            }
+            CpuInfo::set_limit(isa);
+        }
+        else
+        {
+            fprintf_s(stderr, "Error : Unknown Option. %s\n", arg);
+            return false;
+        }
+    }
+
+    // 統合モードでなければ最後の引数をシーンファイルとする.
+    if (option.merge == nullptr && !option.inputs.empty())
+    { option.scene = option.inputs.back(); }
 
-        //if (direct_light)
-        { L += W * record.mat->emissive(); }
+    if (option.adaptive && option.shard_count > 1)
+    {
+        fprintf_s(stderr, "Error : Adaptive Sampling Cannot Be Sharded.\n");
+        return false;
+    }
+
+    // チェックポイントと部分結果は1フレーム分しか持てない.
+    if (option.sequence
+     && (option.resume || option.shard_count > 1 || option.partial != nullptr || option.checkpoint_interval > 0.0))
+    {
+        fprintf_s(stderr, "Error : Sequence Cannot Be Sharded Or Checkpointed.\n");
+        return false;
+    }
 
-        direct_light = record.mat->is_delta();
+    return true;
+}
 
-        // 打ち切り深度に達したら終わり.
-        if(depth > g_max_depth)
+void task_func(TaskData* task, ThreadData* thread_data)
+{
+    auto& sampler = thread_data->sampler;
+    auto& tile    = thread_data->tile;
+
+    // 統計はスレッド専用のカウンターに記録する.
+    Stats::bind(&thread_data->stats);
+
+    // 共有のキャンバスには直接書き込まず，スレッド専用のバッファに累積する.
+    auto has_aov = thread_data->canvas->has_aov();
+    tile.reset(task->x, task->y, task->w, task->h, has_aov);
+
+    auto finish = false;
+    for(auto y = task->y; y < task->y + task->h && !finish; ++y)
+    for(auto x = task->x; x < task->x + task->w && !finish; ++x)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+
+        // 1ピクセルのサンプルは常に番号順に加算するので，加算順序がスレッド数に依存しない.
+        for(auto i = task->sample_begin; i < task->sample_end; ++i)
         {
-            if (random.get_as_float() >= p)
+            sampler.start(x, y, uint32_t(i));
+
+            if (has_aov)
             {
-                break;
+                AOV aov;
+                auto L = radiance(thread_data->scene->emit(x, y, sampler), sampler, thread_data->scene, &aov);
+                tile.add(x, y, L, aov);
+            }
+            else
+            {
+                auto L = radiance(thread_data->scene->emit(x, y, sampler), sampler, thread_data->scene, nullptr);
+                tile.add(x, y, L);
             }
         }
-        else
+
+        if (has_aov)
         {
-            p = 1.0f;
+            auto end = std::chrono::high_resolution_clock::now();
+            tile.add_time(x, y, std::chrono::duration<float>(end - begin).count());
         }
 
-        ShadingArg arg = {};
-        arg.input  = ray.dir;
-        arg.normal = record.nrm;
-        arg.random = &random;
-        arg.uv     = record.uv;
+        thread_data->stats.add(Stats::CounterSamples, uint64_t(task->sample_end - task->sample_begin));
 
-        // マテリアルの評価.
-        auto w = record.mat->shade(arg);
+        // サンプル数はピクセル毎に記録されるので，途中で打ち切っても問題ない.
+        finish = *thread_data->is_finish;
+    }
 
-        //// 直接光をサンプル.
-        //if (obj != g_spheres[g_lightId] && !record.mat->is_delta())
-        //{
-        //    Vector3 light_pos;
-        //    Vector3 light_nrm;
-        //    g_spheres[g_lightId]->sample(*random, light_pos, light_nrm);
+    // タイル単位でまとめてキャンバスに反映する.
+    thread_data->canvas->commit(tile);
+}
 
-        //    // ライトベクトル.
-        //    auto light_dir = light_pos - hit_pos;
+//-------------------------------------------------------------------------------------------------
+//      タイル単位のタスクを積みます.
+//-------------------------------------------------------------------------------------------------
+void enqueue_tiles
+(
+    task_system<TaskData, ThreadData>&  task,
+    int                                 w,
+    int                                 h,
+    int                                 sample_begin,
+    int                                 sample_end
+)
+{
+    for(auto y = 0; y < h; y += g_tile_size)
+    for(auto x = 0; x < w; x += g_tile_size)
+    {
+        TaskData info;
+        info.x            = x;
+        info.y            = y;
+        info.w            = std::min(g_tile_size, w - x);
+        info.h            = std::min(g_tile_size, h - y);
+        info.sample_begin = sample_begin;
+        info.sample_end   = sample_end;
 
-        //    // ライトへの距離の2乗
-        //    auto light_dist2 = dot(light_dir, light_dir);
+        task.enqueue(info);
+    }
+}
 
-        //    // 正規化.
-        //    light_dir = normalize(light_dir);
+//-------------------------------------------------------------------------------------------------
+//      全スレッドの統計を集計します.
+//-------------------------------------------------------------------------------------------------
+void gather_stats
+(
+    task_system<TaskData, ThreadData>&  task,
+    uint32_t                            thread_count,
+    Stats::Value&                       result
+)
+{
+    Stats::reset(result);
 
-        //    ShadowRecord shadow_rec;
-        //    Ray    shadow_ray(hit_pos, light_dir);
+    for(uint32_t i=0; i<thread_count; ++i)
+    {
+        Stats::Value value;
+        task.thread_data(i).stats.gather(value);
+        Stats::accumulate(result, value);
+    }
+}
 
-        //    // シャドウレイを発射.
-        //    auto hit = intersect_scene(shadow_ray, shadow_rec);
+//-------------------------------------------------------------------------------------------------
+//      チェックポイントを保存します.
+//      ワーカースレッドが全タスクを終えて待機している時に呼び出します.
+//-------------------------------------------------------------------------------------------------
+void save_checkpoint(RenderContext& ctx, bool force)
+{
+    if (ctx.interval <= 0.0 || *ctx.is_finish)
+    { return; }
 
-        //    // ライトのみと衝突した場合のみ寄与を取る.
-        //    {
-        //        auto hit_light = hit && (shadow_rec.shape == g_spheres[g_lightId]);
-        //        if (hit_light)
-        //        {
-        //            // 物体からのレイの入出を考慮した法線ベクトル.
-        //            const auto orienting_normal = (dot(normal, ray.dir) < 0.0) ? normal : -normal;
+    auto sec = ctx.budget->elapsed();
+    if (!force && sec - ctx.last_save < ctx.interval)
+    { return; }
 
-        //            auto dot0 = abs(dot(orienting_normal, light_dir));
-        //            auto dot1 = abs(dot(light_nrm,       -light_dir));
+    auto& progress = ctx.progress;
+    progress.header.capture = uint32_t(ctx.counter->load());
 
-        //            auto G = (dot0 * dot1) / light_dist2;
+    progress.randoms.resize(ctx.thread_count);
+    for(uint32_t i=0; i<ctx.thread_count; ++i)
+    { progress.randoms[i] = ctx.task->thread_data(i).sampler.random(); }
 
-        //            // ライトの確率密度.
-        //            auto light_pdf2 = shadow_rec.pdf * shadow_rec.pdf;
+    if (progress.save(ctx.checkpoint, *ctx.canvas))
+    { printf_s("checkpoint. %s (sample %u)\n", ctx.checkpoint, progress.header.next_sample); }
 
-        //            // BRDFの確率密度.
-        //            auto brdf_pdf  = (arg.pdf / light_dist2);
-        //            auto brdf_pdf2 = brdf_pdf * brdf_pdf;
+    ctx.last_save = sec;
+}
 
-        //            // 多重重点的サンプルの重みを求める.
-        //            auto mis_weight = light_pdf2 / (light_pdf2 + brdf_pdf2);
+//-------------------------------------------------------------------------------------------------
+//      全画面を chunk サンプルずつ描画します.
+//      use_budget が true なら制限時間内に収まるように打ち切ります.
+//-------------------------------------------------------------------------------------------------
+void render_progressive
+(
+    RenderContext&  ctx,
+    int             w,
+    int             h,
+    int             s,
+    int             chunk,
+    bool            use_budget
+)
+{
+    auto& budget = *ctx.budget;
 
-        //            L += W * shadow_rec.mat->emissive() * (w / F_PI) * G * mis_weight / shadow_rec.pdf;
-        //        }
-        //    }
-        //}
+    for(auto loop = int(ctx.progress.header.next_sample); loop < s && !*ctx.is_finish; loop += chunk)
+    {
+        auto end          = std::min(loop + chunk, s);
+        auto pass_samples = uint64_t(w) * uint64_t(h) * uint64_t(end - loop);
 
-        // レイを更新.
-        ray = make_ray(record.pos, arg.output);
+        // 締め切りまでに終わらないパスは開始しない.
+        if (use_budget && budget.affordable() < pass_samples)
+        { break; }
 
-        // 重み更新.
-        W *= (w / p);
+        budget.begin();
+        enqueue_tiles(*ctx.task, w, h, loop, end);
+        ctx.task->wait_idle();
+        budget.end(pass_samples);
 
-        // 重みがゼロなら計算しても意味ないので打ち切り.
-        if (is_zero(W))
+        // 全タイルが同じサンプル数になっている時点で保存する.
+        if (*ctx.is_finish)
         { break; }
-    }
 
-    return L;
+        ctx.progress.header.next_sample = uint32_t(end);
+        save_checkpoint(ctx, false);
+    }
 }
 
-void task_func(TaskData* task, ThreadData* thread_data)
+//-------------------------------------------------------------------------------------------------
+//      適応サンプリングで描画します.
+//-------------------------------------------------------------------------------------------------
+void render_adaptive
+(
+    RenderContext&  ctx,
+    int             w,
+    int             h,
+    int             s,
+    float           threshold
+)
 {
-    for(auto y = 0; y < task->h; ++y)
-    for(auto x = 0; x < task->w; ++x)
+    auto& task   = *ctx.task;
+    auto& canvas = *ctx.canvas;
+    auto& budget = *ctx.budget;
+
+    std::vector<TileState> tiles;
+    for(auto y = 0; y < h; y += g_tile_size)
+    for(auto x = 0; x < w; x += g_tile_size)
     {
-        thread_data->canvas->add(x, y,
-            radiance(
-                thread_data->scene->emit(float(x), float(y)),
-                thread_data->random,
-                thread_data->scene) * thread_data->inv_s);
+        TileState tile;
+        tile.x       = x;
+        tile.y       = y;
+        tile.w       = std::min(g_tile_size, w - x);
+        tile.h       = std::min(g_tile_size, h - y);
+        tile.samples = 0;
+        tile.error   = F_MAX;
+        tiles.push_back(tile);
+    }
 
-        if (*thread_data->is_finish)
-        { return; }
+    // 全体のサンプル数は均一に s サンプル描画した場合と同じにする.
+    auto total = uint64_t(s) * uint64_t(w) * uint64_t(h);
+    auto used  = uint64_t(0);
+
+    std::vector<TileState*> active;
+    active.reserve(tiles.size());
+
+    auto& tile_samples = ctx.progress.tile_samples;
+    if (tile_samples.size() == tiles.size())
+    {
+        // チェックポイントから再開する場合は，割り当て済みのサンプル数と誤差を復元する.
+        for(size_t i=0; i<tiles.size(); ++i)
+        {
+            auto& tile = tiles[i];
+            tile.samples = tile_samples[i];
+            used += uint64_t(tile.w * tile.h) * uint64_t(tile.samples);
+
+            if (tile.samples > 0)
+            { tile.error = canvas.error(tile.x, tile.y, tile.w, tile.h); }
+
+            if (tile.error > threshold)
+            { active.push_back(&tile); }
+        }
+
+        std::sort(active.begin(), active.end(),
+            [](const TileState* lhs, const TileState* rhs)
+            { return lhs->error > rhs->error; });
+    }
+    else
+    {
+        // 最初は均一にサンプルを割り当てて誤差を推定する.
+        for(auto& tile : tiles)
+        { active.push_back(&tile); }
     }
+
+    auto batch = std::min(g_adaptive_min, s);
+
+    while(!active.empty() && !*ctx.is_finish)
+    {
+        auto mean_error = 0.0f;
+        for(auto tile : active)
+        { mean_error += min(tile->error, 1e6f); }
+        mean_error /= float(active.size());
+
+        // 残り時間で処理できる分だけ割り当てる.
+        auto limit = std::min(total - used, budget.affordable());
+        auto round = uint64_t(0);
+
+        auto enqueued = false;
+        for(auto tile : active)
+        {
+            // 誤差に比例してサンプル数を割り当てる.
+            auto n = batch;
+            if (tile->error < F_MAX)
+            {
+                n = int(float(g_adaptive_batch) * tile->error / mean_error + 0.5f);
+                n = std::max(1, std::min(n, g_adaptive_batch * 4));
+            }
+
+            auto area = uint64_t(tile->w * tile->h);
+            if (round + area * n > limit)
+            { continue; }
+
+            TaskData info;
+            info.x            = tile->x;
+            info.y            = tile->y;
+            info.w            = tile->w;
+            info.h            = tile->h;
+            info.sample_begin = tile->samples;
+            info.sample_end   = tile->samples + n;
+            task.enqueue(info);
+
+            tile->samples += n;
+            round         += area * n;
+            enqueued       = true;
+        }
+
+        if (!enqueued)
+        { break; }
+
+        budget.begin();
+        task.wait_idle();
+        budget.end(round);
+
+        used += round;
+
+        // 誤差を更新して，収束していないタイルを誤差の大きい順に並べる.
+        active.clear();
+        for(auto& tile : tiles)
+        {
+            tile.error = canvas.error(tile.x, tile.y, tile.w, tile.h);
+            if (tile.error > threshold)
+            { active.push_back(&tile); }
+        }
+
+        std::sort(active.begin(), active.end(),
+            [](const TileState* lhs, const TileState* rhs)
+            { return lhs->error > rhs->error; });
+
+        if (*ctx.is_finish)
+        { break; }
+
+        tile_samples.resize(tiles.size());
+        for(size_t i=0; i<tiles.size(); ++i)
+        { tile_samples[i] = tiles[i].samples; }
+
+        save_checkpoint(ctx, false);
+    }
+
+    printf_s("* adaptive : %zu / %zu tiles converged.\n", tiles.size() - active.size(), tiles.size());
 }
 
 
+//-------------------------------------------------------------------------------------------------
+//      オプションに応じた方法で1フレームを描画します.
+//-------------------------------------------------------------------------------------------------
+void render_frame(RenderContext& ctx, const Option& option, int w, int h, int s, int sample_end)
+{
+    if (option.adaptive)
+    {
+        // 誤差の大きいタイルにサンプルを追加していく.
+        render_adaptive(ctx, w, h, s, option.threshold);
+    }
+    else if (option.deterministic)
+    {
+        // タイル毎に一定数のサンプルをまとめて処理する.
+        // 決定性を保つため，制限時間によるサンプル数の調整は行わない.
+        render_progressive(ctx, w, h, sample_end, g_deterministic_chunk, false);
+    }
+    else
+    {
+        // 全画面を1サンプルずつ処理していく.
+        render_progressive(ctx, w, h, sample_end, 1, true);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      分散描画の部分結果を統合して画像を出力します.
+//-------------------------------------------------------------------------------------------------
+int merge_partials(const Option& option)
+{
+    if (option.inputs.empty())
+    {
+        fprintf_s(stderr, "Error : No Partial Files.\n");
+        return -1;
+    }
+
+    Checkpoint::Header header;
+    if (!Checkpoint::read_header(option.inputs[0], header))
+    { return -1; }
+
+    Canvas canvas;
+    canvas.enable_aov((header.flags & Checkpoint::FlagAOV) != 0);
+    canvas.resize(header.width, header.height);
+    canvas.set_filter(option.filter);
+
+    std::vector<bool> merged(header.shard_count, false);
+
+    for(auto path : option.inputs)
+    {
+        Checkpoint::Header head;
+        if (!Checkpoint::read_header(path, head))
+        { return -1; }
+
+        // 担当番号以外の描画設定は先頭の部分結果と一致している必要がある.
+        Checkpoint part;
+        part.header       = header;
+        part.header.shard = head.shard;
+
+        Canvas temp;
+        temp.enable_aov(canvas.has_aov());
+        temp.resize(header.width, header.height);
+
+        if (!part.load(path, temp) || !canvas.merge(temp))
+        { return -1; }
+
+        if (part.header.shard < merged.size())
+        {
+            if (merged[part.header.shard])
+            { fprintf_s(stderr, "Warning : Shard %u Merged Twice. path = %s\n", part.header.shard, path); }
+            merged[part.header.shard] = true;
+        }
+
+        printf_s("merged. %s (shard %u/%u)\n", path, part.header.shard, part.header.shard_count);
+    }
+
+    for(size_t i=0; i<merged.size(); ++i)
+    {
+        if (!merged[i])
+        { fprintf_s(stderr, "Warning : Shard %zu Is Missing.\n", i); }
+    }
+
+    printf_s("* spp      : %.2f\n", canvas.average_samples());
+
+    if (!canvas.write(option.merge))
+    {
+        fprintf_s(stderr, "Error : Write Failed. path = %s\n", option.merge);
+        return -1;
+    }
+
+    printf_s("written. %s\n", option.merge);
+    return 0;
+}
+
 } // namespace
 
 
@@ -192,30 +714,36 @@ int main(int argc, char** argv)
     auto start = std::chrono::system_clock::now();
     printf_s("start!\n");
 
-    if (argc <= 1)
+    Option option;
+    if (!parse_option(argc, argv, option))
+    { return -1; }
+
+    // 部分結果の統合だけを行う.
+    if (option.merge != nullptr)
+    { return merge_partials(option); }
+
+    if (!g_scene.load(option.scene))
     {
-        if (!g_scene.load("test_scene.xml"))
-        {
-            fprintf_s(stderr, "Error : Scene Load Failed.\n");
-            return false;
-        }
-    }
-    else
-    {
-        if (!g_scene.load(argv[1]))
-        {
-            fprintf_s(stderr, "Error : Scene Load Failed. file = %s\n", argv[1]);
-            return false;
-        }
+        fprintf_s(stderr, "Error : Scene Load Failed. file = %s\n", option.scene);
+        return false;
     }
 
     int w = g_scene.width();
     int h = g_scene.height();
     int s = g_scene.samples();
 
+    // 連番描画では途中のキャプチャーは行わず，フレーム毎に出力する.
+    if (option.sequence)
+    {
+        if (option.frames <= 0)
+        { option.frames = std::max(1, g_scene.key_count()); }
+
+        option.capture = 0.0;
+    }
+
     Canvas canvas;
-    std::atomic<bool> is_finish      = false;   // 終了したかどうか?
-    std::atomic<bool> request_finish = false;   // 終了要求フラグ.
+    std::atomic<bool> is_finish     (false);    // 終了したかどうか?
+    std::atomic<bool> request_finish(false);    // 終了要求フラグ.
 
     // キャプチャディレクトリ作成.
     _mkdir("img");
@@ -229,96 +757,254 @@ int main(int argc, char** argv)
 
     task_system<TaskData, ThreadData> task(core_count, task_func);
 
+    std::atomic<int> counter(0);
+
     // 監視スレッド.
     std::thread thd([&]()
     {
-        auto counter = 0;
-        auto begin   = start;
+        auto begin = start;
+
+        // キャプチャー間のスループットを求めるため，前回のレイ数を覚えておく.
+        uint64_t prev_rays = 0;
 
         printf_s("* width    : %d\n", w);
         printf_s("* height   : %d\n", h);
         printf_s("* samples  : %d\n", s);
         printf_s("* cpu core : %d\n", core_count);
+        printf_s("* simd     : %s (%s)\n", CpuInfo::name(CpuInfo::isa()), Accelerator::kernel_name());
+        printf_s("* mode     : %s%s\n",
+            option.deterministic ? "deterministic" : "progressive",
+            option.adaptive      ? " (adaptive)"   : "");
+        printf_s("* time     : %.1f(sec)\n", option.time_limit);
+        if (option.sequence)
+        { printf_s("* frames   : %d (%d keys, %d cameras)\n", option.frames, g_scene.key_count(), g_scene.camera_count()); }
 
         while(!request_finish)
         {
             auto curr = std::chrono::system_clock::now();
-            auto term = std::chrono::duration_cast<std::chrono::milliseconds>(curr - begin).count();
-            auto sec  = std::chrono::duration_cast<std::chrono::seconds>(curr - start).count();
+            auto term = std::chrono::duration<double>(curr - begin).count();
+            auto sec  = std::chrono::duration<double>(curr - start).count();
 
-            // 30秒ごとにキャプチャー.
-            if (term >= 30000)
+            // 一定間隔でキャプチャー.
+            if (option.capture > 0.0 && term >= option.capture)
             {
-                canvas.write(counter++);
+                canvas.write_async(counter++);
+                printf_s("* spp      : %.2f\n", canvas.average_samples());
+
+                Stats::Value value;
+                gather_stats(task, core_count, value);
+                auto rays = value.counters[Stats::CounterRays];
+                printf_s("* rays     : %.2f(Mrays/sec)\n", double(rays - prev_rays) * 1e-6 / term);
+                prev_rays = rays;
+
                 begin = curr;
             }
 
-            // 4分32秒経ったら終了(レイトレ合宿5のルール準拠).
-            // 終了処理等の時間があるので，1秒早めに終わらせる.
-            if (sec >= 272)
+            // 制限時間を過ぎたら処理を打ち切る.
+            // ピクセル毎に実際のサンプル数で正規化するので，出力は常に整合が取れている.
+            if (sec >= option.time_limit - TimeBudget::kReserve)
             {
+                is_finish = true;
+                task.request_exit();
                 break;
             }
 
             // 他に処理を渡すためにちょっと空ける.
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-        }
-
-        // 最後の1枚は出力する.
-        canvas.write(counter++);
-
-        {
-            auto end = std::chrono::system_clock::now();
-            auto sec = std::chrono::duration_cast<std::chrono::seconds>(end - start).count();
-
-            printf_s("* time = %llu(sec)\n", sec);
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
-
-        is_finish = true;
-        printf_s("end!\n");
-
-        task.request_exit();
     });
 
     // レンダーターゲット生成.
+    canvas.enable_aov(option.aov);
     canvas.resize(w, h);
-
-    auto inv_s = 1.0f / float(s);
-    uint64_t ray_count = 0;
+    canvas.set_filter(option.filter);
+    canvas.set_format(option.format);
 
     // スレッドデータ設定.
     for(uint32_t i=0; i<core_count; ++i)
     {
         auto& data = task.thread_data(i);
         data.canvas     = &canvas;
-        data.inv_s      = inv_s;
         data.scene      = &g_scene;
         data.is_finish  = &is_finish;
-        data.random.set_seed(i * 1000);
+        data.sampler.set_type(option.sampler);
+        data.sampler.set_deterministic(option.deterministic);
+        // 分散描画では担当番号とスレッド番号の組から乱数列を決める.
+        // マシン毎にコア数が違っても，他の担当の乱数列と重ならない.
+        data.sampler.set_seed(option.deterministic ? 0 : hash_combine(hash_u32(uint32_t(option.shard)), i));
     }
 
-    // タスクを積む.
-    for(auto loop = 0; loop < s; ++loop)
+    // スループットを計測しながら，制限時間内に終わるようにタスクを積む.
+    TimeBudget budget(start, option.time_limit);
+
+    // 分散描画では担当番号毎にチェックポイントを分け，同じディレクトリで描画しても上書きしない.
+    char checkpoint[256] = {};
+    if (option.checkpoint != nullptr)
+    { sprintf_s(checkpoint, "%s", option.checkpoint); }
+    else if (option.shard_count > 1)
+    { sprintf_s(checkpoint, "img/checkpoint_%03d.bin", option.shard); }
+    else
+    { sprintf_s(checkpoint, "img/checkpoint.bin"); }
+
+    RenderContext ctx;
+    ctx.task         = &task;
+    ctx.canvas       = &canvas;
+    ctx.budget       = &budget;
+    ctx.is_finish    = &is_finish;
+    ctx.counter      = &counter;
+    ctx.thread_count = core_count;
+    ctx.checkpoint   = checkpoint;
+    ctx.interval     = option.checkpoint_interval;
+    ctx.last_save    = 0.0;
+
+    auto& header = ctx.progress.header;
+    header.width   = w;
+    header.height  = h;
+    header.samples = s;
+    header.sampler = uint32_t(option.sampler);
+    header.flags   = (option.deterministic ? Checkpoint::FlagDeterministic : 0)
+                   | (option.adaptive      ? Checkpoint::FlagAdaptive      : 0)
+                   | (option.aov           ? Checkpoint::FlagAOV           : 0);
+    header.shard       = uint32_t(option.shard);
+    header.shard_count = uint32_t(option.shard_count);
+
+    // 分散描画では担当するサンプル番号の範囲だけを描画する.
+    // --deterministic の場合はサンプル番号から乱数列が決まるので，統合すると1プロセスで描画した結果と一致する.
+    // そうでない場合は担当番号毎にシードをずらすので，結果は統計的に等価だが一致はしない.
+    auto sample_begin = int(int64_t(s) * option.shard       / option.shard_count);
+    auto sample_end   = int(int64_t(s) * (option.shard + 1) / option.shard_count);
+    header.next_sample = uint32_t(sample_begin);
+
+    // チェックポイントから再開.
+    if (option.resume)
     {
-        TaskData info;
-        info.w = w;
-        info.h = h;
+        if (!ctx.progress.load(checkpoint, canvas))
+        {
+            request_finish = true;
+            thd.join();
+            return -1;
+        }
 
-        task.enqueue(info);
+        counter = int(header.capture);
+
+        // スレッド数が変わっていても，残りのスレッドは初期シードのまま続ける.
+        auto count = std::min(uint32_t(ctx.progress.randoms.size()), core_count);
+        for(uint32_t i=0; i<count; ++i)
+        { task.thread_data(i).sampler.set_random(ctx.progress.randoms[i]); }
+
+        printf_s("* resume   : %s (sample %u, %.2f spp)\n",
+            checkpoint, header.next_sample, canvas.average_samples());
     }
 
+    // スループットはシーン読み込みやBVH構築を含めず，描画時間だけで求める.
+    auto render_start = std::chrono::system_clock::now();
+
     // タスク実行.
     task.run();
 
-    // 時間終了まで待つ.
-    task.wait();
+    // 連番描画ではシーン・BVH・ワーカースレッドを使い回して1フレームずつ描画する.
+    auto frame_count = option.sequence ? option.frames : 1;
+    TimeBudget frame_budget(start, option.time_limit);
 
-    // 終了フラグを立てる.
-    request_finish = true;
+    for(auto frame = 0; frame < frame_count && !is_finish; ++frame)
+    {
+        if (option.sequence)
+        {
+            // フレーム番号をキーフレームの範囲に割り当てる.
+            auto key_count = g_scene.key_count();
+            auto time = (frame_count > 1)
+                ? float(frame) * float(key_count - 1) / float(frame_count - 1)
+                : 0.0f;
+            g_scene.set_camera(time);
+
+            // インスタンスを動かした場合は上位BVHを更新する(劣化が大きければ再構築される).
+            if (g_scene.animate(time))
+            { g_scene.refit(); }
+
+            // 残り時間を残りのフレームで等分する.
+            auto share = budget.remaining() / double(frame_count - frame);
+            frame_budget = TimeBudget(std::chrono::system_clock::now(), share + TimeBudget::kReserve);
+            ctx.budget   = &frame_budget;
+            counter      = frame;
+        }
+
+        render_frame(ctx, option, w, h, s, sample_end);
+
+        // 最後のフレームは全スレッドを止めてから出力する.
+        if (frame + 1 >= frame_count || is_finish)
+        { break; }
+
+        task.wait_idle();
+
+        // 書き出し待ちのフレームを上書きで捨てないように，前のフレームの書き出しを待つ.
+        canvas.flush();
+        canvas.write_async(counter++);
+        printf_s("* frame    : %d / %d (%.2f spp)\n", frame + 1, frame_count, canvas.average_samples());
 
-    // スレッドの終了を待機.
+        // 次のフレームのために累積をクリアする.
+        canvas.resize(w, h);
+        ctx.progress.header.next_sample = uint32_t(sample_begin);
+        ctx.progress.tile_samples.clear();
+    }
+
+    // 最後の状態も保存しておく.
+    save_checkpoint(ctx, true);
+
+    // 全タスクの完了か時間終了まで待つ.
+    task.wait_idle();
+
+    // 監視スレッドの終了を待機.
+    request_finish = true;
     if (thd.joinable())
     { thd.join(); }
 
+    // ワーカースレッドの終了を待機.
+    is_finish = true;
+    task.request_exit();
+    task.wait();
+
+    auto render_sec = std::chrono::duration<double>(std::chrono::system_clock::now() - render_start).count();
+
+    // 分散描画の部分結果を書き出す.
+    if (option.shard_count > 1 || option.partial != nullptr)
+    {
+        char path[256] = {};
+        if (option.partial != nullptr)
+        { sprintf_s(path, "%s", option.partial); }
+        else
+        { sprintf_s(path, "img/partial_%03d.bin", option.shard); }
+
+        ctx.progress.header.capture = uint32_t(counter.load());
+        if (ctx.progress.save(path, canvas))
+        { printf_s("partial. %s (shard %d/%d)\n", path, option.shard, option.shard_count); }
+    }
+
+    // 全スレッドが止まってから最後の1枚を出力し，書き出しが終わるのを待つ.
+    canvas.write_async(counter++);
+    canvas.flush();
+    printf_s("* spp      : %.2f\n", canvas.average_samples());
+    printf_s("* rate     : %.2f(Msamples/sec)\n", ctx.budget->rate() * 1e-6);
+    printf_s("* time     : %.2f(sec)\n", budget.elapsed());
+
+    Stats::Value stats;
+    gather_stats(task, core_count, stats);
+    printf_s("* render   : %.2f(sec)\n", render_sec);
+    Stats::print(stats, render_sec);
+
+    if (option.stats != nullptr)
+    {
+        FILE* fp = nullptr;
+        auto err = fopen_s(&fp, option.stats, "w");
+        if (err != 0 || fp == nullptr)
+        { fprintf_s(stderr, "Error : File Open Failed. path = %s\n", option.stats); }
+        else
+        {
+            Stats::write_json(fp, stats, render_sec);
+            fclose(fp);
+        }
+    }
+
+    printf_s("end!\n");
+
     return 0;
 }
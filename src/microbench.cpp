@@ -0,0 +1,861 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : microbench.cpp
+// Desc : Intersection Kernel Microbenchmark.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_math.h>
+#include <r3d_shape.h>
+#include <r3d_bvh.h>
+#include <r3d_cpu.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+const int       g_prim_count = 64;      // 1レイ当たりに判定するプリミティブ数.
+const int       g_repeat     = 3;       // 計測回数(最小値を採用).
+const float     g_grazing    = 0.02f;   // かすめるレイの傾き.
+
+enum Distribution
+{
+    DistributionCoherent,   //!< カメラからの走査順のレイ.
+    DistributionRandom,     //!< 外側のランダムな位置から中心付近へ向かうレイ.
+    DistributionGrazing,    //!< 面とほぼ平行に進むレイ.
+    Distribution_Count,
+};
+
+enum MeshType
+{
+    MeshHeightfield,        //!< 起伏のある格子状のメッシュ.
+    MeshSliver,             //!< 対角方向に伸びた細長い三角形の集まり(空間分割が効く配置).
+    MeshType_Count,
+};
+
+struct Option
+{
+    int             rays      = 1 << 18;    // 計測に使うレイ数.
+    size_t          min_tris  = 1000;       // BVH計測の最小三角形数.
+    size_t          max_tris  = 1000000;    // BVH計測の最大三角形数.
+    const char*     json      = nullptr;    // 結果を書き出すJSONファイルパス.
+};
+
+struct Result
+{
+    const char*     kernel;         // カーネル名.
+    const char*     distribution;   // レイの分布.
+    size_t          count;          // 判定回数.
+    double          ns;             // 1判定当たりの時間[ns].
+    double          hit_rate;       // 交差率.
+};
+
+std::vector<Result> g_results;
+uint64_t            g_sink = 0;     // 最適化で判定が消されないように結果を集める.
+
+//-------------------------------------------------------------------------------------------------
+//      分布名を取得します.
+//-------------------------------------------------------------------------------------------------
+const char* distribution_name(Distribution value)
+{
+    switch(value)
+    {
+    case DistributionCoherent:  return "coherent";
+    case DistributionRandom:    return "random";
+    case DistributionGrazing:   return "grazing";
+    default:                    break;
+    }
+
+    return "unknown";
+}
+
+//-------------------------------------------------------------------------------------------------
+//      メッシュの種類名を取得します.
+//-------------------------------------------------------------------------------------------------
+const char* mesh_name(MeshType value)
+{
+    switch(value)
+    {
+    case MeshHeightfield:   return "heightfield";
+    case MeshSliver:        return "sliver";
+    default:                break;
+    }
+
+    return "unknown";
+}
+
+//-------------------------------------------------------------------------------------------------
+//      [lo, hi) の一様乱数を取得します.
+//-------------------------------------------------------------------------------------------------
+inline float uniform(Random& random, float lo, float hi)
+{ return lo + (hi - lo) * random.get_as_float(); }
+
+//-------------------------------------------------------------------------------------------------
+//      [-1, 1]^3 に配置したプリミティブに向けたレイを生成します.
+//-------------------------------------------------------------------------------------------------
+std::vector<Ray> make_rays(Distribution distribution, int count)
+{
+    std::vector<Ray> rays(count);
+    Random random(12345);
+
+    switch(distribution)
+    {
+    case DistributionCoherent:
+        {
+            // 斜め上から原点を見るピンホールカメラ.
+            auto pos    = Vector3(0.0f, 1.5f, 2.5f);
+            auto axis_z = normalize(-pos);
+            auto axis_x = normalize(cross(Vector3(0.0f, 1.0f, 0.0f), axis_z));
+            auto axis_y = cross(axis_z, axis_x);
+
+            auto side = int(sqrt(float(count)));
+            side = std::max(side, 1);
+            for(auto i=0; i<count; ++i)
+            {
+                auto u = (float(i % side) + 0.5f) / float(side) * 2.0f - 1.0f;
+                auto v = (float((i / side) % side) + 0.5f) / float(side) * 2.0f - 1.0f;
+                auto dir = normalize(axis_x * (u * 0.4f) + axis_y * (v * 0.4f) + axis_z);
+                rays[i] = make_ray(pos, dir);
+            }
+        }
+        break;
+
+    case DistributionRandom:
+        {
+            for(auto i=0; i<count; ++i)
+            {
+                // 半径3の球面上から立方体内の点に向かう.
+                auto z   = uniform(random, -1.0f, 1.0f);
+                auto phi = uniform(random, 0.0f, F_2PI);
+                auto r   = sqrt(std::max(0.0f, 1.0f - z * z));
+                auto pos = Vector3(r * cos(phi), r * sin(phi), z) * 3.0f;
+
+                auto target = Vector3(
+                    uniform(random, -1.0f, 1.0f),
+                    uniform(random, -1.0f, 1.0f),
+                    uniform(random, -1.0f, 1.0f));
+
+                rays[i] = make_ray(pos, normalize(target - pos));
+            }
+        }
+        break;
+
+    case DistributionGrazing:
+        {
+            for(auto i=0; i<count; ++i)
+            {
+                // X軸方向にほぼ平行に進み，XZ平面やYZ平面をかすめる.
+                auto pos = Vector3(
+                    -3.0f,
+                    uniform(random, -0.2f, 0.2f),
+                    uniform(random, -1.0f, 1.0f));
+
+                auto dir = normalize(Vector3(
+                    1.0f,
+                    uniform(random, -g_grazing, g_grazing),
+                    uniform(random, -g_grazing, g_grazing)));
+
+                rays[i] = make_ray(pos, dir);
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return rays;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      立方体内にランダムなボックスを生成します.
+//-------------------------------------------------------------------------------------------------
+std::vector<Box> make_boxes(int count)
+{
+    std::vector<Box> boxes(count);
+    Random random(6789);
+
+    for(auto i=0; i<count; ++i)
+    {
+        auto center = Vector3(
+            uniform(random, -0.9f, 0.9f),
+            uniform(random, -0.9f, 0.9f),
+            uniform(random, -0.9f, 0.9f));
+
+        auto extent = Vector3(
+            uniform(random, 0.02f, 0.1f),
+            uniform(random, 0.02f, 0.1f),
+            uniform(random, 0.02f, 0.1f));
+
+        boxes[i] = Box(center - extent, center + extent);
+    }
+
+    return boxes;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      計測結果を記録します.
+//-------------------------------------------------------------------------------------------------
+void report(const char* kernel, Distribution distribution, size_t count, double sec, uint64_t hits)
+{
+    Result result;
+    result.kernel       = kernel;
+    result.distribution = distribution_name(distribution);
+    result.count        = count;
+    result.ns           = sec * 1e9 / double(count);
+    result.hit_rate     = double(hits) / double(count);
+
+    printf_s("%-24s %-9s %12zu %9.3f %8.2f%%\n",
+        result.kernel, result.distribution, result.count, result.ns, result.hit_rate * 100.0);
+
+    g_results.push_back(result);
+    g_sink += hits;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      関数を繰り返し実行して最短時間[sec]を求めます.
+//-------------------------------------------------------------------------------------------------
+template<typename Func>
+double measure(Func func, uint64_t& hits)
+{
+    auto best = 0.0;
+    for(auto r=0; r<g_repeat; ++r)
+    {
+        auto begin = std::chrono::high_resolution_clock::now();
+        hits = func();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        auto sec = std::chrono::duration<double>(end - begin).count();
+        if (r == 0 || sec < best)
+        { best = sec; }
+    }
+
+    return best;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      立っているビット数を数えます.
+//-------------------------------------------------------------------------------------------------
+inline uint32_t bit_count(uint32_t value)
+{
+    uint32_t count = 0;
+    for(; value != 0; value &= value - 1)
+    { count++; }
+    return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      SIMDレジスタを含む型の配列を確保します.
+//-------------------------------------------------------------------------------------------------
+template<typename T>
+T* aligned_array(size_t count)
+{ return static_cast<T*>(_aligned_malloc(sizeof(T) * count, alignof(T))); }
+
+#if defined(ENABLE_AVX)
+//-------------------------------------------------------------------------------------------------
+//      Ray8 と Box8 の判定でヒットしたボックス数を数えます.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX uint64_t count_box8(const Ray8* ray8, size_t ray_count, const Box8* box8, int box_count)
+{
+    uint64_t count = 0;
+    for(size_t i=0; i<ray_count; ++i)
+    for(auto j=0; j<box_count; ++j)
+    {
+        int mask = 0;
+        hit(ray8[i], box8[j], mask);
+        count += bit_count(uint32_t(mask));
+    }
+
+    _mm256_zeroupper();
+    return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      Ray8 と Box8 の判定(AVX2 + FMA 版)でヒットしたボックス数を数えます.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX2 uint64_t count_box8_fma(const Ray8* ray8, size_t ray_count, const Box8* box8, int box_count)
+{
+    uint64_t count = 0;
+    for(size_t i=0; i<ray_count; ++i)
+    for(auto j=0; j<box_count; ++j)
+    {
+        int mask = 0;
+        hit_fma(ray8[i], box8[j], mask);
+        count += bit_count(uint32_t(mask));
+    }
+
+    _mm256_zeroupper();
+    return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      Ray8 と Box8 の交差判定を計測します(AVX対応CPUのみ).
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX void bench_box8(const std::vector<Ray>& rays, Distribution distribution, const std::vector<Box>& boxes)
+{
+    const auto box_count = g_prim_count / 8;
+    auto ray8 = aligned_array<Ray8>(rays.size());
+    auto box8 = aligned_array<Box8>(box_count);
+    uint64_t hits = 0;
+
+    for(size_t i=0; i<rays.size(); ++i)
+    { ray8[i] = make_ray8(rays[i]); }
+
+    for(auto i=0; i<box_count; ++i)
+    {
+        auto b = &boxes[i * 8];
+        box8[i] = Box8(b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+    }
+
+    auto sec = measure([&]()
+    { return count_box8(ray8, rays.size(), box8, box_count); }, hits);
+
+    report("hit(Ray8, Box8)", distribution, rays.size() * box_count * 8, sec, hits);
+
+    if (CpuInfo::has(CpuInfo::IsaAVX2))
+    {
+        sec = measure([&]()
+        { return count_box8_fma(ray8, rays.size(), box8, box_count); }, hits);
+
+        report("hit_fma(Ray8, Box8)", distribution, rays.size() * box_count * 8, sec, hits);
+    }
+
+    _aligned_free(ray8);
+    _aligned_free(box8);
+}
+#endif//defined(ENABLE_AVX)
+
+#if defined(ENABLE_AVX512)
+//-------------------------------------------------------------------------------------------------
+//      Ray16 と Box16 の判定でヒットしたボックス数を数えます.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX512 uint64_t count_box16(const Ray16* ray16, size_t ray_count, const Box16* box16, int box_count)
+{
+    uint64_t count = 0;
+    for(size_t i=0; i<ray_count; ++i)
+    for(auto j=0; j<box_count; ++j)
+    {
+        int mask = 0;
+        hit(ray16[i], box16[j], mask);
+        count += bit_count(uint32_t(mask));
+    }
+
+    _mm256_zeroupper();
+    return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      Ray16 と Box16 の交差判定を計測します(AVX-512対応CPUのみ).
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX512 void bench_box16(const std::vector<Ray>& rays, Distribution distribution, const std::vector<Box>& boxes)
+{
+    const auto box_count = g_prim_count / 16;
+    auto ray16 = aligned_array<Ray16>(rays.size());
+    auto box16 = aligned_array<Box16>(box_count);
+    uint64_t hits = 0;
+
+    for(size_t i=0; i<rays.size(); ++i)
+    { ray16[i] = make_ray16(rays[i]); }
+
+    for(auto i=0; i<box_count; ++i)
+    { box16[i] = Box16(&boxes[i * 16], 16); }
+
+    auto sec = measure([&]()
+    { return count_box16(ray16, rays.size(), box16, box_count); }, hits);
+
+    report("hit(Ray16, Box16)", distribution, rays.size() * box_count * 16, sec, hits);
+
+    _aligned_free(ray16);
+    _aligned_free(box16);
+}
+#endif//defined(ENABLE_AVX512)
+
+//-------------------------------------------------------------------------------------------------
+//      AABBとの交差判定を計測します.
+//-------------------------------------------------------------------------------------------------
+void bench_box(const std::vector<Ray>& rays, Distribution distribution)
+{
+    auto boxes = make_boxes(g_prim_count);
+    uint64_t hits = 0;
+
+    {
+        auto sec = measure([&]()
+        {
+            uint64_t count = 0;
+            for(auto& ray : rays)
+            for(auto& box : boxes)
+            { count += hit(ray, box) ? 1 : 0; }
+            return count;
+        }, hits);
+
+        report("hit(Ray, Box)", distribution, rays.size() * boxes.size(), sec, hits);
+    }
+
+#if defined(ENABLE_SSE2)
+    {
+        const auto box_count = g_prim_count / 4;
+        auto ray4 = aligned_array<Ray4>(rays.size());
+        auto box4 = aligned_array<Box4>(box_count);
+
+        for(size_t i=0; i<rays.size(); ++i)
+        { ray4[i] = convert(rays[i]); }
+
+        for(auto i=0; i<box_count; ++i)
+        { box4[i] = Box4(boxes[i * 4 + 0], boxes[i * 4 + 1], boxes[i * 4 + 2], boxes[i * 4 + 3]); }
+
+        auto sec = measure([&]()
+        {
+            uint64_t count = 0;
+            for(size_t i=0; i<rays.size(); ++i)
+            for(auto j=0; j<box_count; ++j)
+            {
+                int mask = 0;
+                hit(ray4[i], box4[j], mask);
+                count += bit_count(uint32_t(mask));
+            }
+            return count;
+        }, hits);
+
+        // 1回の呼び出しで4個のボックスを判定するので，ボックス単位で記録する.
+        report("hit(Ray4, Box4)", distribution, rays.size() * box_count * 4, sec, hits);
+
+        _aligned_free(ray4);
+        _aligned_free(box4);
+    }
+#endif//defined(ENABLE_SSE2)
+
+#if defined(ENABLE_AVX)
+    if (CpuInfo::has(CpuInfo::IsaAVX))
+    { bench_box8(rays, distribution, boxes); }
+#endif//defined(ENABLE_AVX)
+
+#if defined(ENABLE_AVX512)
+    if (CpuInfo::has(CpuInfo::IsaAVX512))
+    { bench_box16(rays, distribution, boxes); }
+#endif//defined(ENABLE_AVX512)
+}
+
+//-------------------------------------------------------------------------------------------------
+//      形状との交差判定を計測します.
+//-------------------------------------------------------------------------------------------------
+void bench_shape(const char* kernel, const std::vector<Ray>& rays, Distribution distribution, const std::vector<Shape*>& shapes)
+{
+    uint64_t hits = 0;
+
+    auto sec = measure([&]()
+    {
+        uint64_t count = 0;
+        for(auto& ray : rays)
+        for(auto shape : shapes)
+        {
+            // 最近傍の更新で判定が打ち切られないように，毎回新しいレコードを使う.
+            HitRecord record;
+            count += shape->hit(ray, record) ? 1 : 0;
+        }
+        return count;
+    }, hits);
+
+    report(kernel, distribution, rays.size() * shapes.size(), sec, hits);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ハイトフィールド状の合成メッシュを生成します.
+//-------------------------------------------------------------------------------------------------
+void make_mesh(size_t tri_count, std::vector<Vertex>& vtxs, std::vector<Triangle*>& tris)
+{
+    // 四角形1つで三角形2つ.
+    auto side  = std::max(size_t(1), size_t(sqrt(double(tri_count) * 0.5)));
+    auto count = side * side * 2;
+
+    // Triangle は連続する3頂点を参照するので，頂点は共有しない.
+    vtxs.resize(count * 3);
+    tris.resize(count);
+
+    auto height = [](float x, float z)
+    { return 0.1f * sin(x * 7.0f) * cos(z * 5.0f) + 0.05f * sin((x + z) * 23.0f); };
+
+    auto vertex = [&](size_t ix, size_t iz)
+    {
+        auto x = float(ix) / float(side) * 2.0f - 1.0f;
+        auto z = float(iz) / float(side) * 2.0f - 1.0f;
+
+        Vertex v;
+        v.pos = Vector3(x, height(x, z), z);
+        v.nrm = Vector3(0.0f, 1.0f, 0.0f);
+        v.uv  = Vector2(x * 0.5f + 0.5f, z * 0.5f + 0.5f);
+        return v;
+    };
+
+    size_t idx = 0;
+    for(size_t z=0; z<side; ++z)
+    for(size_t x=0; x<side; ++x)
+    {
+        auto v00 = vertex(x + 0, z + 0);
+        auto v10 = vertex(x + 1, z + 0);
+        auto v01 = vertex(x + 0, z + 1);
+        auto v11 = vertex(x + 1, z + 1);
+
+        vtxs[idx * 3 + 0] = v00;
+        vtxs[idx * 3 + 1] = v10;
+        vtxs[idx * 3 + 2] = v11;
+        idx++;
+
+        vtxs[idx * 3 + 0] = v00;
+        vtxs[idx * 3 + 1] = v11;
+        vtxs[idx * 3 + 2] = v01;
+        idx++;
+    }
+
+    for(size_t i=0; i<count; ++i)
+    { tris[i] = Triangle::create(&vtxs[i * 3], 0); }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      対角方向に伸びた細長い三角形を生成します.
+//      ボックスが三角形に比べて非常に大きくなるので，オブジェクト分割だけでは子ノードが重なる.
+//-------------------------------------------------------------------------------------------------
+void make_slivers(size_t tri_count, std::vector<Vertex>& vtxs, std::vector<Triangle*>& tris)
+{
+    Random random(4321);
+
+    vtxs.resize(tri_count * 3);
+    tris.resize(tri_count);
+
+    // 三角形の間隔に対する長さを揃えるため，1万個で長さ0.3となるよう数の立方根に反比例させる.
+    auto length = 0.15f * cbrtf(10000.0f / float(tri_count));
+
+    for(size_t i=0; i<tri_count; ++i)
+    {
+        auto center = Vector3(
+            uniform(random, -0.5f, 0.5f),
+            uniform(random, -0.5f, 0.5f),
+            uniform(random, -0.5f, 0.5f));
+
+        // (1, 1, 1) 方向に伸び，幅は 0.002 程度.
+        auto axis = normalize(Vector3(
+            1.0f + uniform(random, -0.1f, 0.1f),
+            1.0f + uniform(random, -0.1f, 0.1f),
+            1.0f + uniform(random, -0.1f, 0.1f))) * length;
+        auto side = normalize(cross(axis, Vector3(
+            uniform(random, -1.0f, 1.0f),
+            uniform(random, -1.0f, 1.0f),
+            uniform(random, -1.0f, 1.0f)))) * 0.002f;
+        auto nrm  = normalize(cross(axis, side));
+
+        const Vector3 pos[3] = { center - axis, center + axis, center - axis + side };
+        for(auto j=0; j<3; ++j)
+        {
+            vtxs[i * 3 + j].pos = pos[j];
+            vtxs[i * 3 + j].nrm = nrm;
+            vtxs[i * 3 + j].uv  = Vector2(0.0f, 0.0f);
+        }
+
+        tris[i] = Triangle::create(&vtxs[i * 3], 0);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      レイと交差した数を数えます.
+//-------------------------------------------------------------------------------------------------
+uint64_t count_hits(const Accelerator* bvh, const std::vector<Ray>& rays)
+{
+    uint64_t count = 0;
+    for(auto& ray : rays)
+    {
+        HitRecord record;
+        count += bvh->intersect(ray, record) ? 1 : 0;
+    }
+    return count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      メッシュを変形させてBVHの更新と再構築を比較します.
+//-------------------------------------------------------------------------------------------------
+void bench_refit
+(
+    Accelerator*                    bvh,
+    std::vector<Vertex>&            vtxs,
+    const std::vector<Triangle*>&   tris,
+    const std::vector<Ray>&         rays
+)
+{
+    // 変形前のコストを基準にする.
+    auto base = bvh->refit();
+
+    // 波打たせて変形させる.
+    for(auto& v : vtxs)
+    { v.pos.y += 0.2f * sin(v.pos.x * 3.0f + 1.0f) * sin(v.pos.z * 4.0f); }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    for(auto tri : tris)
+    { tri->update(); }
+    auto cost = bvh->refit();
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto refit_ms = std::chrono::duration<double>(end - begin).count() * 1000.0;
+
+    // 変形後の三角形で作り直したものと交差数が一致するか確認する.
+    auto list = tris;
+    begin = std::chrono::high_resolution_clock::now();
+    auto rebuilt = Accelerator::build(list);
+    end = std::chrono::high_resolution_clock::now();
+    auto build_ms = std::chrono::duration<double>(end - begin).count() * 1000.0;
+
+    auto fresh = rebuilt->refit();
+    auto match = count_hits(bvh, rays) == count_hits(rebuilt, rays);
+    rebuilt->dispose();
+
+    if (cost < 0.0f)
+    {
+        printf_s("* refit    : not supported, rebuild %.2f(ms)\n", build_ms);
+        return;
+    }
+
+    printf_s("* refit    : %.2f(ms), rebuild %.2f(ms), SAH %.2f -> %.2f (rebuilt %.2f), hits %s\n",
+        refit_ms, build_ms, base, cost, fresh, match ? "match" : "MISMATCH");
+}
+
+//-------------------------------------------------------------------------------------------------
+//      BVH走査を計測します.
+//-------------------------------------------------------------------------------------------------
+void bench_bvh(MeshType type, size_t tri_count, const std::vector<Ray>* rays)
+{
+    std::vector<Vertex>     vtxs;
+    std::vector<Triangle*>  tris;
+    if (type == MeshSliver)
+    { make_slivers(tri_count, vtxs, tris); }
+    else
+    { make_mesh(tri_count, vtxs, tris); }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    // CPUに応じて選ばれたカーネルを計測する.
+    auto bvh = Accelerator::build(tris);
+
+    // 結果はポインタで保持するので，メッシュの種類毎に名前を分けて残す.
+    static char kernels[MeshType_Count][64];
+    auto kernel = kernels[type];
+    if (type == MeshHeightfield)
+    { sprintf_s(kernels[type], "%s::intersect", Accelerator::kernel_name()); }
+    else
+    { sprintf_s(kernels[type], "%s::intersect/%s", Accelerator::kernel_name(), mesh_name(type)); }
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    printf_s("* mesh     : %zu triangles (%s), build %.2f(ms)\n",
+        tris.size(), mesh_name(type), std::chrono::duration<double>(end - begin).count() * 1000.0);
+
+    for(auto i=0; i<Distribution_Count; ++i)
+    {
+        uint64_t hits = 0;
+        auto& list = rays[i];
+
+        auto sec = measure([&]()
+        {
+            uint64_t count = 0;
+            for(auto& ray : list)
+            {
+                HitRecord record;
+                count += bvh->intersect(ray, record) ? 1 : 0;
+            }
+            return count;
+        }, hits);
+
+        report(kernel, Distribution(i), list.size(), sec, hits);
+    }
+
+    bench_refit(bvh, vtxs, tris, rays[DistributionRandom]);
+
+    bvh->dispose();
+
+    for(auto tri : tris)
+    { delete tri; }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      コマンドライン引数を解析します.
+//-------------------------------------------------------------------------------------------------
+bool parse_option(int argc, char** argv, Option& option)
+{
+    for(auto i=1; i<argc; ++i)
+    {
+        auto arg = argv[i];
+
+        if (strncmp(arg, "--rays=", 7) == 0)
+        { option.rays = std::max(64, atoi(arg + 7)); }
+        else if (strncmp(arg, "--min-tris=", 11) == 0)
+        { option.min_tris = size_t(std::max(2LL, atoll(arg + 11))); }
+        else if (strncmp(arg, "--max-tris=", 11) == 0)
+        { option.max_tris = size_t(std::max(2LL, atoll(arg + 11))); }
+        else if (strncmp(arg, "--json=", 7) == 0)
+        { option.json = arg + 7; }
+        else if (strcmp(arg, "--compressed-bvh") == 0)
+        { Accelerator::set_compressed(true); }
+        else if (strcmp(arg, "--sbvh") == 0)
+        { Accelerator::set_spatial_split(0.3f); }
+        else if (strncmp(arg, "--sbvh=", 7) == 0)
+        { Accelerator::set_spatial_split(float(atof(arg + 7))); }
+        else if (strncmp(arg, "--isa=", 6) == 0)
+        {
+            CpuInfo::Isa isa;
+            if (!CpuInfo::parse(arg + 6, isa))
+            {
+                fprintf_s(stderr, "Error : Invalid ISA. %s\n", arg);
+                return false;
+            }
+            CpuInfo::set_limit(isa);
+        }
+        else
+        {
+            fprintf_s(stderr, "Error : Unknown Option. %s\n", arg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      計測結果をJSON形式で書き出します.
+//-------------------------------------------------------------------------------------------------
+bool write_json(const char* path)
+{
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, path, "w");
+    if (err != 0 || fp == nullptr)
+    {
+        fprintf_s(stderr, "Error : File Open Failed. path = %s\n", path);
+        return false;
+    }
+
+    fprintf_s(fp, "[\n");
+    for(size_t i=0; i<g_results.size(); ++i)
+    {
+        auto& r = g_results[i];
+        fprintf_s(fp, "  { \"kernel\": \"%s\", \"distribution\": \"%s\", \"count\": %zu, \"ns\": %.4f, \"hit_rate\": %.6f }%s\n",
+            r.kernel, r.distribution, r.count, r.ns, r.hit_rate, (i + 1 < g_results.size()) ? "," : "");
+    }
+    fprintf_s(fp, "]\n");
+
+    auto ret = ferror(fp) == 0;
+    fclose(fp);
+
+    return ret;
+}
+
+} // namespace
+
+
+//-------------------------------------------------------------------------------------------------
+//      メインエントリーポイントです.
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    Option option;
+    if (!parse_option(argc, argv, option))
+    { return -1; }
+
+    std::vector<Ray> rays[Distribution_Count];
+    for(auto i=0; i<Distribution_Count; ++i)
+    { rays[i] = make_rays(Distribution(i), option.rays); }
+
+    // プリミティブ単体の判定はレイ数を減らす(1レイ当たり g_prim_count 回判定する).
+    std::vector<Ray> prim_rays[Distribution_Count];
+    for(auto i=0; i<Distribution_Count; ++i)
+    { prim_rays[i] = make_rays(Distribution(i), option.rays / 16); }
+
+    // 判定対象の形状.
+    std::vector<Shape*>     spheres;
+    std::vector<Shape*>     instances;
+    std::vector<Shape*>     unit_spheres;
+    std::vector<Shape*>     triangles;
+    std::vector<Vertex>     vtxs(g_prim_count * 3);
+    {
+        Random random(2468);
+        for(auto i=0; i<g_prim_count; ++i)
+        {
+            auto center = Vector3(
+                uniform(random, -0.9f, 0.9f),
+                uniform(random, -0.9f, 0.9f),
+                uniform(random, -0.9f, 0.9f));
+
+            spheres.push_back(Sphere::create(uniform(random, 0.02f, 0.1f), center, 0));
+
+            // 単位球を拡大縮小・平行移動したインスタンス.
+            auto sx = uniform(random, 0.02f, 0.1f);
+            auto sy = uniform(random, 0.02f, 0.1f);
+            auto sz = uniform(random, 0.02f, 0.1f);
+            auto world = Matrix(
+                sx,       0.0f,     0.0f,     0.0f,
+                0.0f,     sy,       0.0f,     0.0f,
+                0.0f,     0.0f,     sz,       0.0f,
+                center.x, center.y, center.z, 1.0f);
+            unit_spheres.push_back(Sphere::create(1.0f, Vector3(0.0f, 0.0f, 0.0f), 0));
+            instances   .push_back(ShapeInstance::create(unit_spheres.back(), world));
+
+            for(auto j=0; j<3; ++j)
+            {
+                auto offset = Vector3(
+                    uniform(random, -0.2f, 0.2f),
+                    uniform(random, -0.2f, 0.2f),
+                    uniform(random, -0.2f, 0.2f));
+
+                vtxs[i * 3 + j].pos = center + offset;
+                vtxs[i * 3 + j].nrm = Vector3(0.0f, 1.0f, 0.0f);
+                vtxs[i * 3 + j].uv  = Vector2(0.0f, 0.0f);
+            }
+
+            triangles.push_back(Triangle::create(&vtxs[i * 3], 0));
+        }
+    }
+
+    printf_s("* rays     : %d\n", option.rays);
+    printf_s("* simd     : %s (%s)\n", CpuInfo::name(CpuInfo::isa()), Accelerator::kernel_name());
+    printf_s("%-24s %-9s %12s %9s %9s\n", "kernel", "rays", "tests", "ns/test", "hit");
+
+    for(auto i=0; i<Distribution_Count; ++i)
+    {
+        auto distribution = Distribution(i);
+        bench_box  (prim_rays[i], distribution);
+        bench_shape("Triangle::hit",      prim_rays[i], distribution, triangles);
+        bench_shape("Sphere::hit",        prim_rays[i], distribution, spheres);
+        bench_shape("ShapeInstance::hit", prim_rays[i], distribution, instances);
+    }
+
+    for(auto count = option.min_tris; count <= option.max_tris; count *= 10)
+    {
+        for(auto i=0; i<MeshType_Count; ++i)
+        { bench_bvh(MeshType(i), count, rays); }
+    }
+
+    // ShapeInstance は参照先の形状を所有しないので別に解放する.
+    for(auto shape : instances)
+    { delete shape; }
+
+    for(auto shape : unit_spheres)
+    { delete shape; }
+
+    for(auto shape : spheres)
+    { delete shape; }
+
+    for(auto shape : triangles)
+    { delete shape; }
+
+    printf_s("* checksum : %llu\n", static_cast<unsigned long long>(g_sink));
+
+    if (option.json != nullptr && !write_json(option.json))
+    { return -1; }
+
+    return 0;
+}
@@ -8,15 +8,50 @@
 // Includes
 //-------------------------------------------------------------------------------------------------
 #include <r3d_bvh.h>
+#include <r3d_sbvh.h>
 #include <algorithm>
 
 
+#if defined(ENABLE_AVX)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CBVH8::BuildNode structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// 構築中のノードです. 構築後に CNode8 へ量子化する.
+struct CBVH8::BuildNode
+{
+    Box         box[8];
+    uint32_t    child[8];
+    int         count;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CBVH8::BuildLeaf structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct CBVH8::BuildLeaf
+{
+    size_t      offset;
+    size_t      count;
+};
+#endif//defined(ENABLE_AVX)
+
+
 namespace {
 
 //-------------------------------------------------------------------------------------------------
 // Constant Values.
 //-------------------------------------------------------------------------------------------------
-constexpr int BucketCount = 12;     //!< バケット数です.
+constexpr int      BucketCount = 12;                //!< バケット数です.
+constexpr uint32_t LeafBit     = 0x80000000u;       //!< 圧縮BVHの子ノード番号が葉番号であることを示すビット.
+constexpr size_t   CompressedLeafSize = 16;         //!< 圧縮BVHの葉の三角形数の目安.
+constexpr float    TraversalCost      = 1.0f;       //!< SAHのノード走査コスト.
+constexpr float    IntersectCost      = 1.0f;       //!< SAHの形状1つの交差判定コスト.
+constexpr uint32_t ShapeLeafSize      = 2;          //!< 上位BVHの葉の形状数.
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+bool    g_compressed   = false;     // 圧縮BVHで構築するかどうか.
+float   g_split_budget = 0.0f;      // SBVHの重複参照の上限(三角形数に対する割合). 0 なら使わない.
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Bucket structure
@@ -58,21 +93,6 @@ int longest_axis(const Box& box)
     { return 2; }
 }
 
-Vector3 calc_offset(const Box& box, const Vector3& p)
-{
-    auto offset = p - box.mini;
-
-    if (box.maxi.x > box.mini.x)
-    { offset.x /= box.maxi.x - box.mini.x; }
-
-    if (box.maxi.y > box.mini.y)
-    { offset.y /= box.maxi.y - box.mini.y; }
-
-    if (box.maxi.z > box.mini.z)
-    { offset.z /= box.maxi.z - box.mini.z; }
-
-    return offset;
-}
 
 bool median_split( size_t count, Triangle** tris, Box& box, size_t& mid, size_t& cnt0, size_t& cnt1 )
 {
@@ -103,6 +123,480 @@ bool median_split( size_t count, Triangle** tris, Box& box, size_t& mid, size_t&
     return true;
 }
 
+#if defined(ENABLE_AVX)
+//-------------------------------------------------------------------------------------------------
+//      中央値分割を levels 段繰り返して最大 2^levels (<= 16) 個に分けます.
+//      leaf_size 以下の範囲はそれ以上分けません. 分割数を返します.
+//-------------------------------------------------------------------------------------------------
+int multi_split(size_t count, Triangle** tris, int levels, size_t leaf_size, size_t* offset, size_t* counts)
+{
+    assert(levels <= 4);
+
+    offset[0] = 0;
+    counts[0] = count;
+    auto n = 1;
+
+    for(auto level=0; level<levels; ++level)
+    {
+        size_t next_offset[16];
+        size_t next_counts[16];
+        auto   m = 0;
+
+        for(auto i=0; i<n; ++i)
+        {
+            Box    box;
+            size_t mid, cnt0, cnt1;
+
+            if (counts[i] > leaf_size && median_split(counts[i], &tris[offset[i]], box, mid, cnt0, cnt1))
+            {
+                next_offset[m] = offset[i];       next_counts[m] = cnt0; m++;
+                next_offset[m] = offset[i] + mid; next_counts[m] = cnt1; m++;
+            }
+            else
+            {
+                next_offset[m] = offset[i]; next_counts[m] = counts[i]; m++;
+            }
+        }
+
+        for(auto i=0; i<m; ++i)
+        {
+            offset[i] = next_offset[i];
+            counts[i] = next_counts[i];
+        }
+        n = m;
+    }
+
+    return n;
+}
+#endif//defined(ENABLE_AVX)
+
+//-------------------------------------------------------------------------------------------------
+//      三角形を N 個ずつ SoA に並べます. packs は0で初期化しておくこと.
+//-------------------------------------------------------------------------------------------------
+template<int N>
+void fill_packs(size_t count, Triangle** tris, TrianglePack<N>* packs)
+{
+    for(size_t i=0; i<count; ++i)
+    {
+        auto& pack = packs[i / N];
+        auto  lane = i % N;
+
+        // Triangle::hit() と同じ計算で辺を求める.
+        auto& v0 = tris[i]->vertex(0).pos;
+        auto  e0 = tris[i]->vertex(1).pos - v0;
+        auto  e1 = tris[i]->vertex(2).pos - v0;
+
+        for(auto j=0; j<3; ++j)
+        {
+            pack.v0[j][lane] = v0.a[j];
+            pack.e0[j][lane] = e0.a[j];
+            pack.e1[j][lane] = e1.a[j];
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      三角形を N 個ずつ SoA に並べたパックを確保します.
+//-------------------------------------------------------------------------------------------------
+template<int N>
+TrianglePack<N>* create_packs(size_t count, Triangle** tris, size_t& pack_count)
+{
+    pack_count = (count + N - 1) / N;
+    if (pack_count == 0)
+    { return nullptr; }
+
+    auto size  = sizeof(TrianglePack<N>) * pack_count;
+    auto packs = static_cast<TrianglePack<N>*>(_aligned_malloc(size, alignof(TrianglePack<N>)));
+    if (packs == nullptr)
+    {
+        pack_count = 0;
+        return nullptr;
+    }
+
+    // 余ったレーンは全て0にしておく.
+    memset(packs, 0, size);
+    fill_packs<N>(count, tris, packs);
+
+    return packs;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      2つのボックスを囲むボックスを求めます.
+//-------------------------------------------------------------------------------------------------
+inline Box join(const Box& lhs, const Box& rhs)
+{ return Box(min(lhs.mini, rhs.mini), max(lhs.maxi, rhs.maxi)); }
+
+//-------------------------------------------------------------------------------------------------
+//      葉ノードのボックスを求め，SAHコストを加算します.
+//-------------------------------------------------------------------------------------------------
+Box refit_leaf(size_t count, Triangle** tris, float& cost)
+{
+    auto box = create_box(count, tris);
+    cost += surface_area(box) * IntersectCost * float(count);
+    return box;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      SAHコストをルートの表面積で正規化します.
+//-------------------------------------------------------------------------------------------------
+inline float normalize_cost(float cost, const Box& root)
+{
+    auto area = surface_area(root);
+    return (area > 0.0f) ? cost / area : 0.0f;
+}
+
+#if defined(ENABLE_AVX)
+//-------------------------------------------------------------------------------------------------
+//      8個の三角形と交差判定し，候補になったレーンのマスクを返します.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX int hit_pack(const Ray8& ray, const TrianglePack<8>& tri, float t_max, float dist)
+{
+    // Triangle::hit() と同じ演算順序と比較にして，スカラー版と同じ判定結果にする.
+    // (比較は NaN のときに棄却しないよう否定形の unordered を使う).
+    __m256 e0[3], e1[3], d[3];
+    for(auto i=0; i<3; ++i)
+    {
+        e0[i] = _mm256_load_ps( tri.e0[i] );
+        e1[i] = _mm256_load_ps( tri.e1[i] );
+        d [i] = _mm256_sub_ps( ray.pos[i], _mm256_load_ps( tri.v0[i] ) );
+    }
+
+    // s1 = cross(dir, e1), div = dot(s1, e0).
+    auto s1x = _mm256_sub_ps( _mm256_mul_ps( ray.dir[1], e1[2] ), _mm256_mul_ps( ray.dir[2], e1[1] ) );
+    auto s1y = _mm256_sub_ps( _mm256_mul_ps( ray.dir[2], e1[0] ), _mm256_mul_ps( ray.dir[0], e1[2] ) );
+    auto s1z = _mm256_sub_ps( _mm256_mul_ps( ray.dir[0], e1[1] ), _mm256_mul_ps( ray.dir[1], e1[0] ) );
+    auto div = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( s1x, e0[0] ), _mm256_mul_ps( s1y, e0[1] ) ), _mm256_mul_ps( s1z, e0[2] ) );
+
+    auto abs  = _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), div );
+    auto mask = _mm256_cmp_ps( abs, _mm256_set1_ps( F_EPSILON ), _CMP_NLE_UQ );
+
+    // beta = dot(d, s1) / div.
+    auto beta = _mm256_div_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( d[0], s1x ), _mm256_mul_ps( d[1], s1y ) ), _mm256_mul_ps( d[2], s1z ) ), div );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( beta, _mm256_setzero_ps(),  _CMP_NLE_UQ ) );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( beta, _mm256_set1_ps( 1.0f ), _CMP_NGE_UQ ) );
+
+    // s2 = cross(d, e0), gamma = dot(dir, s2) / div.
+    auto s2x = _mm256_sub_ps( _mm256_mul_ps( d[1], e0[2] ), _mm256_mul_ps( d[2], e0[1] ) );
+    auto s2y = _mm256_sub_ps( _mm256_mul_ps( d[2], e0[0] ), _mm256_mul_ps( d[0], e0[2] ) );
+    auto s2z = _mm256_sub_ps( _mm256_mul_ps( d[0], e0[1] ), _mm256_mul_ps( d[1], e0[0] ) );
+    auto gamma = _mm256_div_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ray.dir[0], s2x ), _mm256_mul_ps( ray.dir[1], s2y ) ), _mm256_mul_ps( ray.dir[2], s2z ) ), div );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( gamma, _mm256_setzero_ps(), _CMP_NLE_UQ ) );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( _mm256_add_ps( beta, gamma ), _mm256_set1_ps( 1.0f ), _CMP_NGE_UQ ) );
+
+    // t = dot(e1, s2) / div.
+    auto t = _mm256_div_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1[0], s2x ), _mm256_mul_ps( e1[1], s2y ) ), _mm256_mul_ps( e1[2], s2z ) ), div );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( t, _mm256_set1_ps( F_HIT_MIN ), _CMP_NLT_UQ ) );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( t, _mm256_set1_ps( t_max ),     _CMP_NGT_UQ ) );
+    mask = _mm256_and_ps( mask, _mm256_cmp_ps( t, _mm256_set1_ps( dist ),      _CMP_NGE_UQ ) );
+
+    return _mm256_movemask_ps( mask );
+}
+#endif//defined(ENABLE_AVX)
+
+#if defined(ENABLE_AVX512)
+//-------------------------------------------------------------------------------------------------
+//      16個の三角形と交差判定し，候補になったレーンのマスクを返します.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX512 int hit_pack(const Ray16& ray, const TrianglePack<16>& tri, float t_max, float dist)
+{
+    // 8個版と同じく Triangle::hit() と同じ演算順序と比較にする.
+    __m512 e0[3], e1[3], d[3];
+    for(auto i=0; i<3; ++i)
+    {
+        e0[i] = _mm512_load_ps( tri.e0[i] );
+        e1[i] = _mm512_load_ps( tri.e1[i] );
+        d [i] = _mm512_sub_ps( ray.pos[i], _mm512_load_ps( tri.v0[i] ) );
+    }
+
+    // s1 = cross(dir, e1), div = dot(s1, e0).
+    auto s1x = _mm512_sub_ps( _mm512_mul_ps( ray.dir[1], e1[2] ), _mm512_mul_ps( ray.dir[2], e1[1] ) );
+    auto s1y = _mm512_sub_ps( _mm512_mul_ps( ray.dir[2], e1[0] ), _mm512_mul_ps( ray.dir[0], e1[2] ) );
+    auto s1z = _mm512_sub_ps( _mm512_mul_ps( ray.dir[0], e1[1] ), _mm512_mul_ps( ray.dir[1], e1[0] ) );
+    auto div = _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( s1x, e0[0] ), _mm512_mul_ps( s1y, e0[1] ) ), _mm512_mul_ps( s1z, e0[2] ) );
+
+    auto mask = _mm512_cmp_ps_mask( _mm512_abs_ps( div ), _mm512_set1_ps( F_EPSILON ), _CMP_NLE_UQ );
+
+    // beta = dot(d, s1) / div.
+    auto beta = _mm512_div_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( d[0], s1x ), _mm512_mul_ps( d[1], s1y ) ), _mm512_mul_ps( d[2], s1z ) ), div );
+    mask = _mm512_mask_cmp_ps_mask( mask, beta, _mm512_setzero_ps(),    _CMP_NLE_UQ );
+    mask = _mm512_mask_cmp_ps_mask( mask, beta, _mm512_set1_ps( 1.0f ), _CMP_NGE_UQ );
+
+    // s2 = cross(d, e0), gamma = dot(dir, s2) / div.
+    auto s2x = _mm512_sub_ps( _mm512_mul_ps( d[1], e0[2] ), _mm512_mul_ps( d[2], e0[1] ) );
+    auto s2y = _mm512_sub_ps( _mm512_mul_ps( d[2], e0[0] ), _mm512_mul_ps( d[0], e0[2] ) );
+    auto s2z = _mm512_sub_ps( _mm512_mul_ps( d[0], e0[1] ), _mm512_mul_ps( d[1], e0[0] ) );
+    auto gamma = _mm512_div_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ray.dir[0], s2x ), _mm512_mul_ps( ray.dir[1], s2y ) ), _mm512_mul_ps( ray.dir[2], s2z ) ), div );
+    mask = _mm512_mask_cmp_ps_mask( mask, gamma, _mm512_setzero_ps(), _CMP_NLE_UQ );
+    mask = _mm512_mask_cmp_ps_mask( mask, _mm512_add_ps( beta, gamma ), _mm512_set1_ps( 1.0f ), _CMP_NGE_UQ );
+
+    // t = dot(e1, s2) / div.
+    auto t = _mm512_div_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( e1[0], s2x ), _mm512_mul_ps( e1[1], s2y ) ), _mm512_mul_ps( e1[2], s2z ) ), div );
+    mask = _mm512_mask_cmp_ps_mask( mask, t, _mm512_set1_ps( F_HIT_MIN ), _CMP_NLT_UQ );
+    mask = _mm512_mask_cmp_ps_mask( mask, t, _mm512_set1_ps( t_max ),     _CMP_NGT_UQ );
+    mask = _mm512_mask_cmp_ps_mask( mask, t, _mm512_set1_ps( dist ),      _CMP_NGE_UQ );
+
+    return int( mask );
+}
+#endif//defined(ENABLE_AVX512)
+
+#if defined(ENABLE_AVX)
+//-------------------------------------------------------------------------------------------------
+//      2^exponent を求めます(exponent は -126 ～ 127).
+//-------------------------------------------------------------------------------------------------
+inline float exp2i(int exponent)
+{
+    auto  bits   = uint32_t(exponent + 127) << 23;
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      255 刻みで mini から maxi まで届く最小の2の冪乗の指数を求めます.
+//-------------------------------------------------------------------------------------------------
+int8_t quantize_exponent(float mini, float maxi)
+{
+    auto exponent = -126;
+    if (maxi > mini)
+    {
+        int e;
+        frexpf((maxi - mini) / 255.0f, &e);
+        exponent = std::max(e, -126);
+    }
+
+    // 基準点との加算で丸められて届かない場合があるので確かめる.
+    while (exponent < 127 && mini + 255.0f * exp2i(exponent) < maxi)
+    { exponent++; }
+
+    return int8_t(exponent);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      最小値を量子化します. 復元した値が元の値以下になるように切り捨てる.
+//-------------------------------------------------------------------------------------------------
+uint8_t quantize_min(float value, float origin, float scale)
+{
+    auto q = int(std::min(std::max(floorf((value - origin) / scale), 0.0f), 255.0f));
+    while (q > 0 && origin + float(q) * scale > value)
+    { q--; }
+
+    return uint8_t(q);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      最大値を量子化します. 復元した値が元の値以上になるように切り上げる.
+//-------------------------------------------------------------------------------------------------
+uint8_t quantize_max(float value, float origin, float scale)
+{
+    auto q = int(std::min(std::max(ceilf((value - origin) / scale), 0.0f), 255.0f));
+    while (q < 255 && origin + float(q) * scale < value)
+    { q++; }
+
+    return uint8_t(q);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      構築中のノードを量子化します.
+//-------------------------------------------------------------------------------------------------
+void encode(const CBVH8::BuildNode& src, CNode8& dst)
+{
+    auto mini = src.box[0].mini;
+    auto maxi = src.box[0].maxi;
+    for(auto i=1; i<src.count; ++i)
+    {
+        mini = min(mini, src.box[i].mini);
+        maxi = max(maxi, src.box[i].maxi);
+    }
+
+    for(auto axis=0; axis<3; ++axis)
+    {
+        auto exponent = quantize_exponent(mini.a[axis], maxi.a[axis]);
+        auto scale    = exp2i(exponent);
+
+        dst.origin  [axis] = mini.a[axis];
+        dst.exponent[axis] = exponent;
+
+        for(auto i=0; i<8; ++i)
+        {
+            // 使わないレーンは最小値と最大値が反転した空のボックスにする.
+            dst.qmin[axis][i] = (i < src.count) ? quantize_min(src.box[i].mini.a[axis], mini.a[axis], scale) : 255;
+            dst.qmax[axis][i] = (i < src.count) ? quantize_max(src.box[i].maxi.a[axis], mini.a[axis], scale) : 0;
+        }
+    }
+
+    dst.count = uint8_t(src.count);
+    for(auto i=0; i<8; ++i)
+    { dst.child[i] = (i < src.count) ? src.child[i] : 0; }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      圧縮BVHのノードを再帰的に構築し，ノード番号を返します.
+//-------------------------------------------------------------------------------------------------
+uint32_t build_compressed
+(
+    size_t                  offset,
+    size_t                  count,
+    Triangle**              tris,
+    std::vector<CBVH8::BuildNode>&  nodes,
+    std::vector<CBVH8::BuildLeaf>&  leaves
+)
+{
+    size_t offsets[8];
+    size_t counts [8];
+    auto n = multi_split(count, &tris[offset], 3, CompressedLeafSize, offsets, counts);
+
+    auto index = uint32_t(nodes.size());
+    nodes.push_back(CBVH8::BuildNode());
+
+    CBVH8::BuildNode node;
+    node.count = n;
+
+    for(auto i=0; i<n; ++i)
+    {
+        auto first = offset + offsets[i];
+        node.box[i] = create_box(counts[i], &tris[first]);
+
+        // 分割できなかった場合は大きさによらず葉にする.
+        if (n == 1 || counts[i] <= CompressedLeafSize)
+        {
+            CBVH8::BuildLeaf leaf;
+            leaf.offset = first;
+            leaf.count  = counts[i];
+
+            node.child[i] = LeafBit | uint32_t(leaves.size());
+            leaves.push_back(leaf);
+        }
+        else
+        { node.child[i] = build_compressed(first, counts[i], tris, nodes, leaves); }
+    }
+
+    // 再帰呼び出しで nodes が再確保されるので，最後に書き込む.
+    nodes[index] = node;
+    return index;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      2分木を8分木にまとめ，ノード番号を返します.
+//-------------------------------------------------------------------------------------------------
+uint32_t collapse
+(
+    const SplitTree&                tree,
+    int                             index,
+    std::vector<CBVH8::BuildNode>&  nodes,
+    std::vector<CBVH8::BuildLeaf>&  leaves
+)
+{
+    // 参照が1パックに収まる部分木は葉にまとめる(部分木の参照は連続している).
+    auto is_leaf = [&](int i)
+    { return tree.nodes[i].child[0] < 0 || tree.nodes[i].count <= 8; };
+
+    int children[8];
+    auto n = 0;
+
+    if (is_leaf(index))
+    { children[n++] = index; }
+    else
+    {
+        children[n++] = tree.nodes[index].child[0];
+        children[n++] = tree.nodes[index].child[1];
+
+        // 表面積が最大の子ノードを開いて，8個まで増やす.
+        while (n < 8)
+        {
+            auto best      = -1;
+            auto best_area = -1.0f;
+            for(auto i=0; i<n; ++i)
+            {
+                if (is_leaf(children[i]))
+                { continue; }
+
+                auto area = surface_area(tree.nodes[children[i]].box);
+                if (area > best_area)
+                {
+                    best      = i;
+                    best_area = area;
+                }
+            }
+
+            if (best < 0)
+            { break; }
+
+            auto& node = tree.nodes[children[best]];
+            children[best] = node.child[0];
+            children[n++]  = node.child[1];
+        }
+    }
+
+    auto result = uint32_t(nodes.size());
+    nodes.push_back(CBVH8::BuildNode());
+
+    CBVH8::BuildNode node;
+    node.count = n;
+
+    for(auto i=0; i<n; ++i)
+    {
+        auto& child = tree.nodes[children[i]];
+        node.box[i] = child.box;
+
+        if (is_leaf(children[i]))
+        {
+            CBVH8::BuildLeaf leaf;
+            leaf.offset = child.offset;
+            leaf.count  = child.count;
+
+            node.child[i] = LeafBit | uint32_t(leaves.size());
+            leaves.push_back(leaf);
+        }
+        else
+        { node.child[i] = collapse(tree, children[i], nodes, leaves); }
+    }
+
+    nodes[result] = node;
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      量子化した値をボックスの座標に戻します.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX inline __m256 dequantize(const uint8_t* q, __m256 origin, __m256 scale)
+{
+    auto v  = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(q));
+    auto lo = _mm_cvtepu8_epi32(v);
+    auto hi = _mm_cvtepu8_epi32(_mm_srli_si128(v, 4));
+    auto i  = _mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    // q * scale は誤差なく求まるので，構築時の計算と同じ値になる.
+    return _mm256_add_ps(origin, _mm256_mul_ps(_mm256_cvtepi32_ps(i), scale));
+}
+
+//-------------------------------------------------------------------------------------------------
+//      量子化したノードの子ノードのボックスと交差判定します.
+//-------------------------------------------------------------------------------------------------
+R3D_TARGET_AVX inline bool hit(const Ray8& ray, const CNode8& node, int& mask)
+{
+    __m256 t_min = _mm256_set1_ps( -F_HIT_MAX );
+    __m256 t_max = ray.t_max;
+
+    for(auto i=0; i<3; ++i)
+    {
+        auto origin = _mm256_set1_ps( node.origin[i] );
+        auto scale  = _mm256_set1_ps( exp2i(node.exponent[i]) );
+        auto mini   = dequantize( node.qmin[i], origin, scale );
+        auto maxi   = dequantize( node.qmax[i], origin, scale );
+
+        auto n_side = ray.sign[i] ? maxi : mini;
+        auto f_side = ray.sign[i] ? mini : maxi;
+
+        t_min = _mm256_max_ps( t_min, _mm256_add_ps( _mm256_mul_ps( n_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+        t_max = _mm256_min_ps( t_max, _mm256_add_ps( _mm256_mul_ps( f_side, ray.inv_dir[i] ), ray.org_inv[i] ) );
+    }
+
+    mask = _mm256_movemask_ps( _mm256_cmp_ps( t_max, t_min, _CMP_GE_OS ) ) & ((1 << node.count) - 1);
+
+    return mask > 0;
+}
+#endif//defined(ENABLE_AVX)
+
 } // namespace
 
 
@@ -150,8 +644,9 @@ BVH* BVH::build_sub(size_t count, Triangle** tris)
     size_t cnt0, cnt1, mid;
     Box box;
 
+    // 要素数が少ないときは median_split() がボックスを求めないので，ここで求める.
     if ( !median_split(count, tris, box, mid, cnt0, cnt1) )
-    { return new BVH(count, tris, box); }
+    { return new BVH(count, tris, create_box(count, tris)); }
 
     // 再帰呼び出し.
     return new BVH(
@@ -161,7 +656,13 @@ BVH* BVH::build_sub(size_t count, Triangle** tris)
 }
 
 bool BVH::intersect(const Ray& ray, HitRecord& record) const
+{ return intersect_sub(ray, record); }
+
+bool BVH::intersect_sub(const Ray& ray, HitRecord& record) const
 {
+    R3D_STATS_ADD(CounterNodes, 1);
+    R3D_STATS_ADD(CounterBoxTests, 1);
+
     // Boxと判定.
     if (!hit(ray, m_box))
     { return false; }
@@ -169,6 +670,8 @@ bool BVH::intersect(const Ray& ray, HitRecord& record) const
     auto hit = false;
     if (!m_tris.empty())
     {
+        R3D_STATS_ADD(CounterTriangleTests, m_tris.size());
+
         for(size_t j=0; j<m_tris.size(); ++j)
         { hit |= m_tris[j]->hit(ray, record); }
 
@@ -176,11 +679,31 @@ bool BVH::intersect(const Ray& ray, HitRecord& record) const
     }
 
     for(int i=0; i<2; ++i)
-    { hit |= m_node[i]->intersect(ray, record); }
+    { hit |= m_node[i]->intersect_sub(ray, record); }
 
     return hit;
 }
 
+float BVH::refit()
+{
+    auto cost = 0.0f;
+    auto box  = refit_sub(cost);
+    return normalize_cost(cost, box);
+}
+
+Box BVH::refit_sub(float& cost)
+{
+    if (!m_tris.empty())
+    {
+        m_box = refit_leaf(m_tris.size(), m_tris.begin(), cost);
+        return m_box;
+    }
+
+    m_box = join(m_node[0]->refit_sub(cost), m_node[1]->refit_sub(cost));
+    cost += surface_area(m_box) * TraversalCost;
+    return m_box;
+}
+
 
 #if defined(ENABLE_SSE2)
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -222,11 +745,14 @@ void BVH4::dispose()
 bool BVH4::intersect(const Ray& ray, HitRecord& record) const
 {
     Ray4 ray4 = convert(ray);
-    return intersect_sub(ray4, record);
+    return intersect_sub(ray, ray4, record);
 }
 
-bool BVH4::intersect_sub(const Ray4& ray4, HitRecord& record) const
+bool BVH4::intersect_sub(const Ray& ray, const Ray4& ray4, HitRecord& record) const
 {
+    R3D_STATS_ADD(CounterNodes, 1);
+    R3D_STATS_ADD(CounterBoxTests, 4);
+
     int mask = 0;
 
     // Boxと判定.
@@ -236,7 +762,7 @@ bool BVH4::intersect_sub(const Ray4& ray4, HitRecord& record) const
     auto hit = false;
     if (!m_tris.empty())
     {
-        Ray ray = revert(ray4);
+        R3D_STATS_ADD(CounterTriangleTests, m_tris.size());
 
         for(size_t j=0; j<m_tris.size(); ++j)
         { hit |= m_tris[j]->hit(ray, record); }
@@ -248,7 +774,7 @@ bool BVH4::intersect_sub(const Ray4& ray4, HitRecord& record) const
     {
         auto bit = 0x1 << i;
         if ( (mask & bit) == bit)
-        { hit |= m_node[i]->intersect_sub(ray4, record); }
+        { hit |= m_node[i]->intersect_sub(ray, ray4, record); }
     }
 
     return hit;
@@ -288,6 +814,32 @@ BVH4* BVH4::build_sub(size_t count, Triangle** tris)
         Box4(box));
 }
 
+float BVH4::refit()
+{
+    auto cost = 0.0f;
+    auto box  = refit_sub(cost);
+    return normalize_cost(cost, box);
+}
+
+Box BVH4::refit_sub(float& cost)
+{
+    Box box;
+    if (!m_tris.empty())
+    { box = refit_leaf(m_tris.size(), m_tris.begin(), cost); }
+    else
+    {
+        box = m_node[0]->refit_sub(cost);
+        for(auto i=1; i<4; ++i)
+        { box = join(box, m_node[i]->refit_sub(cost)); }
+
+        cost += surface_area(box) * TraversalCost;
+    }
+
+    // 4レーンとも自身のボックスを持つ.
+    m_box = Box4(box);
+    return box;
+}
+
 void* BVH4::operator new (size_t size)
 { return _aligned_malloc(size, 16); }
 
@@ -306,7 +858,7 @@ void BVH4::operator delete[] (void* ptr)
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // BVH8 class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-BVH8::BVH8
+R3D_TARGET_AVX BVH8::BVH8
 (
     BVH8* n0, BVH8* n1, BVH8* n2, BVH8* n3,
     BVH8* n4, BVH8* n5, BVH8* n6, BVH8* n7,
@@ -322,15 +874,22 @@ BVH8::BVH8
     m_node[6] = n6;
     m_node[7] = n7;
     m_box     = box;
+
+    m_packs      = nullptr;
+    m_pack_count = 0;
+    m_fma        = false;
 }
 
-BVH8::BVH8(size_t count, Triangle** tris, const Box& box)
+R3D_TARGET_AVX BVH8::BVH8(size_t count, Triangle** tris, const Box& box)
 : m_tris(tris, count)
 {
     for(auto i=0; i<8; ++i)
     { m_node[i] = nullptr; }
 
     m_box = Box8( box );
+
+    m_packs = create_packs<8>(count, tris, m_pack_count);
+    m_fma   = false;
 }
 
 BVH8::~BVH8()
@@ -343,62 +902,134 @@ BVH8::~BVH8()
             m_node[i] = nullptr;
         }
     }
+
+    if (m_packs != nullptr)
+    {
+        _aligned_free(m_packs);
+        m_packs = nullptr;
+    }
 }
 
 void BVH8::dispose()
 { delete this; }
 
-bool BVH8::intersect(const Ray& ray, HitRecord& record) const
+R3D_TARGET_AVX bool BVH8::intersect(const Ray& ray, HitRecord& record) const
 {
     Ray8 ray8 = make_ray8(ray);
-    return intersect_sub(ray8, record);
+    auto hit  = m_fma ? intersect_sub_fma(ray, ray8, record) : intersect_sub(ray, ray8, record);
+
+    // AVXとSSEの切り替えペナルティを避ける.
+    _mm256_zeroupper();
+    return hit;
 }
 
-bool BVH8::intersect_sub(const Ray8& ray8, HitRecord& record) const
+R3D_TARGET_AVX bool BVH8::intersect_sub(const Ray& ray, const Ray8& ray8, HitRecord& record) const
 {
+    R3D_STATS_ADD(CounterNodes, 1);
+    R3D_STATS_ADD(CounterBoxTests, 8);
+
     int mask = 0;
 
     // Boxと判定.
     if (!hit(ray8, m_box, mask))
     { return false; }
 
-    auto hit = false;
     if (!m_tris.empty())
-    {
-        Ray ray = revert(ray8);
-
-        for(size_t j=0; j<m_tris.size(); ++j)
-        { hit |= m_tris[j]->hit(ray, record); }
-
-        return hit;
-    }
+    { return intersect_leaf(ray, ray8, record); }
 
+    auto hit = false;
     for(int i=0; i<8; ++i)
     {
         auto bit = 0x1 << i;
         if ( (mask & bit) == bit)
-        { hit |= m_node[i]->intersect_sub(ray8, record); }
+        { hit |= m_node[i]->intersect_sub(ray, ray8, record); }
     }
 
     return hit;
 }
 
-BVH8* BVH8::build(std::vector<Triangle*>& tris)
-{ return build_sub(tris.size(), tris.data()); }
-
-BVH8* BVH8::build_sub(size_t count, Triangle** tris)
+R3D_TARGET_AVX2 bool BVH8::intersect_sub_fma(const Ray& ray, const Ray8& ray8, HitRecord& record) const
 {
-    size_t cntL, cntR, mid;
-    Box box;
-
-    if (count <= 64)
-    {
-        box = create_box(count, tris);
-        return new BVH8(count, tris, box);
-    }
+    R3D_STATS_ADD(CounterNodes, 1);
+    R3D_STATS_ADD(CounterBoxTests, 8);
 
-    if (!median_split(count, tris, box, mid, cntL, cntR))
-    { return new BVH8(count, tris, box); }
+    int mask = 0;
+
+    // Boxと判定.
+    if (!hit_fma(ray8, m_box, mask))
+    { return false; }
+
+    if (!m_tris.empty())
+    { return intersect_leaf(ray, ray8, record); }
+
+    auto hit = false;
+    for(int i=0; i<8; ++i)
+    {
+        auto bit = 0x1 << i;
+        if ( (mask & bit) == bit)
+        { hit |= m_node[i]->intersect_sub_fma(ray, ray8, record); }
+    }
+
+    return hit;
+}
+
+R3D_TARGET_AVX bool BVH8::intersect_leaf(const Ray& ray, const Ray8& ray8, HitRecord& record) const
+{
+    R3D_STATS_ADD(CounterTriangleTests, m_tris.size());
+
+    auto hit = false;
+    if (m_packs == nullptr)
+    {
+        // パックを確保できなかった場合.
+        _mm256_zeroupper();
+
+        for(size_t j=0; j<m_tris.size(); ++j)
+        { hit |= m_tris[j]->hit(ray, record); }
+
+        return hit;
+    }
+
+    for(size_t i=0; i<m_pack_count; ++i)
+    {
+        auto mask = hit_pack(ray8, m_packs[i], ray.t_max, record.dist);
+
+        // 候補になったものだけスカラー版で判定して交差記録を更新する.
+        for(size_t j=i * 8; mask != 0; ++j, mask >>= 1)
+        {
+            if ((mask & 0x1) == 0)
+            { continue; }
+
+            // MSVC では三角形の判定がSSE命令のままなので，YMMの上位を先にクリアしておく.
+            _mm256_zeroupper();
+            hit |= m_tris[j]->hit(ray, record);
+        }
+    }
+
+    return hit;
+}
+
+BVH8* BVH8::build(std::vector<Triangle*>& tris)
+{
+    auto root = build_sub(tris.size(), tris.data());
+
+    // AVX2 + FMA が使える場合は積和版で走査する.
+    root->m_fma = CpuInfo::has(CpuInfo::IsaAVX2);
+    return root;
+}
+
+R3D_TARGET_AVX BVH8* BVH8::build_sub(size_t count, Triangle** tris)
+{
+    size_t cntL, cntR, mid;
+    Box box;
+
+    if (count <= 64)
+    {
+        box = create_box(count, tris);
+        return new BVH8(count, tris, box);
+    }
+
+    if (!median_split(count, tris, box, mid, cntL, cntR))
+    { return new BVH8(count, tris, box); }
 
     size_t cntA, cntB, cntC, cntD, midL, midR;
     Box boxL, boxR;
@@ -446,6 +1077,40 @@ BVH8* BVH8::build_sub(size_t count, Triangle** tris)
         Box8(box));
 }
 
+R3D_TARGET_AVX float BVH8::refit()
+{
+    auto cost = 0.0f;
+    auto box  = refit_sub(cost);
+
+    _mm256_zeroupper();
+    return normalize_cost(cost, box);
+}
+
+R3D_TARGET_AVX Box BVH8::refit_sub(float& cost)
+{
+    Box box;
+    if (!m_tris.empty())
+    {
+        box = refit_leaf(m_tris.size(), m_tris.begin(), cost);
+
+        // 余ったレーンは0のままなので，使っているレーンだけ詰め直せばよい.
+        if (m_packs != nullptr)
+        { fill_packs<8>(m_tris.size(), m_tris.begin(), m_packs); }
+    }
+    else
+    {
+        box = m_node[0]->refit_sub(cost);
+        for(auto i=1; i<8; ++i)
+        { box = join(box, m_node[i]->refit_sub(cost)); }
+
+        cost += surface_area(box) * TraversalCost;
+    }
+
+    // 8レーンとも自身のボックスを持つ.
+    m_box = Box8(box);
+    return box;
+}
+
 void* BVH8::operator new (size_t size)
 { return _aligned_malloc(size, 32); }
 
@@ -458,4 +1123,605 @@ void BVH8::operator delete (void* ptr)
 void BVH8::operator delete[] (void* ptr)
 { _aligned_free(ptr); }
 
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CBVH8 class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+CBVH8::CBVH8()
+: m_nodes       (nullptr)
+, m_node_count  (0)
+, m_leaves      (nullptr)
+, m_leaf_count  (0)
+, m_packs       (nullptr)
+, m_pack_count  (0)
+, m_tris        (nullptr)
+{ /* DO_NOTHING */ }
+
+CBVH8::~CBVH8()
+{
+    if (m_nodes != nullptr)
+    {
+        _aligned_free(m_nodes);
+        m_nodes = nullptr;
+    }
+
+    if (m_leaves != nullptr)
+    {
+        delete[] m_leaves;
+        m_leaves = nullptr;
+    }
+
+    if (m_packs != nullptr)
+    {
+        _aligned_free(m_packs);
+        m_packs = nullptr;
+    }
+}
+
+void CBVH8::dispose()
+{ delete this; }
+
+CBVH8* CBVH8::build(std::vector<Triangle*>& tris)
+{
+    std::vector<BuildNode> nodes;
+    std::vector<BuildLeaf> leaves;
+    build_compressed(0, tris.size(), tris.data(), nodes, leaves);
+
+    auto instance = new CBVH8();
+    instance->setup(tris.data(), nodes, leaves);
+    return instance;
+}
+
+CBVH8* CBVH8::build_spatial(std::vector<Triangle*>& tris, float budget)
+{
+    SplitTree tree;
+    if (!build_split_tree(tris, budget, tree))
+    { return build(tris); }
+
+    std::vector<BuildNode> nodes;
+    std::vector<BuildLeaf> leaves;
+    collapse(tree, 0, nodes, leaves);
+
+    // 分割された三角形は重複して参照されるので，参照の配列を持っておく.
+    auto instance = new CBVH8();
+    instance->m_refs.swap(tree.refs);
+    instance->setup(instance->m_refs.data(), nodes, leaves);
+    return instance;
+}
+
+void CBVH8::setup(Triangle** tris, const std::vector<BuildNode>& nodes, const std::vector<BuildLeaf>& leaves)
+{
+    m_tris = tris;
+
+    // ノードを量子化して詰める.
+    m_node_count = nodes.size();
+    m_nodes = static_cast<CNode8*>(_aligned_malloc(sizeof(CNode8) * nodes.size(), alignof(CNode8)));
+    for(size_t i=0; i<nodes.size(); ++i)
+    { encode(nodes[i], m_nodes[i]); }
+
+    // 葉ごとに三角形を8個ずつのパックに並べる.
+    m_leaf_count = leaves.size();
+    m_leaves     = new Leaf[leaves.size()];
+
+    size_t pack_count = 0;
+    for(size_t i=0; i<leaves.size(); ++i)
+    {
+        m_leaves[i].offset = uint32_t(leaves[i].offset);
+        m_leaves[i].count  = uint32_t(leaves[i].count);
+        m_leaves[i].pack   = uint32_t(pack_count);
+        pack_count += (leaves[i].count + 7) / 8;
+    }
+
+    auto size = sizeof(TrianglePack<8>) * pack_count;
+    m_pack_count = pack_count;
+    m_packs = static_cast<TrianglePack<8>*>(_aligned_malloc(size, alignof(TrianglePack<8>)));
+    memset(m_packs, 0, size);
+
+    for(size_t i=0; i<leaves.size(); ++i)
+    {
+        auto& leaf = m_leaves[i];
+        fill_packs<8>(leaf.count, &tris[leaf.offset], &m_packs[leaf.pack]);
+    }
+}
+
+R3D_TARGET_AVX bool CBVH8::intersect(const Ray& ray, HitRecord& record) const
+{
+    Ray8 ray8 = make_ray8(ray);
+    auto hit  = intersect_sub(ray, ray8, 0, record);
+
+    // AVXとSSEの切り替えペナルティを避ける.
+    _mm256_zeroupper();
+    return hit;
+}
+
+R3D_TARGET_AVX bool CBVH8::intersect_sub(const Ray& ray, const Ray8& ray8, uint32_t index, HitRecord& record) const
+{
+    R3D_STATS_ADD(CounterNodes, 1);
+    R3D_STATS_ADD(CounterBoxTests, 8);
+
+    auto& node = m_nodes[index];
+    int   mask = 0;
+
+    // 子ノードのBoxとまとめて判定.
+    if (!hit(ray8, node, mask))
+    { return false; }
+
+    auto hit = false;
+    for(auto i=0; mask != 0; ++i, mask >>= 1)
+    {
+        if ((mask & 0x1) == 0)
+        { continue; }
+
+        auto child = node.child[i];
+        if (child & LeafBit)
+        { hit |= intersect_leaf(ray, ray8, m_leaves[child & ~LeafBit], record); }
+        else
+        { hit |= intersect_sub(ray, ray8, child, record); }
+    }
+
+    return hit;
+}
+
+R3D_TARGET_AVX bool CBVH8::intersect_leaf(const Ray& ray, const Ray8& ray8, const Leaf& leaf, HitRecord& record) const
+{
+    R3D_STATS_ADD(CounterTriangleTests, leaf.count);
+
+    auto hit        = false;
+    auto pack_count = (leaf.count + 7) / 8;
+
+    for(uint32_t i=0; i<pack_count; ++i)
+    {
+        auto mask = hit_pack(ray8, m_packs[leaf.pack + i], ray.t_max, record.dist);
+
+        // 候補になったものだけスカラー版で判定して交差記録を更新する.
+        for(auto j=leaf.offset + i * 8; mask != 0; ++j, mask >>= 1)
+        {
+            if ((mask & 0x1) == 0)
+            { continue; }
+
+            _mm256_zeroupper();
+            hit |= m_tris[j]->hit(ray, record);
+        }
+    }
+
+    return hit;
+}
+
 #endif//defined(ENABLE_AVX)
+
+#if defined(ENABLE_AVX512)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// BVH16 class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+R3D_TARGET_AVX512 BVH16::BVH16(int count, BVH16** nodes, const Box* boxes)
+: m_box(boxes, count)
+{
+    for(auto i=0; i<16; ++i)
+    { m_node[i] = (i < count) ? nodes[i] : nullptr; }
+
+    m_mask       = (1u << count) - 1;
+    m_packs      = nullptr;
+    m_pack_count = 0;
+}
+
+R3D_TARGET_AVX512 BVH16::BVH16(size_t count, Triangle** tris)
+: m_box(nullptr, 0)
+, m_tris(tris, count)
+{
+    for(auto i=0; i<16; ++i)
+    { m_node[i] = nullptr; }
+
+    m_mask  = 0;
+    m_packs = create_packs<16>(count, tris, m_pack_count);
+}
+
+BVH16::~BVH16()
+{
+    for(auto i=0; i<16; ++i)
+    {
+        if (m_node[i] != nullptr)
+        {
+            delete m_node[i];
+            m_node[i] = nullptr;
+        }
+    }
+
+    if (m_packs != nullptr)
+    {
+        _aligned_free(m_packs);
+        m_packs = nullptr;
+    }
+}
+
+void BVH16::dispose()
+{ delete this; }
+
+R3D_TARGET_AVX512 bool BVH16::intersect(const Ray& ray, HitRecord& record) const
+{
+    Ray16 ray16 = make_ray16(ray);
+    auto  hit   = intersect_sub(ray, ray16, record);
+
+    // AVXとSSEの切り替えペナルティを避ける.
+    _mm256_zeroupper();
+    return hit;
+}
+
+R3D_TARGET_AVX512 bool BVH16::intersect_sub(const Ray& ray, const Ray16& ray16, HitRecord& record) const
+{
+    R3D_STATS_ADD(CounterNodes, 1);
+
+    if (!m_tris.empty())
+    {
+        R3D_STATS_ADD(CounterTriangleTests, m_tris.size());
+
+        auto hit = false;
+        for(size_t i=0; i<m_pack_count; ++i)
+        {
+            auto mask = hit_pack(ray16, m_packs[i], ray.t_max, record.dist);
+
+            // 候補になったものだけスカラー版で判定して交差記録を更新する.
+            for(size_t j=i * 16; mask != 0; ++j, mask >>= 1)
+            {
+                if ((mask & 0x1) == 0)
+                { continue; }
+
+                _mm256_zeroupper();
+                hit |= m_tris[j]->hit(ray, record);
+            }
+        }
+
+        return hit;
+    }
+
+    R3D_STATS_ADD(CounterBoxTests, 16);
+
+    // 子ノードのBoxとまとめて判定.
+    int mask = 0;
+    if (!hit(ray16, m_box, mask))
+    { return false; }
+
+    auto hit = false;
+    mask &= int(m_mask);
+    for(auto i=0; mask != 0; ++i, mask >>= 1)
+    {
+        if (mask & 0x1)
+        { hit |= m_node[i]->intersect_sub(ray, ray16, record); }
+    }
+
+    return hit;
+}
+
+BVH16* BVH16::build(std::vector<Triangle*>& tris)
+{ return build_sub(tris.size(), tris.data()); }
+
+R3D_TARGET_AVX512 BVH16* BVH16::build_sub(size_t count, Triangle** tris)
+{
+    constexpr size_t LeafSize = 32;
+
+    if (count <= LeafSize)
+    { return new BVH16(count, tris); }
+
+    // 中央値分割を4段繰り返して最大16個に分ける.
+    size_t offset[16];
+    size_t counts[16];
+    auto n = multi_split(count, tris, 4, LeafSize, offset, counts);
+
+    // 分割できなかった.
+    if (n == 1)
+    { return new BVH16(count, tris); }
+
+    BVH16* nodes[16];
+    Box    boxes[16];
+    for(auto i=0; i<n; ++i)
+    {
+        boxes[i] = create_box(counts[i], &tris[offset[i]]);
+        nodes[i] = build_sub(counts[i], &tris[offset[i]]);
+    }
+
+    return new BVH16(n, nodes, boxes);
+}
+
+R3D_TARGET_AVX512 float BVH16::refit()
+{
+    auto cost = 0.0f;
+    auto box  = refit_sub(cost);
+
+    _mm256_zeroupper();
+    return normalize_cost(cost, box);
+}
+
+R3D_TARGET_AVX512 Box BVH16::refit_sub(float& cost)
+{
+    if (!m_tris.empty())
+    {
+        if (m_packs != nullptr)
+        { fill_packs<16>(m_tris.size(), m_tris.begin(), m_packs); }
+
+        // 葉のボックスは親ノードが持つ.
+        return refit_leaf(m_tris.size(), m_tris.begin(), cost);
+    }
+
+    Box boxes[16];
+    auto count = 0;
+    for(; count < 16 && m_node[count] != nullptr; ++count)
+    { boxes[count] = m_node[count]->refit_sub(cost); }
+
+    m_box = Box16(boxes, count);
+
+    auto box = boxes[0];
+    for(auto i=1; i<count; ++i)
+    { box = join(box, boxes[i]); }
+
+    cost += surface_area(box) * TraversalCost;
+    return box;
+}
+
+void* BVH16::operator new (size_t size)
+{ return _aligned_malloc(size, 64); }
+
+void* BVH16::operator new[] (size_t size)
+{ return _aligned_malloc(size, 64); }
+
+void BVH16::operator delete (void* ptr)
+{ _aligned_free(ptr); }
+
+void BVH16::operator delete[] (void* ptr)
+{ _aligned_free(ptr); }
+
+#endif//defined(ENABLE_AVX512)
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Accelerator class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      実行中のCPUで使える最も幅の広いカーネルで構築します.
+//-------------------------------------------------------------------------------------------------
+Accelerator* Accelerator::build(std::vector<Triangle*>& tris)
+{
+#if defined(ENABLE_AVX)
+    if (g_split_budget > 0.0f && CpuInfo::has(CpuInfo::IsaAVX))
+    { return CBVH8::build_spatial(tris, g_split_budget); }
+
+    if (g_compressed && CpuInfo::has(CpuInfo::IsaAVX))
+    { return CBVH8::build(tris); }
+#endif
+
+#if defined(ENABLE_AVX512)
+    if (CpuInfo::has(CpuInfo::IsaAVX512))
+    { return BVH16::build(tris); }
+#endif
+
+#if defined(ENABLE_AVX)
+    if (CpuInfo::has(CpuInfo::IsaAVX))
+    { return BVH8::build(tris); }
+#endif
+
+#if defined(ENABLE_SSE2)
+    if (CpuInfo::has(CpuInfo::IsaSSE2))
+    { return BVH4::build(tris); }
+#endif
+
+    return BVH::build(tris);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      build() が選択するカーネル名を取得します.
+//-------------------------------------------------------------------------------------------------
+const char* Accelerator::kernel_name()
+{
+#if defined(ENABLE_AVX)
+    if (g_split_budget > 0.0f && CpuInfo::has(CpuInfo::IsaAVX))
+    { return "CBVH8-SBVH"; }
+
+    if (g_compressed && CpuInfo::has(CpuInfo::IsaAVX))
+    { return "CBVH8"; }
+#endif
+
+#if defined(ENABLE_AVX512)
+    if (CpuInfo::has(CpuInfo::IsaAVX512))
+    { return "BVH16"; }
+#endif
+
+#if defined(ENABLE_AVX)
+    if (CpuInfo::has(CpuInfo::IsaAVX))
+    { return "BVH8"; }
+#endif
+
+#if defined(ENABLE_SSE2)
+    if (CpuInfo::has(CpuInfo::IsaSSE2))
+    { return "BVH4"; }
+#endif
+
+    return "BVH";
+}
+
+//-------------------------------------------------------------------------------------------------
+//      量子化したノードを使う圧縮BVHで構築するかどうか設定します.
+//-------------------------------------------------------------------------------------------------
+void Accelerator::set_compressed(bool value)
+{ g_compressed = value; }
+
+//-------------------------------------------------------------------------------------------------
+//      空間分割ありのSAH(SBVH)で構築するかどうか設定します.
+//-------------------------------------------------------------------------------------------------
+void Accelerator::set_spatial_split(float budget)
+{ g_split_budget = budget; }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// ShapeBVH class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+ShapeBVH::ShapeBVH()
+: m_cost     (0.0f)
+, m_base_cost(0.0f)
+{ /* DO_NOTHING */ }
+
+ShapeBVH::~ShapeBVH()
+{ clear(); }
+
+void ShapeBVH::build(const std::vector<Shape*>& shapes)
+{
+    // shapes が m_shapes 自身の場合もあるので先に複製する.
+    auto list = shapes;
+    clear();
+
+    m_shapes.swap(list);
+    m_boxes.resize(m_shapes.size());
+    for(size_t i=0; i<m_shapes.size(); ++i)
+    { m_boxes[i] = m_shapes[i]->bounds(); }
+
+    if (!m_shapes.empty())
+    {
+        m_nodes.reserve(m_shapes.size() * 2);
+        build_sub(0, uint32_t(m_shapes.size()));
+    }
+
+    m_cost      = update();
+    m_base_cost = m_cost;
+}
+
+void ShapeBVH::clear()
+{
+    m_nodes .clear();
+    m_shapes.clear();
+    m_boxes .clear();
+    m_cost      = 0.0f;
+    m_base_cost = 0.0f;
+}
+
+uint32_t ShapeBVH::build_sub(uint32_t offset, uint32_t count)
+{
+    auto index = uint32_t(m_nodes.size());
+    m_nodes.push_back(Node());
+
+    // 中心のボックスの最長軸で分ける.
+    Box center;
+    for(auto i=offset; i<offset + count; ++i)
+    {
+        auto c = (m_boxes[i].mini + m_boxes[i].maxi) * 0.5f;
+        center.mini = min(center.mini, c);
+        center.maxi = max(center.maxi, c);
+    }
+
+    auto axis = longest_axis(center);
+    if (count <= ShapeLeafSize || center.maxi.a[axis] == center.mini.a[axis])
+    {
+        m_nodes[index].index = offset;
+        m_nodes[index].count = count;
+        return index;
+    }
+
+    // 形状とボックスの並びを揃えたまま中央値で分ける.
+    std::vector<uint32_t> order(count);
+    for(uint32_t i=0; i<count; ++i)
+    { order[i] = offset + i; }
+
+    auto mid = count / 2;
+    std::nth_element(order.begin(), order.begin() + mid, order.end(),
+        [&](uint32_t lhs, uint32_t rhs)
+        {
+            return m_boxes[lhs].mini.a[axis] + m_boxes[lhs].maxi.a[axis]
+                 < m_boxes[rhs].mini.a[axis] + m_boxes[rhs].maxi.a[axis];
+        });
+
+    std::vector<Shape*> shapes(count);
+    std::vector<Box>    boxes (count);
+    for(uint32_t i=0; i<count; ++i)
+    {
+        shapes[i] = m_shapes[order[i]];
+        boxes [i] = m_boxes [order[i]];
+    }
+    std::copy(shapes.begin(), shapes.end(), m_shapes.begin() + offset);
+    std::copy(boxes .begin(), boxes .end(), m_boxes .begin() + offset);
+
+    // 左の子は直後に並べる.
+    build_sub(offset, mid);
+    auto right = build_sub(offset + mid, count - mid);
+
+    m_nodes[index].index = right;
+    m_nodes[index].count = 0;
+    return index;
+}
+
+float ShapeBVH::update()
+{
+    if (m_nodes.empty())
+    { return 0.0f; }
+
+    for(size_t i=0; i<m_shapes.size(); ++i)
+    { m_boxes[i] = m_shapes[i]->bounds(); }
+
+    // 子ノードは親より後ろに並んでいるので，後ろから更新すればよい.
+    auto cost = 0.0f;
+    for(auto i=m_nodes.size(); i-- > 0;)
+    {
+        auto& node = m_nodes[i];
+        if (node.count > 0)
+        {
+            node.box = m_boxes[node.index];
+            for(auto j=node.index + 1; j<node.index + node.count; ++j)
+            { node.box = join(node.box, m_boxes[j]); }
+
+            cost += surface_area(node.box) * IntersectCost * float(node.count);
+        }
+        else
+        {
+            node.box = join(m_nodes[i + 1].box, m_nodes[node.index].box);
+            cost += surface_area(node.box) * TraversalCost;
+        }
+    }
+
+    return normalize_cost(cost, m_nodes[0].box);
+}
+
+bool ShapeBVH::refit(float threshold)
+{
+    m_cost = update();
+    if (m_cost <= m_base_cost * threshold)
+    { return false; }
+
+    build(m_shapes);
+    return true;
+}
+
+bool ShapeBVH::intersect(const Ray& ray, HitRecord& record) const
+{
+    if (m_nodes.empty())
+    { return false; }
+
+    // 中央値分割なので深さは形状数の対数で収まる.
+    uint32_t stack[64];
+    auto top = 0;
+    stack[top++] = 0;
+
+    // インスタンスも距離をワールド空間で返すので，見つかった交差より遠いノードは飛ばせる.
+    auto cull = ray;
+
+    auto result = false;
+    while(top > 0)
+    {
+        auto  index = stack[--top];
+        auto& node  = m_nodes[index];
+
+        R3D_STATS_ADD(CounterNodes, 1);
+        R3D_STATS_ADD(CounterBoxTests, 1);
+
+        cull.t_max = min(ray.t_max, record.dist);
+        if (!hit(cull, node.box))
+        { continue; }
+
+        if (node.count > 0)
+        {
+            for(auto i=node.index; i<node.index + node.count; ++i)
+            { result |= m_shapes[i]->hit(ray, record); }
+            continue;
+        }
+
+        stack[top++] = node.index;
+        stack[top++] = index + 1;
+    }
+
+    return result;
+}
@@ -11,11 +11,27 @@
 //-------------------------------------------------------------------------------------------------
 #include <r3d_canvas.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <cstring>
 #include <stb_image_write.h>
 
 
 namespace {
 
+//-------------------------------------------------------------------------------------------------
+// Constant Values.
+//-------------------------------------------------------------------------------------------------
+constexpr float kMinLuminance = 1e-2f;  //!< 相対誤差を求める際の輝度の下限値です.
+constexpr int   kATrousIterations = 5;  //!< à-trous フィルタの反復回数です.
+constexpr float kSigmaColor  = 1.0f;    //!< à-trous フィルタの色の重みの幅です.
+constexpr float kSigmaAlbedo = 0.1f;    //!< à-trous フィルタのアルベドの重みの幅です.
+constexpr int   kMaxRowThreads  = 8;    //!< 行単位の並列処理に使う最大スレッド数です(メモリ帯域律速なので少なめ).
+constexpr int   kChunksPerThread = 4;   //!< 1スレッドあたりの行ブロック数です(負荷分散用).
+constexpr int   kReduceRows = 16;       //!< 総和を求める際の1ブロックあたりの行数です(足す順番を固定する).
+
 //------------------------------------------------------------------------------------------------
 //      輝度値を取得します.
 //------------------------------------------------------------------------------------------------
@@ -26,196 +42,1363 @@ float RGBToY(const Vector3& value)
     return dot(value, bt601_to_luminance);
 }
 
-//------------------------------------------------------------------------------------------------
-//      対数平均と最大輝度値を求めます.
-//------------------------------------------------------------------------------------------------
-void CalcLogAve
-(
-    int             width,
-    int             height,
-    const Vector3*  pPixels,
-    float           epsilon,
-    float&          aveLw,
-    float&          maxLw
-)
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 log2 を求めます(絶対誤差 3e-5 程度).
+//-------------------------------------------------------------------------------------------------
+inline float fast_log2(float x)
+{
+    union { float f; uint32_t i; } v = { x };
+    auto e = float(int((v.i >> 23) & 0xff) - 127);
+    v.i = (v.i & 0x007fffff) | 0x3f800000;
+    auto t = v.f - 1.0f;
+
+    // log2(1 + t), t in [0, 1) の5次近似.
+    auto p = 0.0434313238f;
+    p = p * t - 0.187732144f;
+    p = p * t + 0.408734172f;
+    p = p * t - 0.705710979f;
+    p = p * t + 1.44126894f;
+    p = p * t + 3.18072743e-5f;
+    return e + p;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 exp2 を求めます(相対誤差 1e-5 程度).
+//-------------------------------------------------------------------------------------------------
+inline float fast_exp2(float x)
+{
+    x = max(min(x, 127.0f), -126.0f);
+    auto i = floorf(x);
+    auto t = x - i;
+
+    // 2^t, t in [0, 1) の4次近似.
+    auto p = 0.0136765608f;
+    p = p * t + 0.0516670284f;
+    p = p * t + 0.241709986f;
+    p = p * t + 0.692931415f;
+    p = p * t + 1.00000727f;
+
+    union { uint32_t i; float f; } v = { uint32_t(int(i) + 127) << 23 };
+    return p * v.f;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 pow を求めます(x > 0).
+//-------------------------------------------------------------------------------------------------
+inline float fast_pow(float x, float y)
+{ return (x > 0.0f) ? fast_exp2(y * fast_log2(x)) : 0.0f; }
+
+//-------------------------------------------------------------------------------------------------
+//      pow を求めます(fast_pow の参照実装, x > 0).
+//-------------------------------------------------------------------------------------------------
+inline float exact_pow(float x, float y)
+{ return (x > 0.0f) ? powf(x, y) : 0.0f; }
+
+#if defined(ENABLE_SSE2)
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 log2 を求めます(SSE2版).
+//-------------------------------------------------------------------------------------------------
+inline __m128 fast_log2(__m128 x)
+{
+    auto bits = _mm_castps_si128(x);
+    auto e    = _mm_cvtepi32_ps(_mm_sub_epi32(
+                    _mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)),
+                    _mm_set1_epi32(127)));
+    auto m    = _mm_castsi128_ps(_mm_or_si128(
+                    _mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                    _mm_set1_epi32(0x3f800000)));
+    auto t    = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+
+    auto p = _mm_set1_ps(0.0434313238f);
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.187732144f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps( 0.408734172f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.705710979f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps( 1.44126894f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps( 3.18072743e-5f));
+    return _mm_add_ps(e, p);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 exp2 を求めます(SSE2版).
+//-------------------------------------------------------------------------------------------------
+inline __m128 fast_exp2(__m128 x)
+{
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(127.0f)), _mm_set1_ps(-126.0f));
+
+    // SSE2には floor が無いので，切り捨て後に負の端数を補正する.
+    auto i = _mm_cvttps_epi32(x);
+    auto f = _mm_cvtepi32_ps(i);
+    auto c = _mm_cmpgt_ps(f, x);
+    i = _mm_add_epi32(i, _mm_castps_si128(c));  // c は -1 か 0.
+    f = _mm_sub_ps(f, _mm_and_ps(c, _mm_set1_ps(1.0f)));
+    auto t = _mm_sub_ps(x, f);
+
+    auto p = _mm_set1_ps(0.0136765608f);
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.0516670284f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.241709986f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.692931415f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.00000727f));
+
+    auto e = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+    return _mm_mul_ps(p, e);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      高速な近似 pow を求めます(SSE2版, x > 0).
+//-------------------------------------------------------------------------------------------------
+inline __m128 fast_pow(__m128 x, __m128 y)
+{
+    auto mask = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    return _mm_and_ps(mask, fast_exp2(_mm_mul_ps(y, fast_log2(x))));
+}
+
+//-------------------------------------------------------------------------------------------------
+//      4ピクセル分の輝度値を求めます(SSE2版).
+//-------------------------------------------------------------------------------------------------
+inline __m128 RGBToY(const float* rgb)
+{
+    // AoS の 4ピクセル(12要素)を SoA に並べ替える.
+    auto a = _mm_loadu_ps(rgb + 0);     // x0 y0 z0 x1
+    auto b = _mm_loadu_ps(rgb + 4);     // y1 z1 x2 y2
+    auto c = _mm_loadu_ps(rgb + 8);     // z2 x3 y3 z3
+
+    auto x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+    auto y = _mm_shuffle_ps(
+                _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)),
+                _MM_SHUFFLE(2, 0, 2, 0));
+    auto z = _mm_shuffle_ps(
+                _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)),
+                _MM_SHUFFLE(2, 0, 2, 0));
+
+    return _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(x, _mm_set1_ps(0.299f)),
+        _mm_mul_ps(y, _mm_set1_ps(0.587f))),
+        _mm_mul_ps(z, _mm_set1_ps(0.114f)));
+}
+#endif//defined(ENABLE_SSE2)
+
+//-------------------------------------------------------------------------------------------------
+//      2値を昇順に並べ替えます(分岐無し).
+//-------------------------------------------------------------------------------------------------
+inline void sort2(float& a, float& b)
+{
+    auto t = min(a, b);
+    b = max(a, b);
+    a = t;
+}
+
+#if defined(ENABLE_SSE2)
+inline void sort2(__m128& a, __m128& b)
+{
+    auto t = _mm_min_ps(a, b);
+    b = _mm_max_ps(a, b);
+    a = t;
+}
+#endif//defined(ENABLE_SSE2)
+
+//-------------------------------------------------------------------------------------------------
+//      9要素の中央値を求めます.
+//      cf. John Smith, "Implementing median filters in XC4000E FPGAs", XCELL 23, 1995.
+//-------------------------------------------------------------------------------------------------
+template<typename T>
+inline T median9(T* p)
+{
+    // 19回の比較交換によるソーティングネットワーク.
+    sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+    sort2(p[0], p[1]); sort2(p[3], p[4]); sort2(p[6], p[7]);
+    sort2(p[1], p[2]); sort2(p[4], p[5]); sort2(p[7], p[8]);
+    sort2(p[0], p[3]); sort2(p[5], p[8]); sort2(p[4], p[7]);
+    sort2(p[3], p[6]); sort2(p[1], p[4]); sort2(p[2], p[5]);
+    sort2(p[4], p[7]); sort2(p[4], p[2]); sort2(p[6], p[4]);
+    sort2(p[4], p[2]);
+    return p[4];
+}
+
+//-------------------------------------------------------------------------------------------------
+//      高ダイナミックレンジの色を圧縮します(フィルタの重み計算用).
+//-------------------------------------------------------------------------------------------------
+inline Vector3 compress(const Vector3& value)
+{ return value / (1.0f + RGBToY(value)); }
+
+//-------------------------------------------------------------------------------------------------
+//      1行分を8bitに量子化します.
+//-------------------------------------------------------------------------------------------------
+void quantize_row(const float* src, uint8_t* dst, int count, bool exact)
+{
+    auto i = 0;
+
+#if defined(ENABLE_SSE2)
+    // 16要素ずつ 8bit に詰める.
+    auto scale = _mm_set1_ps(255.0f);
+    auto half  = _mm_set1_ps(0.5f);
+    auto zero  = _mm_setzero_ps();
+    auto one   = _mm_set1_ps(1.0f);
+    for(; !exact && i + 16 <= count; i += 16)
+    {
+        __m128i v[4];
+        for(auto k = 0; k < 4; ++k)
+        {
+            auto f = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + k * 4), zero), one);
+            v[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(f, scale), half));
+        }
+
+        auto lo = _mm_packs_epi32(v[0], v[1]);
+        auto hi = _mm_packs_epi32(v[2], v[3]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    for(; i < count; ++i)
+    { dst[i] = static_cast<uint8_t>(saturate(src[i]) * 255.0f + 0.5f); }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      リトルエンディアンで書き込みます.
+//-------------------------------------------------------------------------------------------------
+void write_le(FILE* fp, uint32_t value, int bytes)
+{
+    for(auto i = 0; i < bytes; ++i)
+    { fputc(int((value >> (i * 8)) & 0xff), fp); }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      拡張子からファイル形式を判定します.
+//-------------------------------------------------------------------------------------------------
+Canvas::Format get_format(const char* filename)
+{
+    auto ext = strrchr(filename, '.');
+    if (ext == nullptr)
+    { return Canvas::FormatBMP; }
+
+    if (_stricmp(ext, ".png") == 0)
+    { return Canvas::FormatPNG; }
+    else if (_stricmp(ext, ".hdr") == 0)
+    { return Canvas::FormatHDR; }
+    else if (_stricmp(ext, ".pfm") == 0)
+    { return Canvas::FormatPFM; }
+
+    return Canvas::FormatBMP;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// RowPool class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class RowPool
+{
+public:
+    //---------------------------------------------------------------------------------------------
+    //      シングルトンを取得します(初回呼び出し時にスレッドを生成します).
+    //---------------------------------------------------------------------------------------------
+    static RowPool& instance()
+    {
+        static RowPool pool;
+        return pool;
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      呼び出しスレッドを含めたスレッド数を取得します.
+    //---------------------------------------------------------------------------------------------
+    int size() const
+    { return int(m_threads.size()) + 1; }
+
+    //---------------------------------------------------------------------------------------------
+    //      [0, count) の各ブロックを並列に処理します. 呼び出しスレッドも処理に参加します.
+    //---------------------------------------------------------------------------------------------
+    void run(int count, const std::function<void(int)>& task)
+    {
+        // 書き出しスレッドと同期書き出しが重なっても良いように，ジョブは1つずつ流す.
+        std::lock_guard<std::mutex> job_locker(m_job_mutex);
+
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_task   = &task;
+            m_count  = count;
+            m_next   = 0;
+            m_active = int(m_threads.size());
+            m_generation++;
+        }
+        m_start_cond.notify_all();
+
+        drain();
+
+        std::unique_lock<std::mutex> locker(m_mutex);
+        m_done_cond.wait(locker, [&]() { return m_active == 0; });
+        m_task = nullptr;
+    }
+
+private:
+    std::vector<std::thread>        m_threads;
+    std::mutex                      m_job_mutex;
+    std::mutex                      m_mutex;
+    std::condition_variable         m_start_cond;
+    std::condition_variable         m_done_cond;
+    const std::function<void(int)>* m_task       = nullptr;
+    int                             m_count      = 0;
+    std::atomic<int>                m_next       = { 0 };
+    int                             m_active     = 0;
+    uint64_t                        m_generation = 0;
+    bool                            m_exit       = false;
+
+    RowPool()
+    {
+        auto count = int(std::thread::hardware_concurrency());
+        count = std::max(1, std::min(count, kMaxRowThreads));
+
+        for(auto i = 1; i < count; ++i)
+        { m_threads.push_back(std::thread(&RowPool::worker_main, this)); }
+    }
+
+    ~RowPool()
+    {
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_exit = true;
+        }
+        m_start_cond.notify_all();
+
+        for(auto& thd : m_threads)
+        { thd.join(); }
+    }
+
+    void drain()
+    {
+        for(;;)
+        {
+            auto i = m_next.fetch_add(1);
+            if (i >= m_count)
+            { break; }
+
+            (*m_task)(i);
+        }
+    }
+
+    void worker_main()
+    {
+        uint64_t generation = 0;
+        for(;;)
+        {
+            {
+                std::unique_lock<std::mutex> locker(m_mutex);
+                m_start_cond.wait(locker, [&]() { return m_exit || m_generation != generation; });
+                if (m_exit)
+                { return; }
+
+                generation = m_generation;
+            }
+
+            drain();
+
+            {
+                std::lock_guard<std::mutex> locker(m_mutex);
+                if (--m_active == 0)
+                { m_done_cond.notify_one(); }
+            }
+        }
+    }
+
+    RowPool             (const RowPool&) = delete;
+    RowPool& operator = (const RowPool&) = delete;
+};
+
+//-------------------------------------------------------------------------------------------------
+//      1ブロックあたりの行数を求めます.
+//-------------------------------------------------------------------------------------------------
+inline int row_block(int height)
+{
+    auto count = RowPool::instance().size() * kChunksPerThread;
+    return std::max(1, (height + count - 1) / count);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      rows 行ずつのブロックに分けて並列に処理します.
+//-------------------------------------------------------------------------------------------------
+template<typename Func>
+void parallel_rows(int height, int rows, Func func)
+{
+    if (height <= 0)
+    { return; }
+
+    auto count = (height + rows - 1) / rows;
+
+    // スレッドは毎回生成せず，常駐させたスレッドにブロックを配る.
+    RowPool::instance().run(count, [&](int index)
+    {
+        auto begin = index * rows;
+        func(begin, std::min(begin + rows, height));
+    });
+}
+
+//-------------------------------------------------------------------------------------------------
+//      行単位で並列に処理します.
+//-------------------------------------------------------------------------------------------------
+template<typename Func>
+void parallel_rows(int height, Func func)
+{ parallel_rows(height, row_block(height), func); }
+
+//-------------------------------------------------------------------------------------------------
+//      浮動小数配列の各要素に関数を適用します(行単位で並列).
+//-------------------------------------------------------------------------------------------------
+template<typename Scalar, typename Vector>
+void transform
+(
+    int                     width,
+    int                     height,
+    std::vector<Vector3>&   pixels,
+    bool                    exact,
+    Scalar                  scalar_func,
+    Vector                  vector_func
+)
+{
+    // Vector3 は float 3要素なので，チャンネルを区別しない処理は平坦な配列として扱える.
+    static_assert(sizeof(Vector3) == sizeof(float) * 3, "Invalid Vector3 Size.");
+
+    auto data   = &pixels[0].x;
+    auto stride = width * 3;
+
+    parallel_rows(height, [&](int begin, int end)
+    {
+        auto i    = begin * stride;
+        auto last = end   * stride;
+
+    #if defined(ENABLE_SSE2)
+        for(; !exact && i + 4 <= last; i += 4)
+        { _mm_storeu_ps(data + i, vector_func(_mm_loadu_ps(data + i))); }
+    #else
+        (void)vector_func;
+    #endif
+
+        for(; i < last; ++i)
+        { data[i] = scalar_func(data[i]); }
+    });
+}
+
+//------------------------------------------------------------------------------------------------
+//      対数平均と最大輝度値を求めます.
+//------------------------------------------------------------------------------------------------
+void CalcLogAve
+(
+    int             width,
+    int             height,
+    const Vector3*  pPixels,
+    float           epsilon,
+    bool            exact,
+    float&          aveLw,
+    float&          maxLw
+)
+{
+    struct Partial
+    {
+        double  sum;
+        float   max;
+    };
+
+    // 行ブロック毎の部分和. 足す順番がスレッド数やコア数に依らないように，
+    // ブロックの行数は固定にして，スレッドにはブロックを配るだけにする.
+    auto rows  = kReduceRows;
+    auto count = std::max(1, (height + rows - 1) / rows);
+    std::vector<Partial> partials(count, Partial{ 0.0, 0.0f });
+
+    parallel_rows(height, rows, [&](int begin, int end)
+    {
+        auto& partial = partials[begin / rows];
+        auto  sum     = 0.0;
+        auto  maxi    = 0.0f;
+
+        for( auto i=begin; i<end; ++i )
+        {
+            auto row = pPixels + i * width;
+            auto j   = 0;
+
+        #if defined(ENABLE_SSE2)
+            auto eps  = _mm_set1_ps(epsilon);
+            auto sum4 = _mm_setzero_ps();
+            auto max4 = _mm_setzero_ps();
+            for( ; !exact && j + 4 <= width; j += 4 )
+            {
+                auto Lw = RGBToY( &row[j].x );
+                max4 = _mm_max_ps( max4, Lw );
+                sum4 = _mm_add_ps( sum4, fast_log2( _mm_add_ps( eps, Lw ) ) );
+            }
+
+            alignas(16) float s[4];
+            alignas(16) float m[4];
+            _mm_store_ps( s, sum4 );
+            _mm_store_ps( m, max4 );
+            sum += double(s[0]) + double(s[1]) + double(s[2]) + double(s[3]);
+            maxi = max( maxi, max( max( m[0], m[1] ), max( m[2], m[3] ) ) );
+        #endif
+
+            for( ; j<width; ++j )
+            {
+                // 輝度値に変換.
+                auto Lw = RGBToY( row[j] );
+
+                // 最大輝度値を求める.
+                maxi = max( maxi, Lw );
+
+                // 輝度値の対数総和を求める.
+                sum += exact ? log2f( epsilon + Lw ) : fast_log2( epsilon + Lw );
+            }
+        }
+
+        partial.sum = sum;
+        partial.max = maxi;
+    });
+
+    auto sum = 0.0;
+    maxLw = 0.0f;
+    for(auto& partial : partials)
+    {
+        sum  += partial.sum;
+        maxLw = max( maxLw, partial.max );
+    }
+
+    // ピクセル数で除算し，指数をとる(log2で求めているので exp2).
+    aveLw = exp2f( float( sum / double( width * height ) ) );
+}
+
+} // namespace 
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// TileBuffer class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      コンストラクタです.
+//-------------------------------------------------------------------------------------------------
+TileBuffer::TileBuffer()
+: m_x       (0)
+, m_y       (0)
+, m_w       (0)
+, m_h       (0)
+, m_dirty   (false)
+, m_aov     (false)
+{ /* DO_NOTHING */ }
+
+//-------------------------------------------------------------------------------------------------
+//      担当するタイルを設定し，バッファをクリアします.
+//-------------------------------------------------------------------------------------------------
+void TileBuffer::reset(int x, int y, int w, int h, bool aov)
+{
+    m_x     = x;
+    m_y     = y;
+    m_w     = w;
+    m_h     = h;
+    m_dirty = false;
+    m_aov   = aov;
+
+    auto count = size_t(w * h);
+    m_pixels.assign(count, Vector3(0.0f, 0.0f, 0.0f));
+    m_sum2  .assign(count, 0.0f);
+    m_count .assign(count, 0);
+
+    if (aov)
+    {
+        m_albedo.assign(count, Vector3(0.0f, 0.0f, 0.0f));
+        m_normal.assign(count, Vector3(0.0f, 0.0f, 0.0f));
+        m_depth .assign(count, 0.0f);
+        m_time  .assign(count, 0.0f);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ピクセルに色を加算します(座標はキャンバス上の座標).
+//-------------------------------------------------------------------------------------------------
+void TileBuffer::add(int x, int y, const Vector3& value)
+{
+    auto idx = (y - m_y) * m_w + (x - m_x);
+    auto lum = RGBToY(value);
+
+    m_pixels[idx] += value;
+    m_sum2  [idx] += lum * lum;
+    m_count [idx]++;
+    m_dirty = true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ピクセルに色とAOVを加算します(座標はキャンバス上の座標).
+//-------------------------------------------------------------------------------------------------
+void TileBuffer::add(int x, int y, const Vector3& value, const AOV& aov)
+{
+    add(x, y, value);
+
+    if (!m_aov)
+    { return; }
+
+    auto idx = (y - m_y) * m_w + (x - m_x);
+    m_albedo[idx] += aov.albedo;
+    m_normal[idx] += aov.normal;
+    m_depth [idx] += aov.depth;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ピクセルの処理時間を加算します(座標はキャンバス上の座標).
+//-------------------------------------------------------------------------------------------------
+void TileBuffer::add_time(int x, int y, float sec)
+{
+    if (!m_aov)
+    { return; }
+
+    m_time[(y - m_y) * m_w + (x - m_x)] += sec;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      何も加算されていないかどうか?
+//-------------------------------------------------------------------------------------------------
+bool TileBuffer::empty() const
+{ return !m_dirty; }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Canvas class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      コンストラクタです.
+//-------------------------------------------------------------------------------------------------
+Canvas::Canvas()
+: m_w           (0)
+, m_h           (0)
+, m_filter      (FilterNone)
+, m_format      (FormatBMP)
+, m_aov         (false)
+, m_exact       (false)
+, m_write_index (-1)
+, m_ready_index (-1)
+, m_writer_exit (false)
+{ /* DO_NOTHING */ }
+
+//-------------------------------------------------------------------------------------------------
+//      デストラクタです.
+//-------------------------------------------------------------------------------------------------
+Canvas::~Canvas()
+{
+    // 書き出しスレッドを終了させる.
+    {
+        std::lock_guard<std::mutex> locker(m_writer_mutex);
+        m_writer_exit = true;
+    }
+    m_writer_cond.notify_all();
+
+    if (m_writer.joinable())
+    { m_writer.join(); }
+
+    m_pixels.clear();
+}
+
+//-------------------------------------------------------------------------------------------------
+//      レンダーターゲットのサイズを設定します.
+//-------------------------------------------------------------------------------------------------
+void Canvas::resize(int w, int h)
+{
+    m_w = w;
+    m_h = h;
+    auto count = m_w * m_h;
+    m_pixels.resize(count);
+    m_accums.resize(count);
+
+    for(auto i=0; i<count; ++i)
+    {
+        m_pixels[i] = Vector3(0.0f, 0.0f, 0.0f);
+        m_accums[i].sum2  = 0.0f;
+        m_accums[i].count = 0;
+    }
+
+    if (m_aov)
+    {
+        m_albedo.assign(count, Vector3(0.0f, 0.0f, 0.0f));
+        m_normal.assign(count, Vector3(0.0f, 0.0f, 0.0f));
+        m_depth .assign(count, 0.0f);
+        m_time  .assign(count, 0.0f);
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      指定ピクセルを取得します.
+//-------------------------------------------------------------------------------------------------
+Vector3& Canvas::at(int x, int y)
+{ return m_pixels[y * m_w + x]; }
+
+//-------------------------------------------------------------------------------------------------
+//      指定ピクセルを取得します(const版).
+//-------------------------------------------------------------------------------------------------
+const Vector3& Canvas::at(int x, int y) const
+{ return m_pixels[y * m_w + x]; }
+
+//-------------------------------------------------------------------------------------------------
+//      ピクセルを取得します.
+//-------------------------------------------------------------------------------------------------
+const Vector3* Canvas::data() const
+{ return m_pixels.data(); }
+
+//-------------------------------------------------------------------------------------------------
+//      タイルバッファの内容をキャンバスに加算します.
+//-------------------------------------------------------------------------------------------------
+void Canvas::commit(const TileBuffer& tile)
+{
+    if (tile.empty())
+    { return; }
+
+    // 同じタイルを同時に処理するスレッドは無いので，ワーカー同士は共有ロックで並列に書き込める.
+    std::shared_lock<std::shared_timed_mutex> locker(m_mutex);
+
+    for(auto j = 0; j < tile.m_h; ++j)
+    {
+        auto src = j * tile.m_w;
+        auto dst = (tile.m_y + j) * m_w + tile.m_x;
+
+        // 行単位で連続しているのでベクトル化されやすい.
+        for(auto i = 0; i < tile.m_w; ++i)
+        {
+            m_pixels[dst + i]       += tile.m_pixels[src + i];
+            m_accums[dst + i].sum2  += tile.m_sum2  [src + i];
+            m_accums[dst + i].count += tile.m_count [src + i];
+        }
+
+        if (!m_aov || !tile.m_aov)
+        { continue; }
+
+        for(auto i = 0; i < tile.m_w; ++i)
+        {
+            m_albedo[dst + i] += tile.m_albedo[src + i];
+            m_normal[dst + i] += tile.m_normal[src + i];
+            m_depth [dst + i] += tile.m_depth [src + i];
+            m_time  [dst + i] += tile.m_time  [src + i];
+        }
+    }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      指定ピクセルのサンプル数を取得します.
+//-------------------------------------------------------------------------------------------------
+uint32_t Canvas::samples(int x, int y) const
+{ return m_accums[y * m_w + x].count; }
+
+//-------------------------------------------------------------------------------------------------
+//      指定領域の平均相対誤差を求めます.
+//-------------------------------------------------------------------------------------------------
+float Canvas::error(int x, int y, int w, int h) const
+{
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
+
+    auto result = 0.0f;
+
+    for(auto j = y; j < y + h; ++j)
+    for(auto i = x; i < x + w; ++i)
+    {
+        auto idx = j * m_w + i;
+        auto n   = float(m_accums[idx].count);
+        if (n < 2.0f)
+        { return F_MAX; }
+
+        // 輝度は線形なので総和の輝度 = 輝度の総和.
+        // 平均値の標準誤差 / 平均値.
+        auto mean = RGBToY(m_pixels[idx]) / n;
+        auto var  = max(m_accums[idx].sum2 / n - mean * mean, 0.0f) * n / (n - 1.0f);
+        result += sqrt(var / n) / max(mean, kMinLuminance);
+    }
+
+    return result / float(w * h);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      1ピクセルあたりの実効サンプル数を求めます.
+//-------------------------------------------------------------------------------------------------
+float Canvas::average_samples() const
+{
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
+
+    auto total = 0.0;
+    for(size_t i=0; i<m_accums.size(); ++i)
+    { total += m_accums[i].count; }
+
+    return float(total / double(m_w * m_h));
+}
+
+//-------------------------------------------------------------------------------------------------
+//      出力時に適用するフィルタを設定します.
+//-------------------------------------------------------------------------------------------------
+void Canvas::set_filter(Filter filter)
+{ m_filter = filter; }
+
+//-------------------------------------------------------------------------------------------------
+//      出力時に適用するフィルタを取得します.
+//-------------------------------------------------------------------------------------------------
+Canvas::Filter Canvas::filter() const
+{ return m_filter; }
+
+//-------------------------------------------------------------------------------------------------
+//      キャプチャー番号で書き出す際のファイル形式を設定します.
+//-------------------------------------------------------------------------------------------------
+void Canvas::set_format(Format format)
+{
+    m_format = format;
+
+    // PNGは圧縮率より速度を優先する. stb のグローバル変数なので，書き出しスレッドではなく設定時に変える.
+    stbi_write_png_compression_level = 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      キャプチャー番号で書き出す際のファイル形式を取得します.
+//-------------------------------------------------------------------------------------------------
+Canvas::Format Canvas::format() const
+{ return m_format; }
+
+//-------------------------------------------------------------------------------------------------
+//      キャプチャー番号から出力パスを作ります.
+//-------------------------------------------------------------------------------------------------
+void Canvas::make_path(char* path, size_t size, int counter) const
+{
+    static const char* kExt[] = { "bmp", "png", "hdr", "pfm" };
+    sprintf_s(path, size, "img/%03d.%s", counter, kExt[m_format]);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      AOVの記録を有効にします.
+//-------------------------------------------------------------------------------------------------
+void Canvas::enable_aov(bool enable)
+{ m_aov = enable; }
+
+//-------------------------------------------------------------------------------------------------
+//      AOVを記録するかどうか?
+//-------------------------------------------------------------------------------------------------
+bool Canvas::has_aov() const
+{ return m_aov; }
+
+//-------------------------------------------------------------------------------------------------
+//      参照実装で出力するかどうかを設定します.
+//-------------------------------------------------------------------------------------------------
+void Canvas::set_exact(bool exact)
+{ m_exact = exact; }
+
+//-------------------------------------------------------------------------------------------------
+//      参照実装で出力するかどうか?
+//-------------------------------------------------------------------------------------------------
+bool Canvas::exact() const
+{ return m_exact; }
+
+//-------------------------------------------------------------------------------------------------
+//      ファイルに書き出します.
+//-------------------------------------------------------------------------------------------------
+bool Canvas::write(const char* filename)
+{
+    resolve(m_capture);
+    return process(filename, m_capture);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      レイトレ合宿用にファイルに書き出します.
+//-------------------------------------------------------------------------------------------------
+bool Canvas::write(int counter)
 {
-    auto init = false;
-    for( auto i=0; i<height; ++i )
+    char path[256] = {};
+    make_path(path, sizeof(path), counter);
+    if (write(path))
     {
-        for( auto j=0; j<width; ++j )
-        {
-            // ピクセル番号.
-            auto idx = ( i * width ) + j;
+        printf_s("captured. %s\n", path);
+        return true;
+    }
 
-            // 輝度値に変換.
-            auto Lw = RGBToY( pPixels[idx] );
+    return false;
+}
 
-            // 最大輝度値を求める.
-            if ( !init )
-            {
-                maxLw = Lw;
-                init = true;
-            }
-            else
-            { maxLw = max( maxLw, Lw ); }
+//-------------------------------------------------------------------------------------------------
+//      累積バッファをそのまま保存します.
+//-------------------------------------------------------------------------------------------------
+bool Canvas::save(FILE* fp) const
+{
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
 
-            // 輝度値の対数総和を求める.
-            aveLw += logf( epsilon + Lw );
-        }
-    }
+    int32_t head[3] = { m_w, m_h, m_aov ? 1 : 0 };
+    if (fwrite(head, sizeof(head), 1, fp) != 1)
+    { return false; }
+
+    auto count = m_pixels.size();
+    if (fwrite(m_pixels.data(), sizeof(Vector3), count, fp) != count
+     || fwrite(m_accums.data(), sizeof(Accum),   count, fp) != count)
+    { return false; }
 
-    // ピクセル数で除算.
-    aveLw /= ( width * height );
+    if (m_aov)
+    {
+        if (fwrite(m_albedo.data(), sizeof(Vector3), count, fp) != count
+         || fwrite(m_normal.data(), sizeof(Vector3), count, fp) != count
+         || fwrite(m_depth .data(), sizeof(float),   count, fp) != count
+         || fwrite(m_time  .data(), sizeof(float),   count, fp) != count)
+        { return false; }
+    }
 
-    // 指数をとる.
-    aveLw = expf( aveLw );
+    return true;
 }
 
-} // namespace 
+//-------------------------------------------------------------------------------------------------
+//      累積バッファを復元します. サイズとAOVの有無が一致している必要があります.
+//-------------------------------------------------------------------------------------------------
+bool Canvas::load(FILE* fp)
+{
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
 
+    int32_t head[3] = {};
+    if (fread(head, sizeof(head), 1, fp) != 1)
+    { return false; }
 
+    if (head[0] != m_w || head[1] != m_h || (head[2] != 0) != m_aov)
+    {
+        fprintf_s(stderr, "Error : Canvas Size Mismatch. %d x %d\n", head[0], head[1]);
+        return false;
+    }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
-// Canvas class
-///////////////////////////////////////////////////////////////////////////////////////////////////
+    auto count = m_pixels.size();
+    if (fread(m_pixels.data(), sizeof(Vector3), count, fp) != count
+     || fread(m_accums.data(), sizeof(Accum),   count, fp) != count)
+    { return false; }
 
-//-------------------------------------------------------------------------------------------------
-//      コンストラクタです.
-//-------------------------------------------------------------------------------------------------
-Canvas::Canvas()
-{ /* DO_NOTHING */ }
+    if (m_aov)
+    {
+        if (fread(m_albedo.data(), sizeof(Vector3), count, fp) != count
+         || fread(m_normal.data(), sizeof(Vector3), count, fp) != count
+         || fread(m_depth .data(), sizeof(float),   count, fp) != count
+         || fread(m_time  .data(), sizeof(float),   count, fp) != count)
+        { return false; }
+    }
 
-//-------------------------------------------------------------------------------------------------
-//      デストラクタです.
-//-------------------------------------------------------------------------------------------------
-Canvas::~Canvas()
-{ m_pixels.clear(); }
+    return true;
+}
 
 //-------------------------------------------------------------------------------------------------
-//      レンダーターゲットのサイズを設定します.
+//      別のキャンバスの累積結果を加算します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::resize(int w, int h)
+bool Canvas::merge(const Canvas& other)
 {
-    m_w = w;
-    m_h = h;
-    auto count = m_w * m_h;
-    m_pixels.resize(count);
-    m_temps.resize(count);
-    m_output.resize(count * 3);
+    if (other.m_w != m_w || other.m_h != m_h || other.m_aov != m_aov)
+    {
+        fprintf_s(stderr, "Error : Canvas Size Mismatch. %d x %d\n", other.m_w, other.m_h);
+        return false;
+    }
 
-    for(auto i=0; i<count; ++i)
-    { m_pixels[i] = Vector3(0.0f, 0.0f, 0.0f); }
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
+    std::unique_lock<std::shared_timed_mutex> other_locker(other.m_mutex);
+
+    // サンプル数も加算するので，正規化時にサンプル数で重み付けした平均になる.
+    for(size_t i=0; i<m_pixels.size(); ++i)
+    {
+        m_pixels[i]       += other.m_pixels[i];
+        m_accums[i].sum2  += other.m_accums[i].sum2;
+        m_accums[i].count += other.m_accums[i].count;
+    }
+
+    if (m_aov)
+    {
+        for(size_t i=0; i<m_pixels.size(); ++i)
+        {
+            m_albedo[i] += other.m_albedo[i];
+            m_normal[i] += other.m_normal[i];
+            m_depth [i] += other.m_depth [i];
+            m_time  [i] += other.m_time  [i];
+        }
+    }
+
+    return true;
 }
 
 //-------------------------------------------------------------------------------------------------
-//      指定ピクセルを取得します.
+//      スナップショットを取り，バックグラウンドで書き出します.
 //-------------------------------------------------------------------------------------------------
-Vector3& Canvas::at(int x, int y)
-{ return m_pixels[y * m_w + x]; }
+void Canvas::write_async(int counter)
+{
+    std::unique_lock<std::mutex> locker(m_writer_mutex);
+
+    // 書き出しスレッドは必要になってから起動する.
+    if (!m_writer.joinable())
+    { m_writer = std::thread(&Canvas::writer_main, this); }
+
+    // 書き出し中でない方のバッファを使う.
+    // 書き出し待ちのものが残っていれば，新しいスナップショットで上書きする.
+    auto index = (m_write_index == 0) ? 1 : 0;
+    if (m_ready_index >= 0)
+    {
+        index = m_ready_index;
+        printf_s("skipped. capture %03d\n", m_snapshots[index].counter);
+    }
+    m_ready_index = -1;
+
+    auto begin = std::chrono::system_clock::now();
+
+    auto& snapshot = m_snapshots[index];
+    snapshot.counter = counter;
+    resolve(snapshot);
+
+    auto end = std::chrono::system_clock::now();
+    snapshot.copy_ms = std::chrono::duration<double, std::milli>(end - begin).count();
+
+    m_ready_index = index;
+    locker.unlock();
+
+    m_writer_cond.notify_all();
+}
 
 //-------------------------------------------------------------------------------------------------
-//      指定ピクセルを取得します(const版).
+//      非同期書き出しの完了を待機します.
 //-------------------------------------------------------------------------------------------------
-const Vector3& Canvas::at(int x, int y) const
-{ return m_pixels[y * m_w + x]; }
+void Canvas::flush()
+{
+    std::unique_lock<std::mutex> locker(m_writer_mutex);
+    m_writer_cond.wait(locker, [this]()
+    { return m_ready_index < 0 && m_write_index < 0; });
+}
 
 //-------------------------------------------------------------------------------------------------
-//      ピクセルを取得します.
+//      書き出しスレッドのメイン処理です.
 //-------------------------------------------------------------------------------------------------
-const Vector3* Canvas::data() const
-{ return m_pixels.data(); }
+void Canvas::writer_main()
+{
+    for(;;)
+    {
+        std::unique_lock<std::mutex> locker(m_writer_mutex);
+        m_writer_cond.wait(locker, [this]()
+        { return m_ready_index >= 0 || m_writer_exit; });
+
+        if (m_ready_index < 0)
+        { return; }
+
+        m_write_index = m_ready_index;
+        m_ready_index = -1;
+        locker.unlock();
+
+        // 描画と並行してトーンマップ・量子化・ファイル出力を行う.
+        auto& snapshot = m_snapshots[m_write_index];
+        char path[256] = {};
+        make_path(path, sizeof(path), snapshot.counter);
+
+        auto begin = std::chrono::system_clock::now();
+        auto ret   = process(path, snapshot);
+        auto end   = std::chrono::system_clock::now();
+
+        if (ret)
+        {
+            printf_s("captured. %s (copy %.1f ms, write %.1f ms)\n",
+                path,
+                snapshot.copy_ms,
+                std::chrono::duration<double, std::milli>(end - begin).count());
+        }
+        else
+        { fprintf_s(stderr, "Error : Capture Failed. %s\n", path); }
+
+        locker.lock();
+        m_write_index = -1;
+        locker.unlock();
+
+        m_writer_cond.notify_all();
+    }
+}
 
 //-------------------------------------------------------------------------------------------------
-//      ピクセルに色を加算します.
+//      サンプル数で正規化した放射輝度を求めます.
 //-------------------------------------------------------------------------------------------------
-void Canvas::add(int x, int y, const Vector3& value)
-{ m_pixels[y * m_w + x] += value; }
+void Canvas::resolve(Snapshot& snapshot) const
+{
+    std::unique_lock<std::shared_timed_mutex> locker(m_mutex);
+
+    auto& pixels = snapshot.pixels;
+    pixels.resize(m_pixels.size());
+
+    // 描画途中でもピクセル毎に実際のサンプル数で割るので，露出が変わらない.
+    for(size_t i=0; i<pixels.size(); ++i)
+    {
+        auto n = m_accums[i].count;
+        pixels[i] = (n > 0) ? m_pixels[i] / float(n) : Vector3(0.0f, 0.0f, 0.0f);
+    }
+
+    if (!m_aov)
+    {
+        for(auto i=0; i<AOV_Count; ++i)
+        { snapshot.aovs[i].clear(); }
+        return;
+    }
+
+    for(auto i=0; i<AOV_Count; ++i)
+    { snapshot.aovs[i].resize(m_pixels.size()); }
+
+    for(size_t i=0; i<pixels.size(); ++i)
+    {
+        auto n   = float(m_accums[i].count);
+        auto inv = (n > 0.0f) ? 1.0f / n : 0.0f;
+        auto nrm = m_normal[i];
+        auto len = length(nrm);
+
+        snapshot.aovs[AOV_Albedo ][i] = m_albedo[i] * inv;
+        snapshot.aovs[AOV_Normal ][i] = (len > 0.0f) ? nrm / len : nrm;
+        snapshot.aovs[AOV_Depth  ][i] = Vector3(m_depth[i] * inv, m_depth[i] * inv, m_depth[i] * inv);
+        snapshot.aovs[AOV_Samples][i] = Vector3(n, n, n);
+        snapshot.aovs[AOV_Time   ][i] = Vector3(m_time[i], m_time[i], m_time[i]) * 1000.0f;  // [ms]
+    }
+}
 
 //-------------------------------------------------------------------------------------------------
-//      ファイルに書き出します.
+//      トーンマップ・量子化を行いファイルに書き出します.
 //-------------------------------------------------------------------------------------------------
-bool Canvas::write(const char* filename)
+bool Canvas::process(const char* filename, Snapshot& snapshot) const
 {
-    tonemap_aces();
-    srgb_correction();
+    auto& pixels = snapshot.pixels;
+    auto  aov    = !snapshot.aovs[AOV_Albedo].empty();
+
+    // トーンマップ前の放射輝度に対してノイズ除去を行う.
+    switch(m_filter)
+    {
+    case FilterMedian:
+        median_filter(pixels);
+        break;
+
+    case FilterATrous:
+        // AOVが無い場合は色だけで重みを決める.
+        atrous_filter(pixels,
+            aov ? snapshot.aovs[AOV_Albedo].data() : nullptr,
+            aov ? snapshot.aovs[AOV_Normal].data() : nullptr);
+        break;
+
+    default:
+        break;
+    }
+
+    auto format = get_format(filename);
+    auto hdr    = (format == FormatHDR || format == FormatPFM);
+
+    if (hdr)
+    {
+        // 浮動小数形式はトーンマップせずに放射輝度をそのまま書き出す.
+        if (!write_hdr(filename, pixels))
+        { return false; }
+    }
+    else
+    {
+        tonemap_aces(pixels);
+        srgb_correction(pixels);
+
+        if (!write_ldr(filename, pixels, snapshot.output))
+        { return false; }
+    }
+
+    if (!aov)
+    { return true; }
 
-    for (size_t i = 0; i < m_temps.size(); ++i)
+    // AOVは画像と並べて出力する.
+    static const char* kSuffix[AOV_Count] = {
+        "albedo", "normal", "depth", "samples", "time"
+    };
+
+    for(auto i=0; i<AOV_Count; ++i)
     {
-        m_output[i * 3 + 0] = static_cast<uint8_t>(saturate(m_temps[i].x) * 255.0f + 0.5f);
-        m_output[i * 3 + 1] = static_cast<uint8_t>(saturate(m_temps[i].y) * 255.0f + 0.5f);
-        m_output[i * 3 + 2] = static_cast<uint8_t>(saturate(m_temps[i].z) * 255.0f + 0.5f);
+        auto& values = snapshot.aovs[i];
+
+        char path[256] = {};
+        auto ext = strrchr(filename, '.');
+        auto len = (ext != nullptr) ? int(ext - filename) : int(strlen(filename));
+        sprintf_s(path, "%.*s_%s%s", len, filename, kSuffix[i], (ext != nullptr) ? ext : "");
+
+        // 浮動小数形式は値をそのまま出力する.
+        if (hdr)
+        {
+            if (!write_hdr(path, values))
+            { return false; }
+            continue;
+        }
+
+        // 8bit形式は可視化する.
+        if (i == AOV_Normal)
+        {
+            for(auto& v : values)
+            { v = v * 0.5f + Vector3(0.5f, 0.5f, 0.5f); }
+        }
+        else if (i != AOV_Albedo)
+        {
+            // スカラー値は最大値で正規化する.
+            auto maxi = 0.0f;
+            for(auto& v : values)
+            { maxi = max(maxi, v.x); }
+
+            auto scale = (maxi > 0.0f) ? 1.0f / maxi : 0.0f;
+            for(auto& v : values)
+            { v *= scale; }
+        }
+
+        if (!write_ldr(path, values, snapshot.output))
+        { return false; }
     }
 
-    return stbi_write_bmp(filename, m_w, m_h, 3, m_output.data()) == 1;
+    return true;
 }
 
 //-------------------------------------------------------------------------------------------------
-//      レイトレ合宿用にファイルに書き出します.
+//      8bitに量子化してファイルに書き出します.
 //-------------------------------------------------------------------------------------------------
-bool Canvas::write(int counter)
+bool Canvas::write_ldr(const char* filename, const std::vector<Vector3>& pixels, std::vector<uint8_t>& output) const
 {
-    char path[256] = {};
-    sprintf_s(path, "img/%03d.bmp", counter);
-    if (write(path))
+    auto src    = &pixels[0].x;
+    auto stride = m_w * 3;
+
+    if (get_format(filename) == FormatPNG)
     {
-        printf_s("captured. %s\n", path);
-        return true;
+        // PNGは圧縮に全体が必要なので，量子化結果をまとめて渡す.
+        quantize(pixels, output);
+
+        return stbi_write_png(filename, m_w, m_h, 3, output.data(), stride) != 0;
     }
 
-    return false;
+    // BMPは1行ずつ量子化しながら書き出すので，画像全体の8bitバッファは持たない.
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, filename, "wb");
+    if (err != 0 || fp == nullptr)
+    { return false; }
+
+    auto pitch = (stride + 3) & ~3;
+    auto size  = uint32_t(pitch * m_h);
+
+    // BITMAPFILEHEADER
+    fputc('B', fp);
+    fputc('M', fp);
+    write_le(fp, 14 + 40 + size, 4);
+    write_le(fp, 0, 4);
+    write_le(fp, 14 + 40, 4);
+
+    // BITMAPINFOHEADER
+    write_le(fp, 40, 4);
+    write_le(fp, uint32_t(m_w), 4);
+    write_le(fp, uint32_t(m_h), 4);
+    write_le(fp, 1, 2);
+    write_le(fp, 24, 2);
+    write_le(fp, 0, 4);
+    write_le(fp, size, 4);
+    write_le(fp, 0, 4);
+    write_le(fp, 0, 4);
+    write_le(fp, 0, 4);
+    write_le(fp, 0, 4);
+
+    // 下の行から BGR で書き出す.
+    std::vector<uint8_t> row(pitch, 0);
+    for(auto y = m_h - 1; y >= 0; --y)
+    {
+        quantize_row(src + y * stride, row.data(), stride, m_exact);
+
+        for(auto x = 0; x < m_w; ++x)
+        { std::swap(row[x * 3 + 0], row[x * 3 + 2]); }
+
+        fwrite(row.data(), 1, pitch, fp);
+    }
+
+    auto ret = (ferror(fp) == 0);
+    fclose(fp);
+    return ret;
 }
 
 //-------------------------------------------------------------------------------------------------
-//      トーンマップを適用しない.
+//      浮動小数形式でファイルに書き出します.
+//-------------------------------------------------------------------------------------------------
+bool Canvas::write_hdr(const char* filename, const std::vector<Vector3>& pixels) const
+{
+    auto src = &pixels[0].x;
+
+    if (get_format(filename) == FormatHDR)
+    { return stbi_write_hdr(filename, m_w, m_h, 3, src) != 0; }
+
+    // PFMは下の行から float のまま書き出す(変換不要なので直接書き出せる).
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, filename, "wb");
+    if (err != 0 || fp == nullptr)
+    { return false; }
+
+    // 負のスケールはリトルエンディアンを表す.
+    fprintf_s(fp, "PF\n%d %d\n-1.0\n", m_w, m_h);
+
+    for(auto y = m_h - 1; y >= 0; --y)
+    { fwrite(src + y * m_w * 3, sizeof(float), m_w * 3, fp); }
+
+    auto ret = (ferror(fp) == 0);
+    fclose(fp);
+    return ret;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      8bitに量子化します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::tonemap_none()
+void Canvas::quantize(const std::vector<Vector3>& pixels, std::vector<uint8_t>& output) const
 {
-    for (size_t i = 0; i < m_pixels.size(); ++i)
+    auto src    = &pixels[0].x;
+    auto stride = m_w * 3;
+
+    output.resize(pixels.size() * 3);
+    auto dst = output.data();
+
+    parallel_rows(m_h, [&](int begin, int end)
     {
-        m_temps[i] = m_pixels[i];
-    }
+        for(auto y = begin; y < end; ++y)
+        { quantize_row(src + y * stride, dst + y * stride, stride, m_exact); }
+    });
 }
 
+//-------------------------------------------------------------------------------------------------
+//      対数平均と最大輝度値を求めます.
+//-------------------------------------------------------------------------------------------------
+void Canvas::log_average(const std::vector<Vector3>& pixels, float& aveLw, float& maxLw) const
+{ CalcLogAve( m_w, m_h, pixels.data(), 0.00001f, m_exact, aveLw, maxLw ); }
+
+//-------------------------------------------------------------------------------------------------
+//      トーンマップを適用しない.
+//-------------------------------------------------------------------------------------------------
+void Canvas::tonemap_none(std::vector<Vector3>& pixels) const
+{ /* DO_NOTHING */ }
+
 //-------------------------------------------------------------------------------------------------
 //      Reinhardトーンマッピングを適用します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::tonemap_reinhard()
+void Canvas::tonemap_reinhard(std::vector<Vector3>& pixels) const
 {
     auto a     = 0.18f;
     auto aveLw = 0.0f;
     auto maxLw = 0.0f;
 
     // 対数平均と最大輝度値を求める.
-    CalcLogAve( m_w, m_h, m_pixels.data(), 0.00001f, aveLw, maxLw );
+    log_average( pixels, aveLw, maxLw );
 
     auto coeff = a / aveLw;
     auto maxLw2 = maxLw * coeff;
     maxLw2 *= maxLw2;
 
-    for(size_t i=0; i<m_temps.size(); ++i)
-    {
-        auto l = m_pixels[i] * coeff;
-        m_temps[i].x = l.x * (1.0f + (l.x / maxLw2)) / (1.0f + l.x);
-        m_temps[i].y = l.y * (1.0f + (l.y / maxLw2)) / (1.0f + l.y);
-        m_temps[i].z = l.z * (1.0f + (l.z / maxLw2)) / (1.0f + l.z);
-    }
+    // チャンネル毎に同じ式なので，まとめて処理する.
+    transform(m_w, m_h, pixels, m_exact,
+        [=](float value)
+        {
+            auto l = value * coeff;
+            return l * (1.0f + (l / maxLw2)) / (1.0f + l);
+        }
+    #if defined(ENABLE_SSE2)
+        , [=](__m128 value)
+        {
+            auto l = _mm_mul_ps(value, _mm_set1_ps(coeff));
+            auto n = _mm_mul_ps(l, _mm_add_ps(_mm_set1_ps(1.0f), _mm_div_ps(l, _mm_set1_ps(maxLw2))));
+            return _mm_div_ps(n, _mm_add_ps(_mm_set1_ps(1.0f), l));
+        }
+    #else
+        , nullptr
+    #endif
+    );
 }
 
 //------------------------------------------------------------------------------------------------
 //      ACES Flimicトーンマッピングを適用します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::tonemap_aces()
+void Canvas::tonemap_aces(std::vector<Vector3>& pixels) const
 {
     auto a_    = 0.18f;
     auto aveLw = 0.0f;
     auto maxLw = 0.0f;
 
     // 対数平均と最大輝度値を求める.
-    CalcLogAve( m_w, m_h, m_pixels.data(), 0.00001f, aveLw, maxLw );
+    log_average( pixels, aveLw, maxLw );
 
-    auto coeff = a_ / aveLw;
-    auto maxLw2 = maxLw * coeff;
-    maxLw2 *= maxLw2;
+    auto coeff = a_ / aveLw * 0.6f;
 
     auto a = 2.51f;
     auto b = 0.03f;
@@ -223,111 +1406,212 @@ void Canvas::tonemap_aces()
     auto d = 0.59f;
     auto e = 0.14f;
 
-    for(size_t i=0; i<m_temps.size(); ++i)
-    {
-        auto p = m_pixels[i] * coeff * 0.6f;
-
-        m_temps[i].x = saturate((p.x * (a * p.x + b)) / (p.x * (c * p.x + d) + e));
-        m_temps[i].y = saturate((p.y * (a * p.y + b)) / (p.y * (c * p.y + d) + e));
-        m_temps[i].z = saturate((p.z * (a * p.z + b)) / (p.z * (c * p.z + d) + e));
-    }
+    transform(m_w, m_h, pixels, m_exact,
+        [=](float value)
+        {
+            auto p = value * coeff;
+            return saturate((p * (a * p + b)) / (p * (c * p + d) + e));
+        }
+    #if defined(ENABLE_SSE2)
+        , [=](__m128 value)
+        {
+            auto p   = _mm_mul_ps(value, _mm_set1_ps(coeff));
+            auto num = _mm_mul_ps(p, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), p), _mm_set1_ps(b)));
+            auto den = _mm_add_ps(_mm_mul_ps(p, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c), p), _mm_set1_ps(d))), _mm_set1_ps(e));
+            auto ret = _mm_div_ps(num, den);
+            return _mm_min_ps(_mm_max_ps(ret, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        }
+    #else
+        , nullptr
+    #endif
+    );
 }
 
 //-------------------------------------------------------------------------------------------------
 //      ガンマ補正を適用します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::gamma_correction()
+void Canvas::gamma_correction(std::vector<Vector3>& pixels) const
 {
-    for(size_t i=0; i<m_temps.size(); ++i)
-    {
-        auto value = m_temps[i];
-        m_temps[i].x = pow(value.x, 1.0f / 2.2f);
-        m_temps[i].y = pow(value.y, 1.0f / 2.2f);
-        m_temps[i].z = pow(value.z, 1.0f / 2.2f);
-    }
+    auto exact = m_exact;
+    transform(m_w, m_h, pixels, exact,
+        [=](float value)
+        { return exact ? exact_pow(value, 1.0f / 2.2f) : fast_pow(value, 1.0f / 2.2f); }
+    #if defined(ENABLE_SSE2)
+        , [](__m128 value)
+        { return fast_pow(value, _mm_set1_ps(1.0f / 2.2f)); }
+    #else
+        , nullptr
+    #endif
+    );
 }
 
 //-------------------------------------------------------------------------------------------------
 //      sRGB変換を適用します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::srgb_correction()
+void Canvas::srgb_correction(std::vector<Vector3>& pixels) const
 {
-    for(size_t i=0; i<m_temps.size(); ++i)
-    {
-        auto value = m_temps[i];
-
-        if (value.x < 0.0031308f)
-        { m_temps[i].x = 12.92f * value.x; }
-        else
-        { m_temps[i].x = (1.0f + 0.055f) * pow(value.x, 1.0f / 2.4f) - 0.055f; }
-
-        if (value.y < 0.0031308f)
-        { m_temps[i].y = 12.92f * value.y; }
-        else
-        { m_temps[i].y = (1.0f + 0.055f) * pow(value.y, 1.0f / 2.4f) - 0.055f; }
+    auto exact = m_exact;
+    transform(m_w, m_h, pixels, exact,
+        [=](float value)
+        {
+            if (value < 0.0031308f)
+            { return 12.92f * value; }
 
-        if (value.z < 0.0031308f)
-        { m_temps[i].z = 12.92f * value.z; }
-        else
-        { m_temps[i].z = (1.0f + 0.055f) * pow(value.z, 1.0f / 2.4f) - 0.055f; }
-    }
+            auto p = exact ? exact_pow(value, 1.0f / 2.4f) : fast_pow(value, 1.0f / 2.4f);
+            return (1.0f + 0.055f) * p - 0.055f;
+        }
+    #if defined(ENABLE_SSE2)
+        , [](__m128 value)
+        {
+            // 両方計算してマスクで選択する.
+            auto lo   = _mm_mul_ps(value, _mm_set1_ps(12.92f));
+            auto hi   = _mm_sub_ps(
+                            _mm_mul_ps(_mm_set1_ps(1.0f + 0.055f), fast_pow(value, _mm_set1_ps(1.0f / 2.4f))),
+                            _mm_set1_ps(0.055f));
+            auto mask = _mm_cmplt_ps(value, _mm_set1_ps(0.0031308f));
+            return _mm_or_ps(_mm_and_ps(mask, lo), _mm_andnot_ps(mask, hi));
+        }
+    #else
+        , nullptr
+    #endif
+    );
 }
 
 //-------------------------------------------------------------------------------------------------
 //      中央値フィルタを適用します.
 //-------------------------------------------------------------------------------------------------
-void Canvas::median_filter()
+void Canvas::median_filter(std::vector<Vector3>& pixels) const
 {
-    struct item
+    // チャンネル毎に 3x3 の中央値をとる. 画面端は端のピクセルを繰り返す.
+    std::vector<Vector3> source(pixels);
+
+    auto src    = &source[0].x;
+    auto dst    = &pixels[0].x;
+    auto stride = m_w * 3;
+
+    parallel_rows(m_h, [&](int begin, int end)
     {
-        double luminance;
-        int    array_index;
+        for(auto y = begin; y < end; ++y)
+        {
+            auto r0  = src + std::max(y - 1, 0)       * stride;
+            auto r1  = src + y                        * stride;
+            auto r2  = src + std::min(y + 1, m_h - 1) * stride;
+            auto out = dst + y * stride;
+
+            auto scalar = [&](int i, int l, int r)
+            {
+                float p[9] = {
+                    r0[i + l], r0[i], r0[i + r],
+                    r1[i + l], r1[i], r1[i + r],
+                    r2[i + l], r2[i], r2[i + r],
+                };
+                out[i] = median9(p);
+            };
 
-        item()
-        { /* DO_NOTHING */ }
+            // 左端と右端.
+            for(auto k = 0; k < 3; ++k)
+            {
+                scalar(k, 0, (m_w > 1) ? 3 : 0);
+                if (m_w > 1)
+                { scalar(stride - 3 + k, -3, 0); }
+            }
 
-        item(double lum, int index)
-            : luminance(lum)
-            , array_index(index)
-        { /* DO_NOTHING */ }
+            // 内側は左右のピクセルが必ずあるので分岐無しで処理できる.
+            auto i    = 3;
+            auto last = stride - 3;
 
-        bool operator < (const item& value)
-        { return luminance < value.luminance; }
-    };
+        #if defined(ENABLE_SSE2)
+            for(; i + 4 <= last; i += 4)
+            {
+                __m128 p[9] = {
+                    _mm_loadu_ps(r0 + i - 3), _mm_loadu_ps(r0 + i), _mm_loadu_ps(r0 + i + 3),
+                    _mm_loadu_ps(r1 + i - 3), _mm_loadu_ps(r1 + i), _mm_loadu_ps(r1 + i + 3),
+                    _mm_loadu_ps(r2 + i - 3), _mm_loadu_ps(r2 + i), _mm_loadu_ps(r2 + i + 3),
+                };
+                _mm_storeu_ps(out + i, median9(p));
+            }
+        #endif
+
+            for(; i < last; ++i)
+            { scalar(i, -3, 3); }
+        }
+    });
+}
+
+//-------------------------------------------------------------------------------------------------
+//      エッジ保存 à-trous ウェーブレットフィルタを適用します.
+//      cf. H. Dammertz, et al., "Edge-Avoiding À-Trous Wavelet Transform for fast Global
+//          Illumination Filtering", HPG 2010.
+//-------------------------------------------------------------------------------------------------
+void Canvas::atrous_filter(std::vector<Vector3>& pixels, const Vector3* albedo, const Vector3* normal) const
+{
+    // B3スプラインの 5x5 カーネル.
+    static const float kKernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    std::vector<Vector3> temp(pixels.size());
+    auto src = &pixels;
+    auto dst = &temp;
 
-    for (auto y = 0; y < m_h; ++y)
+    for(auto iter = 0; iter < kATrousIterations; ++iter)
     {
-        for (auto x = 0; x < m_w; ++x)
+        // 反復毎にタップ間隔を2倍にし，色の重みを狭めていく.
+        auto step     = 1 << iter;
+        auto sigma_c  = kSigmaColor / float(step);
+        auto inv_c2   = 1.0f / (sigma_c * sigma_c);
+        auto inv_a2   = 1.0f / (kSigmaAlbedo * kSigmaAlbedo);
+
+        const auto& in  = *src;
+        auto&       out = *dst;
+
+        parallel_rows(m_h, [&](int begin, int end)
         {
-            Vector3 px[9] = {};
-            px[4] = m_temps[y * m_w + x]; // 中央
-            px[0] = (x == 0 || y == 0)                  ? px[4] : m_temps[(y - 1) * m_w + (x - 1)];     // 左上
-            px[1] = (y == 0)                            ? px[4] : m_temps[(y - 1) * m_w + (x + 0)];     // 上
-            px[2] = (x == (m_w - 1) || y == 0)          ? px[4] : m_temps[(y - 1) * m_w + (x + 1)];     // 右上
-            px[3] = (x == 0)                            ? px[4] : m_temps[(y + 0) * m_w + (x - 1)];     // 左
-            px[5] = (x == (m_w - 1))                    ? px[4] : m_temps[(y + 0) * m_w + (x + 1)];     // 右
-            px[6] = (x == 0 || y == (m_h - 1))          ? px[4] : m_temps[(y + 1) * m_w + (x - 1)];     // 左下
-            px[7] = (y == (m_h - 1))                    ? px[4] : m_temps[(y + 1) * m_w + (x + 0)];     // 下
-            px[8] = (x == (m_w - 1) || y == (m_h - 1))  ? px[4] : m_temps[(y + 1) * m_w + (x + 1)];     // 右下
-
-            // 輝度値を求める.
-            item lum[9];
-            lum[0] = item(RGBToY(px[0]), 0);
-            lum[1] = item(RGBToY(px[1]), 1);
-            lum[2] = item(RGBToY(px[2]), 2);
-            lum[3] = item(RGBToY(px[3]), 3);
-            lum[4] = item(RGBToY(px[4]), 4);
-            lum[5] = item(RGBToY(px[5]), 5);
-            lum[6] = item(RGBToY(px[6]), 6);
-            lum[7] = item(RGBToY(px[7]), 7);
-            lum[8] = item(RGBToY(px[8]), 8);
-
-            // 並び替え.
-            std::sort(std::begin(lum), std::end(lum));
-
-            // 中央の値を採用.
-            m_temps[y * m_w + x] = px[lum[4].array_index];
-        }
+            for(auto y = begin; y < end; ++y)
+            for(auto x = 0;     x < m_w; ++x)
+            {
+                auto idx = y * m_w + x;
+                auto cp  = compress(in[idx]);
+
+                Vector3 sum(0.0f, 0.0f, 0.0f);
+                auto weight_sum = 0.0f;
+
+                for(auto dy = -2; dy <= 2; ++dy)
+                for(auto dx = -2; dx <= 2; ++dx)
+                {
+                    auto qx  = std::max(0, std::min(x + dx * step, m_w - 1));
+                    auto qy  = std::max(0, std::min(y + dy * step, m_h - 1));
+                    auto qdx = qy * m_w + qx;
+
+                    auto dc = compress(in[qdx]) - cp;
+                    auto e  = dot(dc, dc) * inv_c2;
+
+                    if (albedo != nullptr)
+                    {
+                        auto da = albedo[qdx] - albedo[idx];
+                        e += dot(da, da) * inv_a2;
+                    }
+
+                    auto g = m_exact ? expf(-e) : fast_exp2(-e * 1.442695f);
+                    auto w = kKernel[abs(dx)] * kKernel[abs(dy)] * g;
+
+                    if (normal != nullptr)
+                    {
+                        // pow(max(dot(n_p, n_q), 0), 32).
+                        auto d = max(dot(normal[qdx], normal[idx]), 0.0f);
+                        d *= d; d *= d; d *= d; d *= d; d *= d;
+                        w *= d;
+                    }
+
+                    sum        += in[qdx] * w;
+                    weight_sum += w;
+                }
+
+                out[idx] = (weight_sum > 0.0f) ? sum / weight_sum : in[idx];
+            }
+        });
+
+        std::swap(src, dst);
     }
-}
 
+    if (src != &pixels)
+    { pixels.swap(temp); }
+}
@@ -22,12 +22,11 @@ bool cas(void* volatile* ptr, void* compare, void* swap)
 #else
 /* Linux系　*/
 
+// ポインタ幅のまま比較交換する(32bit環境でも正しく動くように).
 bool cas(void* volatile* ptr, void* compare, void* swap)
 {
-    return __sync_bool_compare_and_swap(
-        reinterpret_cast<volatile uint64_t*>(ptr),
-        reinterpret_cast<uint64_t>(compare),
-        reinterpret_cast<uint64_t>(swap));
+    return __atomic_compare_exchange_n(
+        ptr, &compare, swap, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
 #endif
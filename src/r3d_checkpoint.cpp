@@ -0,0 +1,236 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_checkpoint.cpp
+// Desc : Checkpoint Module.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_checkpoint.h>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif//NOMINMAX
+#include <Windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif//defined(_WIN32)
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+//      書き込んだ内容をディスクまで反映させます.
+//-------------------------------------------------------------------------------------------------
+bool sync_file(FILE* fp)
+{
+    if (fflush(fp) != 0)
+    { return false; }
+
+#if defined(_WIN32)
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ファイルを置き換えます.
+//-------------------------------------------------------------------------------------------------
+bool replace_file(const char* src, const char* dst)
+{
+#if defined(_WIN32)
+    return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+#else
+    if (rename(src, dst) != 0)
+    { return false; }
+
+    // rename 自体はディレクトリエントリの更新なので，親ディレクトリも同期しないと
+    // 電源断の後に古いファイルに戻ったり，ファイルが消えたりする.
+    char dir[256] = {};
+    auto sep = strrchr(dst, '/');
+    if (sep == nullptr)
+    { strcpy_s(dir, sizeof(dir), "."); }
+    else if (sep == dst)
+    { strcpy_s(dir, sizeof(dir), "/"); }
+    else
+    { sprintf_s(dir, "%.*s", int(sep - dst), dst); }
+
+    auto fd = open(dir, O_RDONLY);
+    if (fd < 0)
+    { return false; }
+
+    auto ret = (fsync(fd) == 0);
+    close(fd);
+    return ret;
+#endif
+}
+
+} // namespace
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Checkpoint class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      コンストラクタです.
+//-------------------------------------------------------------------------------------------------
+Checkpoint::Checkpoint()
+{
+    memset(&header, 0, sizeof(header));
+    header.magic   = kMagic;
+    header.version = kVersion;
+    header.shard_count = 1;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      描画設定が一致するかどうか?
+//-------------------------------------------------------------------------------------------------
+bool Checkpoint::is_compatible(const Header& value) const
+{
+    return header.width   == value.width
+        && header.height  == value.height
+        && header.samples == value.samples
+        && header.sampler == value.sampler
+        && header.flags   == value.flags
+        && header.shard   == value.shard
+        && header.shard_count == value.shard_count;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ファイルに書き出します.
+//-------------------------------------------------------------------------------------------------
+bool Checkpoint::save(const char* path, const Canvas& canvas) const
+{
+    char temp[256] = {};
+    sprintf_s(temp, "%s.tmp", path);
+
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, temp, "wb");
+    if (err != 0 || fp == nullptr)
+    {
+        fprintf_s(stderr, "Error : File Open Failed. path = %s\n", temp);
+        return false;
+    }
+
+    auto head = header;
+    head.tile_count   = uint32_t(tile_samples.size());
+    head.random_count = uint32_t(randoms.size());
+
+    auto ret = fwrite(&head, sizeof(head), 1, fp) == 1;
+
+    if (ret && !tile_samples.empty())
+    { ret = fwrite(tile_samples.data(), sizeof(int32_t), tile_samples.size(), fp) == tile_samples.size(); }
+
+    if (ret && !randoms.empty())
+    { ret = fwrite(randoms.data(), sizeof(Random), randoms.size(), fp) == randoms.size(); }
+
+    if (ret)
+    { ret = canvas.save(fp); }
+
+    // 置き換える前に中身をディスクに書き出しておかないと，置き換え後に中身が空になりうる.
+    ret = sync_file(fp) && ret;
+    fclose(fp);
+
+    if (!ret)
+    {
+        fprintf_s(stderr, "Error : Checkpoint Write Failed. path = %s\n", temp);
+        remove(temp);
+        return false;
+    }
+
+    // 書き終わってから置き換える.
+    if (!replace_file(temp, path))
+    {
+        fprintf_s(stderr, "Error : Checkpoint Replace Failed. path = %s\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ファイルから読み込みます.
+//-------------------------------------------------------------------------------------------------
+bool Checkpoint::load(const char* path, Canvas& canvas)
+{
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, path, "rb");
+    if (err != 0 || fp == nullptr)
+    {
+        fprintf_s(stderr, "Error : File Open Failed. path = %s\n", path);
+        return false;
+    }
+
+    Header head;
+    if (fread(&head, sizeof(head), 1, fp) != 1
+     || head.magic   != kMagic
+     || head.version != kVersion)
+    {
+        fprintf_s(stderr, "Error : Invalid Checkpoint. path = %s\n", path);
+        fclose(fp);
+        return false;
+    }
+
+    if (!is_compatible(head))
+    {
+        fprintf_s(stderr, "Error : Checkpoint Setting Mismatch. path = %s\n", path);
+        fclose(fp);
+        return false;
+    }
+
+    tile_samples.resize(head.tile_count);
+    randoms     .resize(head.random_count);
+
+    auto ret = true;
+    if (ret && !tile_samples.empty())
+    { ret = fread(tile_samples.data(), sizeof(int32_t), tile_samples.size(), fp) == tile_samples.size(); }
+
+    if (ret && !randoms.empty())
+    { ret = fread(randoms.data(), sizeof(Random), randoms.size(), fp) == randoms.size(); }
+
+    if (ret)
+    { ret = canvas.load(fp); }
+
+    fclose(fp);
+
+    if (!ret)
+    {
+        fprintf_s(stderr, "Error : Checkpoint Read Failed. path = %s\n", path);
+        return false;
+    }
+
+    header = head;
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ヘッダーだけを読み込みます.
+//-------------------------------------------------------------------------------------------------
+bool Checkpoint::read_header(const char* path, Header& header)
+{
+    FILE* fp = nullptr;
+    auto err = fopen_s(&fp, path, "rb");
+    if (err != 0 || fp == nullptr)
+    {
+        fprintf_s(stderr, "Error : File Open Failed. path = %s\n", path);
+        return false;
+    }
+
+    auto ret = fread(&header, sizeof(header), 1, fp) == 1
+            && header.magic   == kMagic
+            && header.version == kVersion;
+    fclose(fp);
+
+    if (!ret)
+    { fprintf_s(stderr, "Error : Invalid Checkpoint. path = %s\n", path); }
+
+    return ret;
+}
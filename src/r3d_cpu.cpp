@@ -0,0 +1,183 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_cpu.cpp
+// Desc : CPU Feature Detection.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_cpu.h>
+#include <r3d_platform.h>
+#include <cstdint>
+
+#if defined(R3D_ARCH_X86)
+    #if defined(_MSC_VER)
+    #include <intrin.h>
+    #else
+    #include <cpuid.h>
+    #endif
+#endif//defined(R3D_ARCH_X86)
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+CpuInfo::Isa    g_limit = CpuInfo::IsaAVX512;   // 使用する命令セットの上限.
+
+#if defined(R3D_ARCH_X86) && !defined(DISABLE_SIMD)
+//-------------------------------------------------------------------------------------------------
+//      CPUID命令を実行します.
+//-------------------------------------------------------------------------------------------------
+void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+    int temp[4];
+    __cpuidex(temp, int(leaf), int(subleaf));
+    for(auto i=0; i<4; ++i)
+    { regs[i] = uint32_t(temp[i]); }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+//      OSが保存するレジスタの状態(XCR0)を取得します.
+//-------------------------------------------------------------------------------------------------
+uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    // _xgetbv() は -mxsave が必要なので直接命令を書く.
+    uint32_t eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (uint64_t(edx) << 32) | eax;
+#endif
+}
+#endif//defined(R3D_ARCH_X86) && !defined(DISABLE_SIMD)
+
+//-------------------------------------------------------------------------------------------------
+//      命令セットを判定します.
+//-------------------------------------------------------------------------------------------------
+CpuInfo::Isa detect_isa()
+{
+#if defined(R3D_ARCH_X86) && !defined(DISABLE_SIMD)
+    uint32_t regs[4] = {};
+    cpuid(0, 0, regs);
+    auto max_leaf = regs[0];
+    if (max_leaf < 1)
+    { return CpuInfo::IsaScalar; }
+
+    cpuid(1, 0, regs);
+    auto sse2    = (regs[3] & (1u << 26)) != 0;
+    auto fma     = (regs[2] & (1u << 12)) != 0;
+    auto osxsave = (regs[2] & (1u << 27)) != 0;
+    auto avx     = (regs[2] & (1u << 28)) != 0;
+
+    if (!sse2)
+    { return CpuInfo::IsaScalar; }
+
+    // YMM/ZMMレジスタをOSが退避してくれない場合は使えない.
+    auto xcr0 = osxsave ? xgetbv0() : 0;
+    if (!avx || (xcr0 & 0x6) != 0x6)
+    { return CpuInfo::IsaSSE2; }
+
+    auto avx2    = false;
+    auto avx512f = false;
+    if (max_leaf >= 7)
+    {
+        cpuid(7, 0, regs);
+        avx2    = (regs[1] & (1u << 5))  != 0;
+        avx512f = (regs[1] & (1u << 16)) != 0;
+    }
+
+    if (!avx2 || !fma)
+    { return CpuInfo::IsaAVX; }
+
+    // opmask, ZMM0-15の上位, ZMM16-31 の3つが必要.
+    if (!avx512f || (xcr0 & 0xe6) != 0xe6)
+    { return CpuInfo::IsaAVX2; }
+
+    return CpuInfo::IsaAVX512;
+#else
+    return CpuInfo::IsaScalar;
+#endif
+}
+
+} // namespace
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// CpuInfo class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      CPUとOSが対応している命令セットを取得します.
+//-------------------------------------------------------------------------------------------------
+CpuInfo::Isa CpuInfo::detect()
+{
+    static const Isa result = detect_isa();
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      実際に使用する命令セットを取得します.
+//-------------------------------------------------------------------------------------------------
+CpuInfo::Isa CpuInfo::isa()
+{
+    auto result = detect();
+    return (result < g_limit) ? result : g_limit;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      使用できる命令セットかどうかチェックします.
+//-------------------------------------------------------------------------------------------------
+bool CpuInfo::has(Isa value)
+{ return value <= isa(); }
+
+//-------------------------------------------------------------------------------------------------
+//      使用する命令セットの上限を設定します.
+//-------------------------------------------------------------------------------------------------
+void CpuInfo::set_limit(Isa value)
+{ g_limit = value; }
+
+//-------------------------------------------------------------------------------------------------
+//      命令セット名を取得します.
+//-------------------------------------------------------------------------------------------------
+const char* CpuInfo::name(Isa value)
+{
+    switch(value)
+    {
+    case IsaScalar: return "scalar";
+    case IsaSSE2:   return "sse2";
+    case IsaAVX:    return "avx";
+    case IsaAVX2:   return "avx2";
+    case IsaAVX512: return "avx512";
+    default:        break;
+    }
+
+    return "unknown";
+}
+
+//-------------------------------------------------------------------------------------------------
+//      命令セット名を解析します.
+//-------------------------------------------------------------------------------------------------
+bool CpuInfo::parse(const char* value, Isa& result)
+{
+    if (value == nullptr)
+    { return false; }
+
+    for(auto i=0; i<Isa_Count; ++i)
+    {
+        if (_stricmp(value, name(Isa(i))) == 0)
+        {
+            result = Isa(i);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,149 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_integrator.cpp
+// Desc : Path Tracing Integrator.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_integrator.h>
+#include <r3d_material.h>
+#include <r3d_stats.h>
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Constant Values.
+//-------------------------------------------------------------------------------------------------
+constexpr int kMaxDepth = 3;    // ロシアンルーレットを始める深度.
+
+} // namespace
+
+
+//-------------------------------------------------------------------------------------------------
+//      放射輝度を求めます.
+//-------------------------------------------------------------------------------------------------
+Vector3 radiance(const Ray& input_ray, Sampler& sampler, const Scene* scene, AOV* aov)
+{
+    Vector3 L(0, 0, 0);
+    Vector3 W(1, 1, 1);
+    Ray ray = make_ray(input_ray.pos, input_ray.dir);
+
+    const auto& mats = scene->materials();
+    auto& stats = Stats::local();
+
+    for(int depth=0;; depth++)
+    {
+        HitRecord record = {};
+        stats.add_ray(depth);
+
+        if (!scene->hit(ray, record))
+        {
+            L += W * scene->sample_ibl(ray.dir);
+            break;
+        }
+
+        // マテリアルは1回だけ引いて使いまわす.
+        const auto& mat = mats[record.mat];
+
+        // 最初の衝突点の情報を記録.
+        if (depth == 0 && aov != nullptr)
+        {
+            aov->albedo = mat.albedo;
+            aov->normal = record.nrm;
+            aov->depth  = scene->depth(record.pos);
+        }
+
+        auto p = mat.threshold();
+
+        // 直接光のサンプリングはしていないので，放射は常に加算する.
+        L += W * mat.emissive;
+
+        // 打ち切り深度に達したら終わり.
+        if(depth > kMaxDepth)
+        {
+            if (sampler.get1d() >= p)
+            {
+                stats.add(Stats::CounterRussianRoulette);
+                break;
+            }
+        }
+        else
+        {
+            p = 1.0f;
+        }
+
+        ShadingArg arg = {};
+        arg.input  = ray.dir;
+        arg.normal = record.nrm;
+        arg.sampler = &sampler;
+        arg.uv     = record.uv;
+
+        // マテリアルの評価.
+        auto w = mats.shade(record.mat, arg);
+
+        //// 直接光をサンプル.
+        //if (obj != g_spheres[g_lightId] && !record.mat->is_delta())
+        //{
+        //    Vector3 light_pos;
+        //    Vector3 light_nrm;
+        //    g_spheres[g_lightId]->sample(*random, light_pos, light_nrm);
+
+        //    // ライトベクトル.
+        //    auto light_dir = light_pos - hit_pos;
+
+        //    // ライトへの距離の2乗
+        //    auto light_dist2 = dot(light_dir, light_dir);
+
+        //    // 正規化.
+        //    light_dir = normalize(light_dir);
+
+        //    ShadowRecord shadow_rec;
+        //    Ray    shadow_ray(hit_pos, light_dir);
+
+        //    // シャドウレイを発射.
+        //    auto hit = intersect_scene(shadow_ray, shadow_rec);
+
+        //    // ライトのみと衝突した場合のみ寄与を取る.
+        //    {
+        //        auto hit_light = hit && (shadow_rec.shape == g_spheres[g_lightId]);
+        //        if (hit_light)
+        //        {
+        //            // 物体からのレイの入出を考慮した法線ベクトル.
+        //            const auto orienting_normal = (dot(normal, ray.dir) < 0.0) ? normal : -normal;
+
+        //            auto dot0 = abs(dot(orienting_normal, light_dir));
+        //            auto dot1 = abs(dot(light_nrm,       -light_dir));
+
+        //            auto G = (dot0 * dot1) / light_dist2;
+
+        //            // ライトの確率密度.
+        //            auto light_pdf2 = shadow_rec.pdf * shadow_rec.pdf;
+
+        //            // BRDFの確率密度.
+        //            auto brdf_pdf  = (arg.pdf / light_dist2);
+        //            auto brdf_pdf2 = brdf_pdf * brdf_pdf;
+
+        //            // 多重重点的サンプルの重みを求める.
+        //            auto mis_weight = light_pdf2 / (light_pdf2 + brdf_pdf2);
+
+        //            L += W * shadow_rec.mat->emissive() * (w / F_PI) * G * mis_weight / shadow_rec.pdf;
+        //        }
+        //    }
+        //}
+
+        // レイを更新.
+        ray = make_ray(record.pos, arg.output);
+
+        // 重み更新.
+        W *= (w / p);
+
+        // 重みがゼロなら計算しても意味ないので打ち切り.
+        if (is_zero(W))
+        { break; }
+    }
+
+    return L;
+}
@@ -0,0 +1,599 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_sbvh.cpp
+// Desc : Spatial Split BVH Builder.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_sbvh.h>
+#include <algorithm>
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Constant Values.
+//-------------------------------------------------------------------------------------------------
+constexpr int      BinCount      = 16;      //!< 分割候補のビン数です.
+constexpr size_t   MaxLeafSize   = 8;       //!< SAHで葉にしてよい最大の参照数です.
+constexpr int      MaxDepth      = 64;      //!< 最大の深さです.
+constexpr float    TraversalCost = 1.0f;    //!< ノードを辿るコストです.
+constexpr float    IntersectCost = 1.0f;    //!< 三角形と判定するコストです.
+constexpr float    OverlapRatio  = 1e-5f;   //!< 空間分割を試す重なり面積(ルートの表面積に対する割合 α).
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Reference structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct Reference
+{
+    Box         box;        //!< クリップ済みのボックス.
+    uint32_t    index;      //!< 三角形番号.
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Bin structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct Bin
+{
+    Box         box;
+    size_t      count = 0;      //!< オブジェクト分割 : 含まれる参照数.
+    size_t      enter = 0;      //!< 空間分割 : このビンから始まる参照数.
+    size_t      exit  = 0;      //!< 空間分割 : このビンで終わる参照数.
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Split structure
+///////////////////////////////////////////////////////////////////////////////////////////////////
+struct Split
+{
+    float       cost    = F_MAX;
+    int         axis    = -1;
+    int         bin     = 0;        //!< 右側の先頭のビン番号.
+    bool        spatial = false;
+    Box         left;
+    Box         right;
+    size_t      left_count  = 0;
+    size_t      right_count = 0;
+};
+
+//-------------------------------------------------------------------------------------------------
+//      ボックスを広げます(Box() は空のボックスとして扱える).
+//-------------------------------------------------------------------------------------------------
+inline void grow(Box& box, const Vector3& value)
+{
+    box.mini = min(box.mini, value);
+    box.maxi = max(box.maxi, value);
+}
+
+inline void grow(Box& box, const Box& value)
+{
+    box.mini = min(box.mini, value.mini);
+    box.maxi = max(box.maxi, value.maxi);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      空のボックスかどうかチェックします.
+//-------------------------------------------------------------------------------------------------
+inline bool is_empty(const Box& box)
+{ return box.mini.x > box.maxi.x || box.mini.y > box.maxi.y || box.mini.z > box.maxi.z; }
+
+//-------------------------------------------------------------------------------------------------
+//      ボックスの共通部分を求めます.
+//-------------------------------------------------------------------------------------------------
+inline Box intersection(const Box& lhs, const Box& rhs)
+{
+    Box result;
+    result.mini = max(lhs.mini, rhs.mini);
+    result.maxi = min(lhs.maxi, rhs.maxi);
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      SAH用の表面積を求めます. 空のボックスは0とします.
+//-------------------------------------------------------------------------------------------------
+inline float area(const Box& box)
+{ return is_empty(box) ? 0.0f : surface_area(box); }
+
+//-------------------------------------------------------------------------------------------------
+//      2つのボックスの重なりの表面積を求めます.
+//      面や辺で接しているだけの場合(体積が0)は重なっていないとみなします.
+//-------------------------------------------------------------------------------------------------
+inline float overlap_area(const Box& lhs, const Box& rhs)
+{
+    auto box = intersection(lhs, rhs);
+    if (box.mini.x >= box.maxi.x || box.mini.y >= box.maxi.y || box.mini.z >= box.maxi.z)
+    { return 0.0f; }
+
+    return surface_area(box);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      ビン番号を求めます.
+//-------------------------------------------------------------------------------------------------
+inline int bin_index(float value, float mini, float scale)
+{
+    auto index = int((value - mini) * scale);
+    return std::min(std::max(index, 0), BinCount - 1);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      三角形を平面で分割し，左右のボックスを求めます.
+//-------------------------------------------------------------------------------------------------
+void split_reference
+(
+    const Reference&    ref,
+    const Triangle*     tri,
+    int                 axis,
+    float               pos,
+    Reference&          left,
+    Reference&          right
+)
+{
+    left .index = ref.index;
+    right.index = ref.index;
+    left .box   = Box();
+    right.box   = Box();
+
+    // 各辺を平面でクリップして，左右それぞれに含まれる点を集める.
+    for(auto i=0; i<3; ++i)
+    {
+        auto& v0 = tri->vertex(i).pos;
+        auto& v1 = tri->vertex((i + 1) % 3).pos;
+        auto  p0 = v0.a[axis];
+        auto  p1 = v1.a[axis];
+
+        if (p0 <= pos)
+        { grow(left.box, v0); }
+
+        if (p0 >= pos)
+        { grow(right.box, v0); }
+
+        if ((p0 < pos && pos < p1) || (p1 < pos && pos < p0))
+        {
+            auto t = clamp((pos - p0) / (p1 - p0), 0.0f, 1.0f);
+            auto v = v0 + (v1 - v0) * t;
+            v.a[axis] = pos;
+
+            grow(left.box,  v);
+            grow(right.box, v);
+        }
+    }
+
+    left .box.maxi.a[axis] = pos;
+    right.box.mini.a[axis] = pos;
+
+    // 既にクリップされている範囲からはみ出さないようにする.
+    left .box = intersection(left .box, ref.box);
+    right.box = intersection(right.box, ref.box);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Builder class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+class Builder
+{
+public:
+    Builder(const std::vector<Triangle*>& tris, SplitTree& tree, size_t budget)
+    : m_tris        (tris)
+    , m_tree        (tree)
+    , m_budget      (budget)
+    , m_min_overlap (0.0f)
+    { /* DO_NOTHING */ }
+
+    void build()
+    {
+        std::vector<Reference> refs(m_tris.size());
+        Box root;
+        for(size_t i=0; i<m_tris.size(); ++i)
+        {
+            auto& box = m_tris[i]->box();
+            refs[i].box.mini = box.mini;
+            refs[i].box.maxi = box.maxi;
+            refs[i].index    = uint32_t(i);
+            grow(root, refs[i].box);
+        }
+
+        m_min_overlap = area(root) * OverlapRatio;
+
+        m_tree.nodes.clear();
+        m_tree.refs .clear();
+        m_tree.nodes.reserve(m_tris.size() * 2);
+        m_tree.refs .reserve(m_tris.size() + m_budget);
+
+        build_node(refs, 0, m_budget);
+    }
+
+private:
+    const std::vector<Triangle*>&   m_tris;
+    SplitTree&                      m_tree;
+    size_t                          m_budget;       //!< 全体で重複可能な参照数.
+    float                           m_min_overlap;  //!< 空間分割を試す重なり面積.
+
+    //---------------------------------------------------------------------------------------------
+    //      ノードを再帰的に構築し，ノード番号を返します.
+    //      budget はこの部分木で重複可能な参照数です. 深さ優先で構築しても左の部分木だけで
+    //      使い切らないように，分割後の残りは子ノードの参照数の比で分配します.
+    //---------------------------------------------------------------------------------------------
+    int build_node(std::vector<Reference>& refs, int depth, size_t budget)
+    {
+        Box box;
+        Box centroid;
+        for(auto& ref : refs)
+        {
+            grow(box, ref.box);
+            grow(centroid, (ref.box.mini + ref.box.maxi) * 0.5f);
+        }
+
+        auto index = int(m_tree.nodes.size());
+        m_tree.nodes.push_back(SplitTree::Node());
+
+        if (refs.size() <= 1 || depth >= MaxDepth)
+        { return make_leaf(index, refs, box); }
+
+        Split split;
+        find_object_split(refs, box, centroid, split);
+
+        // 三角形の切り分けはオブジェクト分割よりずっと高いので，予算が残っていて，
+        // 葉にできない大きさのノードで，オブジェクト分割の左右がルートの α 倍以上重なる場合だけ試す.
+        if (budget > 0
+         && refs.size() > MaxLeafSize
+         && overlap_area(split.left, split.right) > m_min_overlap)
+        { find_spatial_split(refs, box, budget, split); }
+
+        auto leaf_cost = IntersectCost * float(refs.size());
+        if (split.axis < 0 || (split.cost >= leaf_cost && refs.size() <= MaxLeafSize))
+        { return make_leaf(index, refs, box); }
+
+        std::vector<Reference> left;
+        std::vector<Reference> right;
+        if (split.spatial)
+        { partition_spatial(refs, box, split, budget, left, right); }
+        else
+        { partition_object(refs, centroid, split, left, right); }
+
+        // 子ノードの構築中は不要なので解放する.
+        std::vector<Reference>().swap(refs);
+
+        auto budget0 = size_t(double(budget) * double(left.size()) / double(left.size() + right.size()));
+        auto budget1 = budget - budget0;
+
+        auto child0 = build_node(left,  depth + 1, budget0);
+        auto child1 = build_node(right, depth + 1, budget1);
+
+        auto& node = m_tree.nodes[index];
+        node.box      = box;
+        node.child[0] = child0;
+        node.child[1] = child1;
+        node.offset   = m_tree.nodes[child0].offset;
+        node.count    = m_tree.nodes[child0].count + m_tree.nodes[child1].count;
+
+        return index;
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      葉ノードを作ります.
+    //---------------------------------------------------------------------------------------------
+    int make_leaf(int index, const std::vector<Reference>& refs, const Box& box)
+    {
+        auto& node = m_tree.nodes[index];
+        node.box      = box;
+        node.child[0] = -1;
+        node.child[1] = -1;
+        node.offset   = uint32_t(m_tree.refs.size());
+        node.count    = uint32_t(refs.size());
+
+        for(auto& ref : refs)
+        { m_tree.refs.push_back(m_tris[ref.index]); }
+
+        return index;
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      分割面のSAHコストを求めます.
+    //---------------------------------------------------------------------------------------------
+    static float sah_cost(const Box& box, const Box& left, size_t left_count, const Box& right, size_t right_count)
+    {
+        auto inv_area = 1.0f / area(box);
+        return TraversalCost + IntersectCost * inv_area
+            * (area(left) * float(left_count) + area(right) * float(right_count));
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      重心をビンに分けてオブジェクト分割の候補を求めます.
+    //---------------------------------------------------------------------------------------------
+    void find_object_split(const std::vector<Reference>& refs, const Box& box, const Box& centroid, Split& split)
+    {
+        for(auto axis=0; axis<3; ++axis)
+        {
+            auto extent = centroid.maxi.a[axis] - centroid.mini.a[axis];
+            if (extent <= 0.0f)
+            { continue; }
+
+            auto scale = float(BinCount) / extent;
+
+            Bin bins[BinCount];
+            for(auto& ref : refs)
+            {
+                auto c = (ref.box.mini.a[axis] + ref.box.maxi.a[axis]) * 0.5f;
+                auto b = bin_index(c, centroid.mini.a[axis], scale);
+                grow(bins[b].box, ref.box);
+                bins[b].count++;
+            }
+
+            evaluate(box, axis, false, bins, refs.size(), 0,
+                [](const Bin& bin) { return bin.count; },
+                [](const Bin& bin) { return bin.count; },
+                split);
+        }
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      参照をビンで切り分けて空間分割の候補を求めます.
+    //---------------------------------------------------------------------------------------------
+    void find_spatial_split(const std::vector<Reference>& refs, const Box& box, size_t budget, Split& split)
+    {
+        for(auto axis=0; axis<3; ++axis)
+        {
+            auto mini   = box.mini.a[axis];
+            auto extent = box.maxi.a[axis] - mini;
+            if (extent <= 0.0f)
+            { continue; }
+
+            auto scale = float(BinCount) / extent;
+
+            // 三角形を切る前に，各境界に跨る参照数(= 重複する参照数)を数えて，
+            // どの境界でも予算を超える場合は切り分けを省く.
+            Bin bins[BinCount];
+            for(auto& ref : refs)
+            {
+                bins[bin_index(ref.box.mini.a[axis], mini, scale)].enter++;
+                bins[bin_index(ref.box.maxi.a[axis], mini, scale)].exit++;
+            }
+
+            auto affordable = false;
+            size_t straddle = 0;
+            for(auto i=1; i<BinCount && !affordable; ++i)
+            {
+                straddle += bins[i - 1].enter - bins[i - 1].exit;
+                affordable = (straddle <= budget);
+            }
+
+            if (!affordable)
+            { continue; }
+
+            for(auto& ref : refs)
+            {
+                auto first = bin_index(ref.box.mini.a[axis], mini, scale);
+                auto last  = bin_index(ref.box.maxi.a[axis], mini, scale);
+
+                // ビンの境界で三角形を切りながら，各ビンのボックスを広げる.
+                auto current = ref;
+                for(auto b=first; b<last; ++b)
+                {
+                    Reference left, right;
+                    split_reference(current, m_tris[ref.index], axis, plane(mini, extent, b + 1), left, right);
+                    grow(bins[b].box, left.box);
+                    current = right;
+                }
+                grow(bins[last].box, current.box);
+            }
+
+            evaluate(box, axis, true, bins, refs.size(), budget,
+                [](const Bin& bin) { return bin.enter; },
+                [](const Bin& bin) { return bin.exit; },
+                split);
+        }
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      ビンの境界の位置を求めます.
+    //---------------------------------------------------------------------------------------------
+    static float plane(float mini, float extent, int bin)
+    { return mini + extent * (float(bin) / float(BinCount)); }
+
+    //---------------------------------------------------------------------------------------------
+    //      ビンの境界ごとにSAHコストを求め，最小のものを記録します.
+    //      重複する参照数が budget を超える境界は選びません.
+    //---------------------------------------------------------------------------------------------
+    template<typename LeftCount, typename RightCount>
+    void evaluate
+    (
+        const Box&  box,
+        int         axis,
+        bool        spatial,
+        const Bin*  bins,
+        size_t      total,
+        size_t      budget,
+        LeftCount   left_count,
+        RightCount  right_count,
+        Split&      split
+    )
+    {
+        Box    right_box  [BinCount];
+        size_t right_total[BinCount];
+
+        Box    accum;
+        size_t count = 0;
+        for(auto i=BinCount - 1; i>0; --i)
+        {
+            grow(accum, bins[i].box);
+            count += right_count(bins[i]);
+            right_box  [i] = accum;
+            right_total[i] = count;
+        }
+
+        Box left;
+        count = 0;
+        for(auto i=1; i<BinCount; ++i)
+        {
+            grow(left, bins[i - 1].box);
+            count += left_count(bins[i - 1]);
+
+            if (count == 0 || right_total[i] == 0 || count + right_total[i] > total + budget)
+            { continue; }
+
+            auto cost = sah_cost(box, left, count, right_box[i], right_total[i]);
+            if (cost < split.cost)
+            {
+                split.cost        = cost;
+                split.axis        = axis;
+                split.bin         = i;
+                split.spatial     = spatial;
+                split.left        = left;
+                split.right       = right_box[i];
+                split.left_count  = count;
+                split.right_count = right_total[i];
+            }
+        }
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      オブジェクト分割で参照を振り分けます.
+    //---------------------------------------------------------------------------------------------
+    void partition_object
+    (
+        const std::vector<Reference>&   refs,
+        const Box&                      centroid,
+        const Split&                    split,
+        std::vector<Reference>&         left,
+        std::vector<Reference>&         right
+    )
+    {
+        auto axis  = split.axis;
+        auto scale = float(BinCount) / (centroid.maxi.a[axis] - centroid.mini.a[axis]);
+
+        left .reserve(split.left_count);
+        right.reserve(split.right_count);
+
+        for(auto& ref : refs)
+        {
+            auto c = (ref.box.mini.a[axis] + ref.box.maxi.a[axis]) * 0.5f;
+            if (bin_index(c, centroid.mini.a[axis], scale) < split.bin)
+            { left.push_back(ref); }
+            else
+            { right.push_back(ref); }
+        }
+    }
+
+    //---------------------------------------------------------------------------------------------
+    //      空間分割で参照を振り分けます. 跨る参照は分割するか片側に寄せます.
+    //---------------------------------------------------------------------------------------------
+    void partition_spatial
+    (
+        const std::vector<Reference>&   refs,
+        const Box&                      box,
+        const Split&                    split,
+        size_t&                         budget,
+        std::vector<Reference>&         left,
+        std::vector<Reference>&         right
+    )
+    {
+        auto axis   = split.axis;
+        auto mini   = box.mini.a[axis];
+        auto extent = box.maxi.a[axis] - mini;
+        auto scale  = float(BinCount) / extent;
+        auto pos    = plane(mini, extent, split.bin);
+
+        std::vector<const Reference*> straddle;
+
+        Box    left_box;
+        Box    right_box;
+        size_t left_count  = 0;
+        size_t right_count = 0;
+
+        for(auto& ref : refs)
+        {
+            auto first = bin_index(ref.box.mini.a[axis], mini, scale);
+            auto last  = bin_index(ref.box.maxi.a[axis], mini, scale);
+
+            if (last < split.bin)
+            {
+                left.push_back(ref);
+                grow(left_box, ref.box);
+            }
+            else if (first >= split.bin)
+            {
+                right.push_back(ref);
+                grow(right_box, ref.box);
+            }
+            else
+            { straddle.push_back(&ref); }
+        }
+
+        left_count  = left .size() + straddle.size();
+        right_count = right.size() + straddle.size();
+
+        for(auto ref : straddle)
+        {
+            Reference l, r;
+            split_reference(*ref, m_tris[ref->index], axis, pos, l, r);
+
+            auto split_left  = left_box;   grow(split_left,  l.box);
+            auto split_right = right_box;  grow(split_right, r.box);
+            auto whole_left  = left_box;   grow(whole_left,  ref->box);
+            auto whole_right = right_box;  grow(whole_right, ref->box);
+
+            // 分割せずに片側へ寄せた方が安い場合は寄せる(参照の重複を減らす).
+            auto cost_split = area(split_left) * float(left_count)     + area(split_right) * float(right_count);
+            auto cost_left  = area(whole_left) * float(left_count)     + area(right_box)   * float(right_count - 1);
+            auto cost_right = area(left_box)   * float(left_count - 1) + area(whole_right) * float(right_count);
+
+            if (budget > 0 && cost_split < cost_left && cost_split < cost_right && !is_empty(l.box) && !is_empty(r.box))
+            {
+                left .push_back(l);
+                right.push_back(r);
+                left_box  = split_left;
+                right_box = split_right;
+                budget--;
+            }
+            else if (cost_left <= cost_right)
+            {
+                left.push_back(*ref);
+                left_box = whole_left;
+                right_count--;
+            }
+            else
+            {
+                right.push_back(*ref);
+                right_box = whole_right;
+                left_count--;
+            }
+        }
+
+        // 片側が空になった場合は寄せ直す.
+        if (left.empty() || right.empty())
+        {
+            auto& all = left.empty() ? right : left;
+            auto  mid = all.size() / 2;
+            std::nth_element(all.begin(), all.begin() + mid, all.end(),
+                [axis](const Reference& lhs, const Reference& rhs)
+                { return lhs.box.mini.a[axis] + lhs.box.maxi.a[axis] < rhs.box.mini.a[axis] + rhs.box.maxi.a[axis]; });
+
+            auto& other = left.empty() ? left : right;
+            other.assign(all.begin() + mid, all.end());
+            all.resize(mid);
+        }
+    }
+};
+
+} // namespace
+
+
+//-------------------------------------------------------------------------------------------------
+//      空間分割ありのSAHで2分木を構築します.
+//-------------------------------------------------------------------------------------------------
+bool build_split_tree(const std::vector<Triangle*>& tris, float budget, SplitTree& tree)
+{
+    if (tris.empty())
+    { return false; }
+
+    auto limit = size_t(float(tris.size()) * std::max(budget, 0.0f));
+
+    Builder builder(tris, tree, limit);
+    builder.build();
+
+    return true;
+}
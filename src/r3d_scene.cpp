@@ -12,6 +12,8 @@
 #include <cassert>
 #include <fstream>
 #include <map>
+#include <algorithm>
+#include <chrono>
 #include <cereal/cereal.hpp>
 #include <cereal/archives/xml.hpp>
 #include <cereal/types/vector.hpp>
@@ -179,9 +181,10 @@ struct ResSphere
 
 struct ResShapeInstance
 {
-    int     id;
-    Matrix  world;
-    int     shape_id;
+    int                 id;
+    Matrix              world;
+    int                 shape_id;
+    std::vector<Matrix> keys;       //!< カメラと同じ時間軸のキーフレーム(空なら world で固定).
 
     template<class Archive>
     void serialize(Archive& archive)
@@ -191,6 +194,12 @@ struct ResShapeInstance
             CEREAL_NVP(world),
             CEREAL_NVP(shape_id)
         );
+
+        // キーフレームの無い既存のシーンファイルも読めるように，見つからなければ固定にする.
+        try
+        { archive(CEREAL_NVP(keys)); }
+        catch(cereal::Exception&)
+        { keys.clear(); }
     }
 };
 
@@ -431,11 +440,122 @@ struct ResScene
 
         ibl_path = "HDR_041_Path.hdr";
     }
+
+    void preset_scene(Scene::Preset preset)
+    {
+        default_scene();
+
+        switch(preset)
+        {
+        case Scene::PresetCornell:
+            {
+                mesh_shapes.clear();
+            }
+            break;
+
+        case Scene::PresetInstanced:
+            {
+                // 元のメッシュの左右と奥に平行移動したインスタンスを置く.
+                const Vector3 offsets[] = {
+                    Vector3(-25.0f, 0.0f,   0.0f),
+                    Vector3( 25.0f, 0.0f,   0.0f),
+                    Vector3(-25.0f, 0.0f, -40.0f),
+                    Vector3(  0.0f, 0.0f, -40.0f),
+                    Vector3( 25.0f, 0.0f, -40.0f),
+                };
+
+                auto id = int(sphere_shapes.size() + mesh_shapes.size()) + 1;
+                for(auto& offset : offsets)
+                {
+                    ResShapeInstance instance = {};
+                    instance.id       = id++;
+                    instance.shape_id = mesh_shapes[0].id;
+                    instance.world    = Matrix(
+                        1.0f,     0.0f,     0.0f,     0.0f,
+                        0.0f,     1.0f,     0.0f,     0.0f,
+                        0.0f,     0.0f,     1.0f,     0.0f,
+                        offset.x, offset.y, offset.z, 1.0f);
+
+                    instance_shapes.push_back(instance);
+                }
+            }
+            break;
+
+        case Scene::PresetSpheres:
+            {
+                mesh_shapes.clear();
+
+                // 床の上に小さな球を格子状に並べる.
+                const int   count  = 16;
+                const float radius = 2.0f;
+                const float pitch  = 5.0f;
+
+                auto id = int(sphere_shapes.size()) + 1;
+                for(auto z=0; z<count; ++z)
+                for(auto x=0; x<count; ++x)
+                {
+                    ResSphere sphere = {};
+                    sphere.id          = id++;
+                    sphere.radius      = radius;
+                    sphere.pos         = Vector3(12.5f + pitch * x, radius, 30.0f + pitch * z);
+                    sphere.material_id = lamberts[(x + z) % 3].id;
+
+                    sphere_shapes.push_back(sphere);
+                }
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
 };
 
+//-------------------------------------------------------------------------------------------------
+//      ワールド行列のキーフレームを補間します.
+//      各軸(1～3行目)は向きと長さを分けて補間し，回転しても縮まないようにします.
+//      軸の向きは線形補間して正規化するだけなので，キー間の回転は180度未満にすること.
+//-------------------------------------------------------------------------------------------------
+Matrix interpolate(const Matrix& a, const Matrix& b, float t)
+{
+    Vector3 axis[3];
+    const Vector3 axis_a[3] = {
+        Vector3(a._11, a._12, a._13),
+        Vector3(a._21, a._22, a._23),
+        Vector3(a._31, a._32, a._33),
+    };
+    const Vector3 axis_b[3] = {
+        Vector3(b._11, b._12, b._13),
+        Vector3(b._21, b._22, b._23),
+        Vector3(b._31, b._32, b._33),
+    };
+
+    for(auto i=0; i<3; ++i)
+    {
+        axis[i] = lerp(axis_a[i], axis_b[i], t);
+
+        auto len = length(axis[i]);
+        if (len > 0.0f)
+        { axis[i] = axis[i] * (lerp(length(axis_a[i]), length(axis_b[i]), t) / len); }
+    }
+
+    auto pos = lerp(Vector3(a._41, a._42, a._43), Vector3(b._41, b._42, b._43), t);
+
+    return Matrix(
+        axis[0].x, axis[0].y, axis[0].z, 0.0f,
+        axis[1].x, axis[1].y, axis[1].z, 0.0f,
+        axis[2].x, axis[2].y, axis[2].z, 0.0f,
+        pos.x,     pos.y,     pos.z,     1.0f);
+}
+
 
 Scene::Scene()
-: m_cam(nullptr)
+: m_w         (0)
+, m_h         (0)
+, m_s         (0)
+, m_cam       (nullptr)
+, m_ibl       (nullptr)
+, m_build_time(0.0)
 { /* DO_NOTHING */ }
 
 Scene::~Scene()
@@ -450,135 +570,197 @@ bool Scene::load(const char* filename)
     if (!stream.is_open())
     { return false; }
 
+    ResScene res;
     {
-        ResScene res;
         cereal::XMLInputArchive arc(stream);
         arc(cereal::make_nvp("scene", res));
+    }
 
-        m_w = res.width;
-        m_h = res.height;
-        m_s = res.samples;
+    // シーンファイルは足りない形状があっても描画できる範囲で描画する.
+    return setup(res, false);
+}
+
+bool Scene::load(Preset preset)
+{
+    dispose();
+
+    ResScene res;
+    res.preset_scene(preset);
+
+    // プリセットは計測に使うので，形状が欠けたまま別のシーンとして計測しないように失敗させる.
+    return setup(res, true);
+}
+
+const char* Scene::preset_name(Preset preset)
+{
+    switch(preset)
+    {
+    case PresetCornell:     return "cornell";
+    case PresetMesh:        return "mesh";
+    case PresetInstanced:   return "instanced";
+    case PresetSpheres:     return "spheres";
+    default:                break;
+    }
+
+    return "unknown";
+}
+
+bool Scene::setup(const ResScene& res, bool strict)
+{
+    m_w = res.width;
+    m_h = res.height;
+    m_s = res.samples;
 
-        if (!res.textures.empty())
+    if (!res.textures.empty())
+    {
+        m_texs.resize(res.textures.size());
+        for(size_t i=0; i<m_texs.size(); ++i)
         {
-            m_texs.resize(res.textures.size());
-            for(size_t i=0; i<m_texs.size(); ++i)
+            m_texs[i] = new(std::nothrow) Texture();
+            if (!m_texs[i]->load(res.textures[i].path.c_str()))
             {
-                m_texs[i] = new(std::nothrow) Texture();
-                if (!m_texs[i]->load(res.textures[i].path.c_str()))
-                {
-                    fprintf_s(stderr, "Error : Texture Load Failed. %s\n", res.textures[i].path.c_str());
-                }
+                fprintf_s(stderr, "Error : Texture Load Failed. %s\n", res.textures[i].path.c_str());
             }
         }
+    }
 
-        std::map<int, size_t> matid_dic;
+    std::map<int, uint16_t> matid_dic;
 
-        if (!res.lamberts.empty())
+    if (!res.lamberts.empty())
+    {
+        for(size_t i=0; i<res.lamberts.size(); ++i)
         {
-            for(size_t i=0; i<res.lamberts.size(); ++i)
-            {
-                auto lambert = Lambert::create(res.lamberts[i].color, res.lamberts[i].emissive);
-                auto idx = m_mats.size();
-                m_mats.push_back(lambert);
-                matid_dic[res.lamberts[i].id] = idx;
-            }
+            auto id = m_mats.add_lambert(res.lamberts[i].color, res.lamberts[i].emissive);
+            matid_dic[res.lamberts[i].id] = id;
         }
+    }
 
-        if (!res.mirrors.empty())
+    if (!res.mirrors.empty())
+    {
+        for(size_t i=0; i<res.mirrors.size(); ++i)
         {
-            for(size_t i=0; i<res.mirrors.size(); ++i)
-            {
-                auto mirror = Mirror::create(res.mirrors[i].color, res.mirrors[i].emissive);
-                auto idx = m_mats.size();
-                m_mats.push_back(mirror);
-                matid_dic[res.mirrors[i].id] = idx;
-            }
+            auto id = m_mats.add_mirror(res.mirrors[i].color, res.mirrors[i].emissive);
+            matid_dic[res.mirrors[i].id] = id;
         }
+    }
 
-        if (!res.refracts.empty())
+    if (!res.refracts.empty())
+    {
+        for(size_t i=0; i<res.refracts.size(); ++i)
         {
-            for(size_t i=0; i<res.refracts.size(); ++i)
-            {
-                auto refract = Refract::create(res.refracts[i].color, res.refracts[i].ior, res.refracts[i].emissive);
-                auto idx = m_mats.size();
-                m_mats.push_back(refract);
-                matid_dic[res.refracts[i].id] = idx;
-            }
+            auto id = m_mats.add_refract(res.refracts[i].color, res.refracts[i].ior, res.refracts[i].emissive);
+            matid_dic[res.refracts[i].id] = id;
         }
+    }
 
-        if (!res.phongs.empty())
+    if (!res.phongs.empty())
+    {
+        for(size_t i=0; i<res.phongs.size(); ++i)
         {
-            for(size_t i=0; i<res.phongs.size(); ++i)
-            {
-                auto phong = Phong::create(res.phongs[i].color, res.phongs[i].shininess, res.phongs[i].emissive);
-                auto idx = m_mats.size();
-                matid_dic[res.phongs[i].id] = idx;
-            }
+            auto id = m_mats.add_phong(res.phongs[i].color, res.phongs[i].shininess, res.phongs[i].emissive);
+            matid_dic[res.phongs[i].id] = id;
         }
+    }
 
-        m_mats.shrink_to_fit();
+    std::map<int, size_t> shapeid_dic;
 
-        std::map<int, size_t> shapeid_dic;
+    if (!res.sphere_shapes.empty())
+    {
+        for(size_t i=0; i<res.sphere_shapes.size(); ++i)
+        {
+            auto mat = matid_dic[res.sphere_shapes[i].material_id];
+            auto shape = Sphere::create(res.sphere_shapes[i].radius, res.sphere_shapes[i].pos, mat);
+            auto id = m_objs.size();
+            m_objs.push_back(shape);
+            shapeid_dic[res.sphere_shapes[i].id] = id;
+        }
+    }
 
-        if (!res.sphere_shapes.empty())
+    if (!res.mesh_shapes.empty())
+    {
+        for(size_t i=0; i<res.mesh_shapes.size(); ++i)
         {
-            for(size_t i=0; i<res.sphere_shapes.size(); ++i)
+            auto shape = Mesh::create(res.mesh_shapes[i].path.c_str(), m_mats);
+            if (shape == nullptr)
             {
-                auto idx = matid_dic[res.sphere_shapes[i].material_id];
-                auto mat = m_mats[idx];
-                auto shape = Sphere::create(res.sphere_shapes[i].radius, res.sphere_shapes[i].pos, mat);
-                auto id = m_objs.size();
-                m_objs.push_back(shape);
-                shapeid_dic[res.sphere_shapes[i].id] = id;
+                fprintf_s(stderr, "Error : Mesh Load Failed. path = %s\n", res.mesh_shapes[i].path.c_str());
+                if (strict)
+                { return false; }
+                continue;
             }
+
+            m_build_time += shape->build_time();
+
+            auto id    = m_objs.size();
+            m_objs.push_back(shape);
+            shapeid_dic[res.mesh_shapes[i].id] = id;
+            m_meshes   [res.mesh_shapes[i].id] = shape;
         }
+    }
 
-        if (!res.mesh_shapes.empty())
+    if (!res.instance_shapes.empty())
+    {
+        for(size_t i=0; i<res.instance_shapes.size(); ++i)
         {
-            for(size_t i=0; i<res.mesh_shapes.size(); ++i)
+            auto itr = shapeid_dic.find(res.instance_shapes[i].shape_id);
+            if (itr == shapeid_dic.end())
             {
-                auto shape = Mesh::create(res.mesh_shapes[i].path.c_str());
-                auto id    = m_objs.size();
-                m_objs.push_back(shape);
-                shapeid_dic[res.mesh_shapes[i].id] = id;
+                fprintf_s(stderr, "Error : Instance Shape Not Found. id = %d, shape_id = %d\n",
+                    res.instance_shapes[i].id, res.instance_shapes[i].shape_id);
+                if (strict)
+                { return false; }
+                continue;
             }
-        }
 
-        if (!res.instance_shapes.empty())
-        {
-            for(size_t i=0; i<res.instance_shapes.size(); ++i)
+            auto idx = itr->second;
+            auto obj = m_objs[idx];
+            auto shape = ShapeInstance::create(obj, res.instance_shapes[i].world);
+            auto id = m_objs.size();
+            m_objs.push_back(shape);
+            shapeid_dic[res.instance_shapes[i].id] = id;
+            m_instances[res.instance_shapes[i].id] = shape;
+
+            if (!res.instance_shapes[i].keys.empty())
             {
-                auto idx = shapeid_dic[res.instance_shapes[i].shape_id];
-                auto obj = m_objs[idx];
-                auto shape = ShapeInstance::create(obj, res.instance_shapes[i].world);
-                auto id = m_objs.size();
-                m_objs.push_back(shape);
-                shapeid_dic[res.instance_shapes[i].id] = id;
+                InstanceKey anim;
+                anim.shape  = shape;
+                anim.worlds = res.instance_shapes[i].keys;
+                m_anims.push_back(anim);
             }
         }
+    }
 
-        m_objs.shrink_to_fit();
+    m_objs.shrink_to_fit();
 
-        if (!res.cameras.empty())
+    // 上位BVHの構築時間も含める(球だけのシーンではこれが唯一のBVHになる).
+    auto begin = std::chrono::high_resolution_clock::now();
+    m_bvh.build(m_objs);
+    auto end = std::chrono::high_resolution_clock::now();
+    m_build_time += std::chrono::duration<double>(end - begin).count();
+
+    if (!res.cameras.empty())
+    {
+        m_keys.resize(res.cameras.size());
+        for(size_t i=0; i<res.cameras.size(); ++i)
         {
-            m_cam = new (std::nothrow) Camera(
-                res.cameras[0].pos,
-                res.cameras[0].dir,
-                res.cameras[0].upward,
-                radian(res.cameras[0].fov),
-                res.cameras[0].znear,
-                float(m_w),
-                float(m_h));
+            m_keys[i].pos    = res.cameras[i].pos;
+            m_keys[i].dir    = res.cameras[i].dir;
+            m_keys[i].upward = res.cameras[i].upward;
+            m_keys[i].fov    = radian(res.cameras[i].fov);
+            m_keys[i].znear  = res.cameras[i].znear;
         }
 
-        if (!res.ibl_path.empty())
+        set_camera(0.0f);
+    }
+
+    if (!res.ibl_path.empty())
+    {
+        m_ibl = new (std::nothrow) Texture();
+        if (!m_ibl->load(res.ibl_path.c_str()))
         {
-            m_ibl = new (std::nothrow) Texture();
-            if (!m_ibl->load(res.ibl_path.c_str()))
-            {
-                fprintf_s(stderr, "Error : IBL texture load failed. path = %s\n", res.ibl_path.c_str());
-            }
+            fprintf_s(stderr, "Error : IBL texture load failed. path = %s\n", res.ibl_path.c_str());
+            delete m_ibl;
+            m_ibl = nullptr;
         }
     }
 
@@ -623,46 +805,129 @@ void Scene::dispose()
         }
     }
 
-    for(size_t i=0; i<m_mats.size(); ++i)
-    {
-        if (m_mats[i] != nullptr)
-        {
-            delete m_mats[i];
-            m_mats[i] = nullptr;
-        }
-    }
-
     if (m_cam != nullptr)
     {
         delete m_cam;
         m_cam = nullptr;
     }
 
+    if (m_ibl != nullptr)
+    {
+        delete m_ibl;
+        m_ibl = nullptr;
+    }
+
+    m_keys.clear();
+    m_anims.clear();
     m_texs.clear();
     m_objs.clear();
     m_mats.clear();
+    m_bvh.clear();
+    m_meshes.clear();
+    m_instances.clear();
 
     m_w = 0;
     m_h = 0;
     m_s = 0;
+    m_build_time = 0.0;
 }
 
 Ray Scene::emit(float x, float y) const
 { return m_cam->emit(x, y); }
 
+Ray Scene::emit(int x, int y, Sampler& sampler) const
+{ return m_cam->emit(x, y, sampler); }
+
+float Scene::depth(const Vector3& pos) const
+{ return m_cam->depth(pos); }
+
 bool Scene::hit(const Ray& ray, HitRecord& record) const
 {
     record.dist  = F_MAX;
     record.shape = nullptr;
-    record.mat   = nullptr;
+    record.mat   = MaterialTable::kDefaultId;
 
-    bool hit = false;
+    record.instance = nullptr;
 
-    for(size_t i=0; i<m_objs.size(); ++i)
-    { hit |= m_objs[i]->hit(ray, record); }
+    if (!m_bvh.intersect(ray, record))
+    { return false; }
 
-    return hit;
+    // インスタンスの法線は最も近い交差だけ変換する.
+    if (record.instance != nullptr)
+    { record.instance->resolve(record); }
+
+    return true;
+}
+
+Mesh* Scene::find_mesh(int id) const
+{
+    auto itr = m_meshes.find(id);
+    return (itr != m_meshes.end()) ? itr->second : nullptr;
+}
+
+ShapeInstance* Scene::find_instance(int id) const
+{
+    auto itr = m_instances.find(id);
+    return (itr != m_instances.end()) ? itr->second : nullptr;
+}
+
+bool Scene::refit(float threshold)
+{ return m_bvh.refit(threshold); }
+
+int Scene::key_count() const
+{
+    auto result = int(m_keys.size());
+    for(auto& anim : m_anims)
+    { result = std::max(result, int(anim.worlds.size())); }
+
+    return result;
+}
+
+void Scene::set_camera(float time)
+{
+    if (m_keys.empty())
+    { return; }
+
+    auto last  = int(m_keys.size()) - 1;
+    auto index = std::max(0, std::min(int(floor(time)), last));
+    auto next  = std::min(index + 1, last);
+    auto t     = saturate(time - float(index));
+
+    auto& a = m_keys[index];
+    auto& b = m_keys[next];
+
+    if (m_cam != nullptr)
+    { delete m_cam; }
+
+    m_cam = new (std::nothrow) Camera(
+        lerp(a.pos, b.pos, t),
+        normalize(lerp(a.dir, b.dir, t)),
+        lerp(a.upward, b.upward, t),
+        lerp(a.fov, b.fov, t),
+        lerp(a.znear, b.znear, t),
+        float(m_w),
+        float(m_h));
+}
+
+bool Scene::animate(float time)
+{
+    for(auto& anim : m_anims)
+    {
+        auto last  = int(anim.worlds.size()) - 1;
+        auto index = std::max(0, std::min(int(floor(time)), last));
+        auto next  = std::min(index + 1, last);
+        auto t     = saturate(time - float(index));
+
+        anim.shape->set_world(interpolate(anim.worlds[index], anim.worlds[next], t));
+    }
+
+    return !m_anims.empty();
 }
 
 Vector3 Scene::sample_ibl(const Vector3& dir) const
-{ return m_ibl->sample3d(dir); }
+{
+    if (m_ibl == nullptr)
+    { return Vector3(0.0f, 0.0f, 0.0f); }
+
+    return m_ibl->sample3d(dir);
+}
@@ -12,15 +12,16 @@
 #include <r3d_material.h>
 #include <r3d_bvh.h>
 #include <smd.h>
+#include <chrono>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Mesh class
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-Mesh* Mesh::create(const char* filename)
+Mesh* Mesh::create(const char* filename, MaterialTable& mats)
 {
     auto instance = new(std::nothrow) Mesh();
-    if (!instance->load(filename))
+    if (!instance->load(filename, mats))
     {
         delete instance;
         return nullptr;
@@ -31,6 +32,9 @@ Mesh* Mesh::create(const char* filename)
 
 
 Mesh::Mesh()
+: m_bvh       (nullptr)
+, m_base_cost (-1.0f)
+, m_build_time(0.0)
 { /* DO_NOTHING */ }
 
 Mesh::~Mesh()
@@ -45,7 +49,37 @@ Mesh::~Mesh()
 bool Mesh::hit(const Ray& ray, HitRecord& record) const
 { return m_bvh->intersect(ray, record); }
 
-bool Mesh::load(const char* filename)
+bool Mesh::refit(float threshold)
+{
+    m_box = Box();
+    for(auto tri : m_tris)
+    {
+        tri->update();
+        m_box.mini = min(m_box.mini, tri->box().mini);
+        m_box.maxi = max(m_box.maxi, tri->box().maxi);
+    }
+    m_box.empty = m_tris.empty();
+
+    // 更新に対応していないか，構築時より品質が落ちすぎた場合は作り直す.
+    auto cost = m_bvh->refit();
+    if (cost >= 0.0f && cost <= m_base_cost * threshold)
+    { return false; }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    // 古いBVHは三角形の並びを参照しているので，先に破棄する.
+    m_bvh->dispose();
+    m_bvh = Accelerator::build(m_tris);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    m_build_time += std::chrono::duration<double>(end - begin).count();
+
+    m_base_cost = m_bvh->refit();
+
+    return true;
+}
+
+bool Mesh::load(const char* filename, MaterialTable& mats)
 {
     FILE* file;
 
@@ -71,8 +105,9 @@ bool Mesh::load(const char* filename)
         return false;
     }
 
+    std::vector<uint16_t> mat_ids(header.MaterialCount, MaterialTable::kDefaultId);
+
     m_vtxs.resize(header.VertexCount);
-    m_mats.resize(header.MaterialCount);
     m_texs.resize(header.TextureCount);
     m_tris.resize(header.TriangleCount);
 
@@ -107,25 +142,25 @@ bool Mesh::load(const char* filename)
         {
         case SMD_MATERIAL_TYPE_LAMBERT:
             {
-                m_mats[i] = Lambert::create(mat.Color, mat.Emissive);
+                mat_ids[i] = mats.add_lambert(mat.Color, mat.Emissive);
             }
             break;
 
         case SMD_MATERIAL_TYPE_MIRROR:
             {
-                m_mats[i] = Mirror::create(mat.Color, mat.Emissive);
+                mat_ids[i] = mats.add_mirror(mat.Color, mat.Emissive);
             }
             break;
 
         case SMD_MATERIAL_TYPE_REFRACT:
             {
-                m_mats[i] = Refract::create(mat.Color, mat.Ior, mat.Emissive);
+                mat_ids[i] = mats.add_refract(mat.Color, mat.Ior, mat.Emissive);
             }
             break;
 
         case SMD_MATERIAL_TYPE_PHONG:
             {
-                m_mats[i] = Phong::create(mat.Color, mat.Shininess, mat.Emissive);
+                mat_ids[i] = mats.add_phong(mat.Color, mat.Shininess, mat.Emissive);
             }
             break;
         }
@@ -136,18 +171,25 @@ bool Mesh::load(const char* filename)
         SMD_TRIANGLE tri;
         fread(&tri, sizeof(tri), 1, file);
 
-        m_tris[i] = Triangle::create(&m_vtxs[tri.VertexOffset], m_mats[tri.MaterialId]);
+        m_tris[i] = Triangle::create(&m_vtxs[tri.VertexOffset], mat_ids[tri.MaterialId]);
+
+        m_box.mini  = min(m_box.mini, m_tris[i]->box().mini);
+        m_box.maxi  = max(m_box.maxi, m_tris[i]->box().maxi);
+        m_box.empty = false;
     }
 
     fclose(file);
 
-    #if defined(ENABLE_AVX)
-        m_bvh = BVH8::build(m_tris);
-    #elif defined(ENABLE_SSE2)
-        m_bvh = BVH4::build(m_tris);
-    #else
-        m_bvh = BVH::build(m_tris);
-    #endif
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    // CPUの対応状況に応じて BVH / BVH4 / BVH8 を選ぶ.
+    m_bvh = Accelerator::build(m_tris);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    m_build_time = std::chrono::duration<double>(end - begin).count();
+
+    // 変形前の構築直後のコストを品質監視の基準にする(頂点は動いていないので更新しても変わらない).
+    m_base_cost = m_bvh->refit();
 
     return true;
 }
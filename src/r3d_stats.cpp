@@ -0,0 +1,174 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : r3d_stats.cpp
+// Desc : Render Statistics.
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_stats.h>
+#include <cstring>
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+Stats                   g_dummy_stats;              // 登録されていないスレッド用.
+thread_local Stats*     g_local_stats = nullptr;    // スレッド毎のカウンター.
+
+} // namespace
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Stats class
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+//-------------------------------------------------------------------------------------------------
+//      コンストラクタです.
+//-------------------------------------------------------------------------------------------------
+Stats::Stats()
+{
+    for(auto i=0; i<Counter_Count; ++i)
+    { m_counters[i].store(0, std::memory_order_relaxed); }
+
+    for(auto i=0; i<kMaxDepth; ++i)
+    { m_rays[i].store(0, std::memory_order_relaxed); }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      コピーコンストラクタです.
+//-------------------------------------------------------------------------------------------------
+Stats::Stats(const Stats& value)
+{ *this = value; }
+
+//-------------------------------------------------------------------------------------------------
+//      代入演算子です.
+//-------------------------------------------------------------------------------------------------
+Stats& Stats::operator = (const Stats& value)
+{
+    for(auto i=0; i<Counter_Count; ++i)
+    { m_counters[i].store(value.m_counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+    for(auto i=0; i<kMaxDepth; ++i)
+    { m_rays[i].store(value.m_rays[i].load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+    return *this;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      他のスレッドから読み取れる値を取得します.
+//-------------------------------------------------------------------------------------------------
+void Stats::gather(Value& value) const
+{
+    for(auto i=0; i<Counter_Count; ++i)
+    { value.counters[i] = m_counters[i].load(std::memory_order_relaxed); }
+
+    for(auto i=0; i<kMaxDepth; ++i)
+    { value.rays[i] = m_rays[i].load(std::memory_order_relaxed); }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      呼び出しスレッドのカウンターを設定します.
+//-------------------------------------------------------------------------------------------------
+void Stats::bind(Stats* stats)
+{ g_local_stats = stats; }
+
+//-------------------------------------------------------------------------------------------------
+//      呼び出しスレッドのカウンターを取得します.
+//-------------------------------------------------------------------------------------------------
+Stats& Stats::local()
+{ return (g_local_stats != nullptr) ? *g_local_stats : g_dummy_stats; }
+
+//-------------------------------------------------------------------------------------------------
+//      集計値をゼロクリアします.
+//-------------------------------------------------------------------------------------------------
+void Stats::reset(Value& value)
+{ memset(&value, 0, sizeof(value)); }
+
+//-------------------------------------------------------------------------------------------------
+//      集計値を加算します.
+//-------------------------------------------------------------------------------------------------
+void Stats::accumulate(Value& value, const Value& other)
+{
+    for(auto i=0; i<Counter_Count; ++i)
+    { value.counters[i] += other.counters[i]; }
+
+    for(auto i=0; i<kMaxDepth; ++i)
+    { value.rays[i] += other.rays[i]; }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      カウンター名を取得します.
+//-------------------------------------------------------------------------------------------------
+const char* Stats::name(Counter counter)
+{
+    switch(counter)
+    {
+    case CounterRays:               return "rays";
+    case CounterNodes:              return "nodes";
+    case CounterBoxTests:           return "box_tests";
+    case CounterTriangleTests:      return "triangle_tests";
+    case CounterSphereTests:        return "sphere_tests";
+    case CounterRussianRoulette:    return "russian_roulette";
+    case CounterSamples:            return "samples";
+    default:                        break;
+    }
+
+    return "unknown";
+}
+
+//-------------------------------------------------------------------------------------------------
+//      集計値を表示します.
+//-------------------------------------------------------------------------------------------------
+void Stats::print(const Value& value, double sec)
+{
+    auto rays  = double(value.counters[CounterRays]);
+    auto scale = (sec > 0.0) ? 1e-6 / sec : 0.0;
+
+    printf_s("* rays     : %.2f(Mrays/sec)\n", rays * scale);
+
+#if defined(ENABLE_STATS)
+    // レイ1本当たりの平均値.
+    auto inv = (rays > 0.0) ? 1.0 / rays : 0.0;
+    printf_s("* traverse : %.2f nodes, %.2f boxes, %.2f triangles, %.2f spheres (per ray)\n",
+        double(value.counters[CounterNodes])         * inv,
+        double(value.counters[CounterBoxTests])      * inv,
+        double(value.counters[CounterTriangleTests]) * inv,
+        double(value.counters[CounterSphereTests])   * inv);
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+//      集計値をJSON形式で書き出します.
+//-------------------------------------------------------------------------------------------------
+bool Stats::write_json(FILE* fp, const Value& value, double sec)
+{
+    if (fp == nullptr)
+    { return false; }
+
+    auto rays = double(value.counters[CounterRays]);
+
+    fprintf_s(fp, "{\n");
+    fprintf_s(fp, "  \"time\": %.3f,\n", sec);
+    fprintf_s(fp, "  \"mrays_per_sec\": %.3f,\n", (sec > 0.0) ? rays * 1e-6 / sec : 0.0);
+#if defined(ENABLE_STATS)
+    fprintf_s(fp, "  \"traversal_stats\": true,\n");
+#else
+    fprintf_s(fp, "  \"traversal_stats\": false,\n");
+#endif
+
+    for(auto i=0; i<Counter_Count; ++i)
+    { fprintf_s(fp, "  \"%s\": %llu,\n", name(Counter(i)), static_cast<unsigned long long>(value.counters[i])); }
+
+    fprintf_s(fp, "  \"rays_per_depth\": [");
+    for(auto i=0; i<kMaxDepth; ++i)
+    { fprintf_s(fp, "%s%llu", (i == 0) ? "" : ", ", static_cast<unsigned long long>(value.rays[i])); }
+    fprintf_s(fp, "]\n");
+
+    fprintf_s(fp, "}\n");
+
+    return ferror(fp) == 0;
+}
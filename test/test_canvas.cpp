@@ -0,0 +1,217 @@
+﻿//-------------------------------------------------------------------------------------------------
+// File : test_canvas.cpp
+// Desc : Canvas output processing test (approximation vs reference).
+// Copyright(c) Project Asura. All right reserved.
+//-------------------------------------------------------------------------------------------------
+
+//-------------------------------------------------------------------------------------------------
+// Includes
+//-------------------------------------------------------------------------------------------------
+#include <r3d_canvas.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+
+namespace {
+
+//-------------------------------------------------------------------------------------------------
+// Constant Values.
+//-------------------------------------------------------------------------------------------------
+constexpr int   kWidth          = 67;       //!< SIMDの端数処理も通るように4の倍数にしない.
+constexpr int   kHeight         = 37;       //!< 行ブロックの端数処理も通るように半端にする.
+constexpr float kMinExponent    = -4.0f;    //!< 入力の最小値(10の冪).
+constexpr float kMaxExponent    = 4.0f;     //!< 入力の最大値(10の冪).
+constexpr float kLogAveTolerance = 1e-4f;   //!< 対数平均の許容相対誤差です.
+constexpr float kMaxTolerance    = 1e-6f;   //!< 最大輝度値の許容相対誤差です.
+constexpr float kTolerance       = 1e-4f;   //!< 各画素の許容誤差です(1未満は絶対誤差，1以上は相対誤差).
+constexpr int   kQuantizeTolerance = 1;     //!< 8bit量子化後の許容誤差です[LSB].
+
+//-------------------------------------------------------------------------------------------------
+// Global Varaibles.
+//-------------------------------------------------------------------------------------------------
+int g_failed = 0;   //!< 失敗したテストの数です.
+
+//-------------------------------------------------------------------------------------------------
+//      HDR のテスト画像を作ります.
+//-------------------------------------------------------------------------------------------------
+std::vector<Vector3> make_pixels()
+{
+    std::vector<Vector3> pixels(kWidth * kHeight);
+
+    // 再現性のために固定シードの線形合同法を使う.
+    uint32_t seed = 123456789u;
+    auto next = [&]()
+    {
+        seed = seed * 1664525u + 1013904223u;
+        return float(seed >> 8) / float(1 << 24);
+    };
+
+    auto value = [&]()
+    {
+        auto r = next();
+
+        // 0 と sRGB の線形区間の境界付近も含める.
+        if (r < 0.05f)
+        { return 0.0f; }
+        if (r < 0.10f)
+        { return 0.0031308f * (0.5f + next()); }
+
+        return powf(10.0f, kMinExponent + (kMaxExponent - kMinExponent) * next());
+    };
+
+    for(auto& p : pixels)
+    { p = Vector3(value(), value(), value()); }
+
+    return pixels;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      誤差を求めます(1未満は絶対誤差，1以上は相対誤差).
+//-------------------------------------------------------------------------------------------------
+float calc_error(float value, float expected)
+{ return fabsf(value - expected) / std::max(1.0f, fabsf(expected)); }
+
+//-------------------------------------------------------------------------------------------------
+//      結果を表示します.
+//-------------------------------------------------------------------------------------------------
+void report(const char* name, double error, double tolerance)
+{
+    auto pass = (error <= tolerance);
+    printf_s("%-5s %-20s error = %.3e (tolerance = %.1e)\n", pass ? "PASS" : "FAIL", name, error, tolerance);
+
+    if (!pass)
+    { g_failed++; }
+}
+
+//-------------------------------------------------------------------------------------------------
+//      近似版と参照実装の画素を比較します.
+//-------------------------------------------------------------------------------------------------
+float compare(const std::vector<Vector3>& value, const std::vector<Vector3>& expected)
+{
+    auto result = 0.0f;
+    for(size_t i=0; i<value.size(); ++i)
+    {
+        result = std::max(result, calc_error(value[i].x, expected[i].x));
+        result = std::max(result, calc_error(value[i].y, expected[i].y));
+        result = std::max(result, calc_error(value[i].z, expected[i].z));
+    }
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+//      画像処理を近似版と参照実装の両方で行い比較します.
+//-------------------------------------------------------------------------------------------------
+template<typename Func>
+void test_process(const char* name, Canvas& fast, Canvas& exact, Func func)
+{
+    auto value    = make_pixels();
+    auto expected = value;
+
+    func(fast,  value);
+    func(exact, expected);
+
+    report(name, compare(value, expected), kTolerance);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      対数平均と最大輝度値を比較します.
+//-------------------------------------------------------------------------------------------------
+void test_log_average(Canvas& fast, Canvas& exact)
+{
+    auto pixels = make_pixels();
+
+    float aveLw[2] = {};
+    float maxLw[2] = {};
+    fast .log_average(pixels, aveLw[0], maxLw[0]);
+    exact.log_average(pixels, aveLw[1], maxLw[1]);
+
+    report("log_average (ave)", fabs(aveLw[0] - aveLw[1]) / aveLw[1], kLogAveTolerance);
+    report("log_average (max)", fabs(maxLw[0] - maxLw[1]) / maxLw[1], kMaxTolerance);
+}
+
+//-------------------------------------------------------------------------------------------------
+//      8bit量子化を比較します.
+//-------------------------------------------------------------------------------------------------
+void test_quantize(Canvas& fast, Canvas& exact)
+{
+    // SIMD版とスカラー版は同じ入力に対して一致しなければならない.
+    {
+        auto pixels = make_pixels();
+        for(auto& p : pixels)
+        { p = Vector3(p.x / (1.0f + p.x), p.y / (1.0f + p.y), p.z / (1.0f + p.z)); }
+
+        std::vector<uint8_t> value;
+        std::vector<uint8_t> expected;
+        fast .quantize(pixels, value);
+        exact.quantize(pixels, expected);
+
+        auto error = 0;
+        for(size_t i=0; i<value.size(); ++i)
+        { error = std::max(error, abs(int(value[i]) - int(expected[i]))); }
+
+        report("quantize", error, 0);
+    }
+
+    // 出力パイプライン全体(ACES + sRGB + 量子化)では1段階までの違いを許す.
+    {
+        auto value    = make_pixels();
+        auto expected = value;
+
+        std::vector<uint8_t> output[2];
+        Canvas* canvas[2] = { &fast, &exact };
+        std::vector<Vector3>* pixels[2] = { &value, &expected };
+        for(auto i=0; i<2; ++i)
+        {
+            canvas[i]->tonemap_aces(*pixels[i]);
+            canvas[i]->srgb_correction(*pixels[i]);
+            canvas[i]->quantize(*pixels[i], output[i]);
+        }
+
+        auto error = 0;
+        for(size_t i=0; i<output[0].size(); ++i)
+        { error = std::max(error, abs(int(output[0][i]) - int(output[1][i]))); }
+
+        report("aces + srgb + quantize", error, kQuantizeTolerance);
+    }
+}
+
+} // namespace
+
+
+//-------------------------------------------------------------------------------------------------
+//      メインエントリーポイントです.
+//-------------------------------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    Canvas fast;
+    Canvas exact;
+    fast .resize(kWidth, kHeight);
+    exact.resize(kWidth, kHeight);
+    exact.set_exact(true);
+
+    test_log_average(fast, exact);
+
+    test_process("tonemap_reinhard", fast, exact, [](Canvas& canvas, std::vector<Vector3>& pixels)
+    { canvas.tonemap_reinhard(pixels); });
+
+    test_process("tonemap_aces", fast, exact, [](Canvas& canvas, std::vector<Vector3>& pixels)
+    { canvas.tonemap_aces(pixels); });
+
+    test_process("gamma_correction", fast, exact, [](Canvas& canvas, std::vector<Vector3>& pixels)
+    { canvas.gamma_correction(pixels); });
+
+    test_process("srgb_correction", fast, exact, [](Canvas& canvas, std::vector<Vector3>& pixels)
+    { canvas.srgb_correction(pixels); });
+
+    test_quantize(fast, exact);
+
+    if (g_failed > 0)
+    {
+        fprintf_s(stderr, "Error : %d test(s) failed.\n", g_failed);
+        return -1;
+    }
+
+    return 0;
+}
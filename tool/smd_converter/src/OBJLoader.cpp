@@ -138,23 +138,18 @@ OBJVEC3 Vec3SafeNormalize( const OBJVEC3& v )
 // Name : GetDirectionPath()
 // Desc : 文字列からディレクトリを取得
 //------------------------------------------------------------------------
-const char* GetDirectoryPath( const char* filename )
+std::string GetDirectoryPath( const char* filename )
 {
     std::string temp(filename);
 
-    auto pos = temp.find_last_of("\\");
-    if (pos != std::string::npos)
-    {
-        return temp.substr(0, pos).c_str();
-    }
-
-    pos = temp.find_last_of("/");
+    // 区切り文字まで含めて返す(一時オブジェクトのポインタを返さないように文字列で返す).
+    auto pos = temp.find_last_of("\\/");
     if (pos != std::string::npos)
     {
-        return temp.substr(0, pos).c_str();
+        return temp.substr(0, pos + 1);
     }
 
-    return kEmpty;
+    return std::string(kEmpty);
 }
 
 //-----------------------------------------------------------------------
@@ -184,14 +179,11 @@ const char* CutDirectoryPath( const char* filename )
 // Name : SetDirectoryPath
 // Desc : ディレクトリを前に付加して文字列を返す
 //-----------------------------------------------------------------------
-const char* SetDirectoryPath( char* dest, char* directory )
+std::string SetDirectoryPath( const char* dest, const char* directory )
 {
-    if (strlen(directory) == 0)
-    { return dest; }
-
     std::string temp(directory);
     temp += dest;
-    return temp.c_str();
+    return temp;
 }
 
 //-----------------------------------------------------------------------
@@ -200,7 +192,8 @@ const char* SetDirectoryPath( char* dest, char* directory )
 //-----------------------------------------------------------------------
 void InitMaterial( OBJMATERIAL* pMaterial )
 {
-    memset( pMaterial, 0, sizeof( OBJMATERIAL ) );
+    // 文字列バッファも含めてゼロクリアする(コンストラクタは何もしないので memset で良い).
+    memset( static_cast<void*>( pMaterial ), 0, sizeof( OBJMATERIAL ) );
     pMaterial->ambient   = OBJVEC3( 0.2f, 0.2f, 0.2f );
     pMaterial->diffuse   = OBJVEC3( 0.8f, 0.8f, 0.8f );
     pMaterial->specular  = OBJVEC3( 1.0f, 1.0f, 1.0f );
@@ -327,7 +320,7 @@ OBJVEC3::operator const float *() const
 // Desc : コンストラクタ
 //-----------------------------------------------------------------------
 OBJBOUNDINGBOX::OBJBOUNDINGBOX( OBJVEC3 value )
-: minimum( value ), maximum( value )
+: maximum( value ), minimum( value )
 {
 }
 
@@ -436,15 +429,13 @@ bool OBJMESH::LoadOBJFile(const char *filename)
     bool initBox = false;
     int prevSize = 0;
 
-    unsigned long total = 0;
-
     OBJMATERIAL  material;
     uint32_t dwFaceIndex = 0;
     uint32_t dwFaceCount = 0;
     uint32_t dwCurSubset = 0;
 
     //　ディレクトリを切り取り
-    strcpy_s( m_directoryPath, GetDirectoryPath( filename ) );
+    strcpy_s( m_directoryPath, GetDirectoryPath( filename ).c_str() );
 
     //　ファイルを開く
     file.open( filename, ios::in );
@@ -535,7 +526,7 @@ bool OBJMESH::LoadOBJFile(const char *filename)
             for ( int iFace = 0; iFace < 4; iFace++ )
             {
                 count++;    //　頂点数を数える
-                memset( &vertex, 0, sizeof( OBJVERTEX ) );
+                vertex = OBJVERTEX();
 
                 file >> iPosition;
                 vertex.position = positions[ iPosition - 1 ];
@@ -592,11 +583,11 @@ bool OBJMESH::LoadOBJFile(const char *filename)
                 for ( int iFace = 1; iFace < 4; iFace++ )
                 {
                     int j = (iFace+1)%4;
-                    memset( &vertex, 0, sizeof( OBJVERTEX ) );
+                    vertex = OBJVERTEX();
 
-                    if ( p[j] != -1 ) vertex.position = positions[ p[j] ];
-                    if ( t[j] != -1 ) vertex.texcoord = texcoords[ t[j] ];
-                    if ( n[j] != -1 ) vertex.normal   = normals[ n[j] ];
+                    if ( p[j] != UINT32_MAX ) vertex.position = positions[ p[j] ];
+                    if ( t[j] != UINT32_MAX ) vertex.texcoord = texcoords[ t[j] ];
+                    if ( n[j] != UINT32_MAX ) vertex.normal   = normals[ n[j] ];
 
                     t_vertices.push_back( vertex );
                     index = t_vertices.size() - 1;
@@ -613,7 +604,7 @@ bool OBJMESH::LoadOBJFile(const char *filename)
             //　マテリアルファイルの読み込み
             if ( mtlFileName[0] )
             {
-                if ( !LoadMTLFile( SetDirectoryPath(mtlFileName, m_directoryPath) ) )
+                if ( !LoadMTLFile( SetDirectoryPath(mtlFileName, m_directoryPath).c_str() ) )
                 {
                     cerr << "Error : マテリアルのロードに失敗\n";
                     return false;
@@ -1331,9 +1322,6 @@ void OBJMESH::WriteDirect( FILE* pFile )
             // 頂点インデックスを算出.
             uint32_t idx = m_Subsets[i].faceStart + j;
 
-            // 格納用三角形データです.
-            SMD_TRIANGLE triangle;
-
             // 頂点データを設定します.
             for (size_t k = 0; k < 3; ++k)
             {
@@ -1411,7 +1399,6 @@ void OBJMESH::WriteDirect( FILE* pFile )
         fwrite( &mat, sizeof(mat), 1, pFile );
     }
 
-    uint32_t idx = 0;
     // サブセットをデータを書き込み.
     for (size_t i = 0; i<m_NumSubsets; ++i)
     {
@@ -8,6 +8,7 @@
 //-----------------------------------------------------------------------------------------
 // Includes
 //-----------------------------------------------------------------------------------------
+#include <r3d_platform.h>
 #include <cstdio>
 #include <map>
 #include <string>